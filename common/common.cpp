@@ -190,6 +190,97 @@ int32_t cpu_get_num_math() {
     return cpu_get_num_physical_cores();
 }
 
+bool cpu_get_physical_core_mask(bool (&mask)[GGML_MAX_N_THREADS]) {
+    bool cores[GGML_MAX_N_THREADS] = {false};
+
+    int n_set = 0;
+#ifdef __linux__
+    // keep the first thread of each core
+    for (int cpu = 0; cpu < GGML_MAX_N_THREADS; ++cpu) {
+        std::ifstream siblings("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list");
+        int first = -1;
+        if (siblings.is_open() && (siblings >> first) && first == cpu) {
+            cores[cpu] = true;
+            n_set++;
+        }
+    }
+#if defined(__x86_64__) && !defined(__ANDROID__)
+    if (n_set > 0 && is_hybrid_cpu()) {
+        cpu_set_t affinity;
+        if (!pthread_getaffinity_np(pthread_self(), sizeof(affinity), &affinity)) {
+            for (int cpu = 0; cpu < GGML_MAX_N_THREADS; ++cpu) {
+                if (!cores[cpu] || pin_cpu(cpu)) {
+                    continue;
+                }
+                if (is_running_on_efficiency_core()) {
+                    cores[cpu] = false; // efficiency cores harm lockstep threading
+                    n_set--;
+                }
+            }
+            pthread_setaffinity_np(pthread_self(), sizeof(affinity), &affinity);
+        }
+    }
+#endif
+#endif
+    for (int cpu = 0; cpu < GGML_MAX_N_THREADS; ++cpu) {
+        mask[cpu] = mask[cpu] || cores[cpu];
+    }
+
+    return n_set > 0;
+}
+
+bool parse_cpu_range(const std::string & range, bool (&mask)[GGML_MAX_N_THREADS]) {
+    const size_t dash = range.find('-');
+    if (dash == std::string::npos) {
+        return false;
+    }
+
+    try {
+        const int start = dash == 0                ? 0                      : std::stoi(range.substr(0, dash));
+        const int end   = dash == range.size() - 1 ? GGML_MAX_N_THREADS - 1 : std::stoi(range.substr(dash + 1));
+        if (start < 0 || start > end || end >= GGML_MAX_N_THREADS) {
+            return false;
+        }
+        for (int i = start; i <= end; i++) {
+            mask[i] = true;
+        }
+    } catch (const std::exception &) {
+        return false;
+    }
+
+    return true;
+}
+
+bool parse_cpu_mask(const std::string & hex, bool (&mask)[GGML_MAX_N_THREADS]) {
+    size_t start = 0;
+    if (hex.size() > 2 && hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X')) {
+        start = 2;
+    }
+
+    // the last digit holds CPUs 0-3
+    const size_t n_digits = hex.size() - start;
+    if (n_digits == 0 || n_digits*4 > GGML_MAX_N_THREADS) {
+        return false;
+    }
+
+    for (size_t i = 0; i < n_digits; i++) {
+        const char c = hex[hex.size() - 1 - i];
+        int v;
+        if      (c >= '0' && c <= '9') { v = c - '0'; }
+        else if (c >= 'a' && c <= 'f') { v = c - 'a' + 10; }
+        else if (c >= 'A' && c <= 'F') { v = c - 'A' + 10; }
+        else { return false; }
+
+        for (int b = 0; b < 4; b++) {
+            if (v & (1 << b)) {
+                mask[4*i + b] = true;
+            }
+        }
+    }
+
+    return true;
+}
+
 //
 // CLI argument parsing
 //
@@ -905,6 +996,46 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         else { invalid_param = true; }
         return true;
     }
+    if (arg == "-C" || arg == "--cpu-mask") {
+        CHECK_ARG
+        if (!parse_cpu_mask(argv[i], params.cpumask)) {
+            invalid_param = true;
+        }
+        return true;
+    }
+    if (arg == "-Cr" || arg == "--cpu-range") {
+        CHECK_ARG
+        if (!parse_cpu_range(argv[i], params.cpumask)) {
+            invalid_param = true;
+        }
+        return true;
+    }
+    if (arg == "--cpu-physical") {
+        if (!cpu_get_physical_core_mask(params.cpumask)) {
+            fprintf(stderr, "warning: the physical cores could not be determined, --cpu-physical is ignored\n");
+        }
+        return true;
+    }
+    if (arg == "--cpu-strict") {
+        CHECK_ARG
+        params.cpu_strict = std::stoi(argv[i]) != 0;
+        return true;
+    }
+    if (arg == "--prio") {
+        CHECK_ARG
+        const int prio = std::stoi(argv[i]);
+        if (prio < GGML_SCHED_PRIO_NORMAL || prio > GGML_SCHED_PRIO_REALTIME) {
+            invalid_param = true;
+            return true;
+        }
+        params.cpu_prio = (enum ggml_sched_priority) prio;
+        return true;
+    }
+    if (arg == "--poll") {
+        CHECK_ARG
+        params.cpu_poll = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "-v" || arg == "--verbose") {
         params.verbosity = 1;
         return true;
@@ -974,6 +1105,10 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.check_tensors = true;
         return true;
     }
+    if (arg == "--repack") {
+        params.repack_tensors = true;
+        return true;
+    }
     if (arg == "--hellaswag") {
         params.hellaswag = true;
         return true;
@@ -1561,6 +1696,12 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
                                                                         "  - numactl: use the CPU map provided by numactl\n"
                                                                         "if run without this previously, it is recommended to drop the system page cache before using this\n"
                                                                         "see https://github.com/ggerganov/llama.cpp/issues/1437" });
+    options.push_back({ "*",           "-C,    --cpu-mask M",           "CPU affinity mask of the compute threads as a hex number, complements --cpu-range" });
+    options.push_back({ "*",           "-Cr,   --cpu-range lo-hi",      "range of CPUs for the compute threads, complements --cpu-mask" });
+    options.push_back({ "*",           "       --cpu-physical",         "use one CPU per physical core: no SMT siblings and no efficiency cores" });
+    options.push_back({ "*",           "       --cpu-strict <0|1>",     "pin each compute thread to its own CPU of the mask (default: %d)", (int) params.cpu_strict });
+    options.push_back({ "*",           "       --prio N",               "compute thread priority: 0-normal, 1-medium, 2-high, 3-realtime (default: %d)", (int) params.cpu_prio });
+    options.push_back({ "*",           "       --poll N",               "polling iterations before idle compute threads sleep (default: ggml default)" });
 
     if (llama_supports_gpu_offload()) {
         options.push_back({ "*",           "-ngl,  --gpu-layers N",
@@ -1580,6 +1721,7 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
 
     options.push_back({ "model" });
     options.push_back({ "*",           "       --check-tensors",        "check model tensor data for invalid values (default: %s)", params.check_tensors ? "true" : "false" });
+    options.push_back({ "*",           "       --repack",               "repack Q4_0 weights into the interleaved layout of the CPU at load time, disables mmap (default: %s)", params.repack_tensors ? "true" : "false" });
     options.push_back({ "*",           "       --override-kv KEY=TYPE:VALUE",
                                                                         "advanced option to override model metadata by key. may be specified multiple times.\n"
                                                                         "types: int, float, bool, str. example: --override-kv tokenizer.ggml.add_bos_token=bool:false" });
@@ -2144,6 +2286,7 @@ struct llama_model_params llama_model_params_from_gpt_params(const gpt_params &
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
     mparams.check_tensors   = params.check_tensors;
+    mparams.repack_tensors  = params.repack_tensors;
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
     } else {
@@ -2183,6 +2326,33 @@ static ggml_type kv_cache_type_from_str(const std::string & s) {
     throw std::runtime_error("Invalid cache type: " + s);
 }
 
+struct ggml_threadpool_params ggml_threadpool_params_from_gpt_params(const gpt_params & params, int32_t n_threads) {
+    struct ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+
+    std::copy(std::begin(params.cpumask), std::end(params.cpumask), tpp.cpumask);
+    tpp.strict_cpu = params.cpu_strict;
+    tpp.prio       = params.cpu_prio;
+    if (params.cpu_poll >= 0) {
+        tpp.n_spin = params.cpu_poll;
+    }
+
+    return tpp;
+}
+
+struct ggml_threadpool * gpt_threadpool_new(const gpt_params & params, int32_t n_threads) {
+    const bool placement =
+        std::any_of(std::begin(params.cpumask), std::end(params.cpumask), [](bool b) { return b; }) ||
+        params.cpu_strict || params.cpu_prio != GGML_SCHED_PRIO_NORMAL || params.cpu_poll >= 0;
+
+    if (n_threads <= 0 || (ggml_cpu_has_openmp() && !placement)) {
+        return nullptr;
+    }
+
+    const struct ggml_threadpool_params tpp = ggml_threadpool_params_from_gpt_params(params, n_threads);
+
+    return ggml_threadpool_new(&tpp);
+}
+
 struct llama_context_params llama_context_params_from_gpt_params(const gpt_params & params) {
     auto cparams = llama_context_default_params();
 
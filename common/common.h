@@ -48,6 +48,11 @@ struct llama_control_vector_load_info;
 int32_t cpu_get_num_physical_cores();
 int32_t cpu_get_num_math();
 
+// CPU masks for ggml_threadpool_params.cpumask, the parsers add to the existing mask
+bool cpu_get_physical_core_mask(bool (&mask)[GGML_MAX_N_THREADS]);                 // one CPU per physical core, no efficiency cores
+bool parse_cpu_range(const std::string & range, bool (&mask)[GGML_MAX_N_THREADS]); // "lo-hi", either end may be omitted
+bool parse_cpu_mask (const std::string & hex,   bool (&mask)[GGML_MAX_N_THREADS]); // hex, bit i is CPU i
+
 //
 // CLI argument parsing
 //
@@ -96,6 +101,12 @@ struct gpt_params {
 
     ggml_numa_strategy numa = GGML_NUMA_STRATEGY_DISABLED;
 
+    // placement of the CPU compute threads, applied through a ggml_threadpool
+    bool                     cpumask[GGML_MAX_N_THREADS] = {false};                 // CPU affinity mask (all false = inherited affinity)
+    bool                     cpu_strict                  = false;                   // pin each thread to its own CPU of the mask
+    int32_t                  cpu_poll                    = -1;                      // polling iterations before idle threads sleep (-1 = ggml default)
+    enum ggml_sched_priority cpu_prio                    = GGML_SCHED_PRIO_NORMAL;  // scheduling priority of the compute threads
+
     enum llama_split_mode        split_mode        = LLAMA_SPLIT_MODE_LAYER; // how to split the model across GPUs
     enum llama_rope_scaling_type rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED;
     enum llama_pooling_type      pooling_type      = LLAMA_POOLING_TYPE_UNSPECIFIED; // pooling type for embeddings
@@ -178,6 +189,7 @@ struct gpt_params {
     bool no_kv_offload     = false; // disable KV offloading
     bool warmup            = true;  // warmup run
     bool check_tensors     = false; // validate tensor data
+    bool repack_tensors    = false; // repack Q4_0 weights for the CPU
 
     std::string cache_type_k = "f16"; // KV cache data type for the K
     std::string cache_type_v = "f16"; // KV cache data type for the V
@@ -313,6 +325,11 @@ std::tuple<struct llama_model *, struct llama_context *> llama_init_from_gpt_par
 struct llama_model_params   llama_model_params_from_gpt_params  (const gpt_params & params);
 struct llama_context_params llama_context_params_from_gpt_params(const gpt_params & params);
 
+struct ggml_threadpool_params ggml_threadpool_params_from_gpt_params(const gpt_params & params, int32_t n_threads);
+
+// returns nullptr when no pool is needed: OpenMP already keeps its threads and no placement was requested
+struct ggml_threadpool * gpt_threadpool_new(const gpt_params & params, int32_t n_threads);
+
 struct llama_model * llama_load_model_from_url(const char * model_url, const char * path_model, const char * hf_token, const struct llama_model_params & params);
 struct llama_model * llama_load_model_from_hf(const char * repo, const char * file, const char * path_model, const char * hf_token, const struct llama_model_params & params);
 
@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+# Convert a whisper model from the legacy ggml format (ggml-*.bin) to GGUF
+#
+# The hparams are stored as "whisper.*" keys, the vocab as "tokenizer.ggml.tokens" (GPT-2 byte-to-unicode encoded)
+# and the pre-computed mel filters as the "mel_filters" tensor. The weights keep their names and types.
+#
+# Usage:
+#
+#   python3 convert_whisper_ggml_to_gguf.py -i models/ggml-base.en.bin -o models/ggml-base.en.gguf
+#
+from __future__ import annotations
+
+import logging
+import argparse
+import os
+import struct
+import sys
+from pathlib import Path
+
+import numpy as np
+
+if 'NO_LOCAL_GGUF' not in os.environ:
+    sys.path.insert(1, str(Path(__file__).parent / 'gguf-py'))
+import gguf
+
+logger = logging.getLogger("whisper-ggml-to-gguf")
+
+GGML_FILE_MAGIC = 0x67676d6c
+GGML_QNT_VERSION_FACTOR = 1000
+
+
+def bytes_to_unicode() -> dict[int, str]:
+    # same mapping as the GPT-2 tokenizer
+    bs = list(range(ord("!"), ord("~") + 1)) + list(range(ord("¡"), ord("¬") + 1)) + list(range(ord("®"), ord("ÿ") + 1))
+    cs = bs[:]
+    n = 0
+    for b in range(2**8):
+        if b not in bs:
+            bs.append(b)
+            cs.append(2**8 + n)
+            n += 1
+    return dict(zip(bs, (chr(c) for c in cs)))
+
+
+class WhisperGGMLModel:
+    HPARAMS = ['n_vocab', 'n_audio_ctx', 'n_audio_state', 'n_audio_head', 'n_audio_layer',
+               'n_text_ctx', 'n_text_state', 'n_text_head', 'n_text_layer', 'n_mels', 'ftype']
+
+    def __init__(self, data: np.memmap):
+        self.data = data
+        self.offset = 0
+
+    def read(self, fmt: str):
+        n = struct.calcsize(fmt)
+        vals = struct.unpack_from(fmt, self.data, self.offset)
+        self.offset += n
+        return vals
+
+    def load(self):
+        magic, = self.read('<I')
+        if magic != GGML_FILE_MAGIC:
+            raise ValueError(f'invalid model file (bad magic {magic:#x})')
+
+        self.hparams = dict(zip(self.HPARAMS, self.read('<11i')))
+
+        n_mel, n_fft = self.read('<2i')
+        self.mel_filters = np.frombuffer(self.data, dtype = np.float32, count = n_mel * n_fft, offset = self.offset).reshape(n_mel, n_fft)
+        self.offset += n_mel * n_fft * 4
+
+        n_vocab, = self.read('<i')
+        self.tokens = []
+        for _ in range(n_vocab):
+            n, = self.read('<I')
+            self.tokens.append(bytes(self.data[self.offset:self.offset + n]))
+            self.offset += n
+
+        self.tensors = []
+        while self.offset < len(self.data):
+            n_dims, length, ttype = self.read('<3i')
+            ne = self.read(f'<{n_dims}i')
+            name = bytes(self.data[self.offset:self.offset + length]).decode('utf-8')
+            self.offset += length
+
+            dtype = gguf.GGMLQuantizationType(ttype)
+            block_size, type_size = gguf.GGML_QUANT_SIZES[dtype]
+            n_bytes = int(np.prod(ne)) // block_size * type_size
+
+            self.tensors.append((name, ne, dtype, self.offset, n_bytes))
+            self.offset += n_bytes
+
+
+def convert(model: WhisperGGMLModel, cfg: argparse.Namespace) -> None:
+    hp = model.hparams
+
+    writer = gguf.GGUFWriter(cfg.output, 'whisper', use_temp_file = False)
+
+    if cfg.name is not None:
+        writer.add_name(cfg.name)
+    writer.add_description(cfg.desc if cfg.desc is not None else 'converted from legacy whisper ggml format')
+
+    writer.add_uint32('whisper.vocab_size',                 hp['n_vocab'])
+    writer.add_uint32('whisper.audio.context_length',       hp['n_audio_ctx'])
+    writer.add_uint32('whisper.audio.embedding_length',     hp['n_audio_state'])
+    writer.add_uint32('whisper.audio.attention.head_count', hp['n_audio_head'])
+    writer.add_uint32('whisper.audio.block_count',          hp['n_audio_layer'])
+    writer.add_uint32('whisper.text.context_length',        hp['n_text_ctx'])
+    writer.add_uint32('whisper.text.embedding_length',      hp['n_text_state'])
+    writer.add_uint32('whisper.text.attention.head_count',  hp['n_text_head'])
+    writer.add_uint32('whisper.text.block_count',           hp['n_text_layer'])
+    writer.add_uint32('whisper.mel_count',                  hp['n_mels'])
+    writer.add_file_type(hp['ftype'] % GGML_QNT_VERSION_FACTOR)
+    writer.add_quantization_version(hp['ftype'] // GGML_QNT_VERSION_FACTOR)
+
+    byte_encoder = bytes_to_unicode()
+    writer.add_tokenizer_model('gpt2')
+    writer.add_token_list([''.join(byte_encoder[b] for b in token) for token in model.tokens])
+
+    writer.add_tensor('mel_filters', np.array(model.mel_filters))
+
+    logger.info(f'* Adding {len(model.tensors)} tensor(s)')
+    for name, ne, dtype, offset, n_bytes in model.tensors:
+        data = model.data[offset:offset + n_bytes]
+        shape = list(reversed(ne))
+        if dtype == gguf.GGMLQuantizationType.F32:
+            writer.add_tensor(name, data.view(np.float32).reshape(shape))
+        elif dtype == gguf.GGMLQuantizationType.F16:
+            writer.add_tensor(name, data.view(np.float16).reshape(shape))
+        else:
+            # byte shape: the innermost dimension is given in bytes
+            block_size, type_size = gguf.GGML_QUANT_SIZES[dtype]
+            shape[-1] = shape[-1] // block_size * type_size
+            writer.add_tensor(name, data.reshape(shape), raw_dtype = dtype)
+
+    writer.write_header_to_file()
+    writer.write_kv_data_to_file()
+    writer.write_tensors_to_file()
+    writer.close()
+
+
+def handle_args():
+    parser = argparse.ArgumentParser(description = 'Convert whisper ggml models to GGUF')
+    parser.add_argument('--input', '-i', type = Path, required = True,
+                        help = 'Input whisper ggml filename')
+    parser.add_argument('--output', '-o', type = Path, required = True,
+                        help = 'Output GGUF filename')
+    parser.add_argument('--name',
+                        help = 'Set model name')
+    parser.add_argument('--desc',
+                        help = 'Set model description')
+    parser.add_argument("--verbose", action="store_true", help="increase output verbosity")
+    return parser.parse_args()
+
+
+def main():
+    cfg = handle_args()
+    logging.basicConfig(level=logging.DEBUG if cfg.verbose else logging.INFO)
+    data = np.memmap(cfg.input, mode = 'r')
+    model = WhisperGGMLModel(data)
+    logger.info('* Scanning whisper ggml input file')
+    model.load()
+    logger.info(f'* Hyperparameters: {model.hparams}')
+    convert(model, cfg)
+    logger.info(f'* Successful completion. Output saved to: {cfg.output}')
+
+
+if __name__ == '__main__':
+    main()
@@ -217,6 +217,17 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
+    // CPU compute threads that are kept alive between the tokens, placed according to --cpu-mask, --cpu-strict, etc.
+    const int32_t n_threads_batch = params.n_threads_batch == -1 ? params.n_threads : params.n_threads_batch;
+
+    struct ggml_threadpool * threadpool       = gpt_threadpool_new(params, params.n_threads);
+    struct ggml_threadpool * threadpool_batch = n_threads_batch != params.n_threads ? gpt_threadpool_new(params, n_threads_batch) : nullptr;
+
+    llama_attach_threadpool(ctx, threadpool, threadpool_batch);
+    if (ctx_guidance) {
+        llama_attach_threadpool(ctx_guidance, threadpool, threadpool_batch);
+    }
+
     const int n_ctx_train = llama_n_ctx_train(model);
     const int n_ctx = llama_n_ctx(ctx);
     LOG("n_ctx: %d\n", n_ctx);
@@ -982,6 +993,9 @@ int main(int argc, char ** argv) {
     llama_free(ctx);
     llama_free_model(model);
 
+    ggml_threadpool_free(threadpool);
+    ggml_threadpool_free(threadpool_batch);
+
     llama_sampling_free(ctx_sampling);
     llama_backend_free();
 
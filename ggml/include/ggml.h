@@ -234,6 +234,7 @@
 #endif
 #define GGML_MAX_OP_PARAMS      64
 #define GGML_DEFAULT_N_THREADS  4
+#define GGML_MAX_N_THREADS      512 // also the max number of CPUs in a ggml_threadpool_params.cpumask
 #define GGML_DEFAULT_GRAPH_SIZE 2048
 #if UINTPTR_MAX == 0xFFFFFFFF
     #define GGML_MEM_ALIGN 4
@@ -347,6 +348,10 @@ extern "C" {
     GGML_API void        ggml_bf16_to_fp32_row(const ggml_bf16_t *, float *, int64_t);
     GGML_API void        ggml_fp32_to_bf16_row(const float *, ggml_bf16_t *, int64_t);
 
+    // f32 rows, vectorized like the CPU backend - for use outside of a graph (e.g. sampling from logits)
+    GGML_API float       ggml_max_row_f32(const float *, int64_t);
+    GGML_API double      ggml_soft_max_row_f32(const float *, float *, int64_t, float max); // y = expf(x - max), returns sum(y)
+
     struct ggml_object;
     struct ggml_context;
 
@@ -481,6 +486,7 @@ extern "C" {
         GGML_OP_ROPE,
         GGML_OP_ROPE_BACK,
         GGML_OP_CLAMP,
+        GGML_OP_CONV_1D,
         GGML_OP_CONV_TRANSPOSE_1D,
         GGML_OP_IM2COL,
         GGML_OP_CONV_TRANSPOSE_2D,
@@ -617,6 +623,27 @@ extern "C" {
     // If it returns true, the computation is aborted
     typedef bool (*ggml_abort_callback)(void * data);
 
+    // persistent pool of CPU worker threads that can be reused across ggml_graph_compute() calls
+    struct ggml_threadpool;
+
+    enum ggml_sched_priority {
+        GGML_SCHED_PRIO_NORMAL,
+        GGML_SCHED_PRIO_MEDIUM,
+        GGML_SCHED_PRIO_HIGH,
+        GGML_SCHED_PRIO_REALTIME,
+    };
+
+    struct ggml_threadpool_params {
+        int  n_threads; // number of threads, including the thread that calls ggml_graph_compute()
+        int  n_spin;    // number of polling iterations before an idle worker goes to sleep (0 - sleep immediately)
+        bool paused;    // start in the paused state
+
+        // thread placement of the workers, the thread that calls ggml_graph_compute() (thread 0) keeps its own
+        bool cpumask[GGML_MAX_N_THREADS]; // CPUs the threads may run on (all false - keep the inherited affinity)
+        bool strict_cpu;                  // pin each thread to its own CPU of the mask, in order, instead of the whole mask
+        enum ggml_sched_priority prio;    // scheduling priority of the threads
+    };
+
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
     struct ggml_cplan {
@@ -625,6 +652,9 @@ extern "C" {
 
         int n_threads;
 
+        // optional, when set the graph is computed by the threads of this pool instead of spawning new ones
+        struct ggml_threadpool * threadpool;
+
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
@@ -1596,6 +1626,21 @@ extern "C" {
             int                   s,
             int                   d);
 
+    // direct conv_1d with fused bias and GELU, the im2col rows are built in small tiles instead of a full buffer
+    // same result as ggml_gelu(ggml_add(ggml_conv_1d(a, b, s0, p0, d0), c)) for N == 1, without the GELU if gelu == false
+    // a: [OC, IC, K] (F16), b: [N, IC, L] (F32), c: OC elements (F32, optional)
+    // result: [N, OC, OL]
+    // only the CPU backend implements GGML_OP_CONV_1D - use ggml_conv_1d with the other backends
+    GGML_API struct ggml_tensor * ggml_conv_1d_fused(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c,
+            int                   s0,  // stride
+            int                   p0,  // padding
+            int                   d0,  // dilation
+            bool                  gelu);
+
     GGML_API struct ggml_tensor * ggml_conv_transpose_1d(
             struct ggml_context * ctx,
             struct ggml_tensor  * a,
@@ -2009,6 +2054,16 @@ extern "C" {
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_API enum ggml_status  ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
 
+    // the worker threads are created once and wait for new graphs by spinning for params.n_spin iterations and then
+    // sleeping (futex on Linux), while paused the idle workers sleep right away
+    // a threadpool can only compute one graph at a time
+    GGML_API struct ggml_threadpool_params ggml_threadpool_params_default(int n_threads);
+    GGML_API struct ggml_threadpool *      ggml_threadpool_new           (const struct ggml_threadpool_params * params);
+    GGML_API void                          ggml_threadpool_free          (struct ggml_threadpool * threadpool);
+    GGML_API int                           ggml_threadpool_get_n_threads (const struct ggml_threadpool * threadpool);
+    GGML_API void                          ggml_threadpool_pause         (struct ggml_threadpool * threadpool);
+    GGML_API void                          ggml_threadpool_resume        (struct ggml_threadpool * threadpool);
+
     GGML_API struct ggml_tensor * ggml_graph_get_tensor(struct ggml_cgraph * cgraph, const char * name);
 
     GGML_API void                 ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname);
@@ -2017,6 +2072,11 @@ extern "C" {
     // print info and performance information for the graph
     GGML_API void ggml_graph_print(const struct ggml_cgraph * cgraph);
 
+    // how the CPU computes the graph with n_threads - returns the number of phases (nodes between two barriers)
+    // phase[i] is the phase of node i, group[i] is the index of the node with which node i is computed in a single pass
+    // both arrays must have space for the nodes of the graph
+    GGML_API int ggml_graph_get_schedule(const struct ggml_cgraph * cgraph, int n_threads, int * phase, int * group);
+
     // dump the graph into a file using the dot format
     GGML_API void ggml_graph_dump_dot(const struct ggml_cgraph * gb, const struct ggml_cgraph * gf, const char * filename);
 
@@ -2241,6 +2301,12 @@ extern "C" {
                    int64_t   n_per_row,
                const float * imatrix);
 
+    // repacking of Q4_0 data into the interleaved layout that suits the CPU best (Q4_0_4_4, Q4_0_4_8 or Q4_0_8_8)
+    // ggml_repack_get_optimal_type returns the tensor type if there is no better layout
+    // ggml_repack_tensor converts the data in place, so it must be in writable host memory
+    GGML_API enum ggml_type ggml_repack_get_optimal_type(const struct ggml_tensor * tensor);
+    GGML_API void           ggml_repack_tensor(struct ggml_tensor * tensor, enum ggml_type type);
+
     //
     // gguf
     //
@@ -2397,6 +2463,7 @@ extern "C" {
     GGML_API int ggml_cpu_has_rpc        (void);
     GGML_API int ggml_cpu_has_vsx        (void);
     GGML_API int ggml_cpu_has_matmul_int8(void);
+    GGML_API int ggml_cpu_has_openmp     (void);
 
     //
     // Internal types and functions exposed for tests and benchmarks
@@ -2418,6 +2485,7 @@ extern "C" {
                                        const void * GGML_RESTRICT y, int nr, int nc);
     typedef void (*ggml_gemm_t)     (int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT x,
                                        const void * GGML_RESTRICT y, int nr, int nc);
+    typedef void (*ggml_vec_mad_t)  (int n, float * GGML_RESTRICT y, const void * GGML_RESTRICT x, float v);
 
     typedef struct {
         const char             * type_name;
@@ -2435,6 +2503,7 @@ extern "C" {
         int64_t                  ncols; // number of columns to process simultaneously
         ggml_gemv_t              gemv;
         ggml_gemm_t              gemm;
+        ggml_vec_mad_t           vec_mad; // y += x*v with x dequantized on the fly (NULL if the type has none)
     } ggml_type_traits_t;
 
     GGML_API ggml_type_traits_t ggml_internal_get_type_traits(enum ggml_type type);
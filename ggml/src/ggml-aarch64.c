@@ -253,6 +253,54 @@ void quantize_q8_0_4x8(const float * restrict x, void * restrict vy, int64_t k)
             y[i].qs[32 * j + 31] = vgetq_lane_s32(vi, 3);
         }
     }
+#elif defined(__AVX2__)
+    for (int i = 0; i < nb; i++) {
+        for (int row_iter = 0; row_iter < 4; row_iter++) {
+            const float * xr = x + row_iter * k + i * QK8_0;
+
+            __m256 v0 = _mm256_loadu_ps(xr +  0);
+            __m256 v1 = _mm256_loadu_ps(xr +  8);
+            __m256 v2 = _mm256_loadu_ps(xr + 16);
+            __m256 v3 = _mm256_loadu_ps(xr + 24);
+
+            // max(abs(x))
+            const __m256 sign_bit = _mm256_set1_ps(-0.0f);
+            __m256 max_abs = _mm256_andnot_ps(sign_bit, v0);
+            max_abs = _mm256_max_ps(max_abs, _mm256_andnot_ps(sign_bit, v1));
+            max_abs = _mm256_max_ps(max_abs, _mm256_andnot_ps(sign_bit, v2));
+            max_abs = _mm256_max_ps(max_abs, _mm256_andnot_ps(sign_bit, v3));
+
+            __m128 max4 = _mm_max_ps(_mm256_extractf128_ps(max_abs, 1), _mm256_castps256_ps128(max_abs));
+            max4 = _mm_max_ps(max4, _mm_movehl_ps(max4, max4));
+            max4 = _mm_max_ss(max4, _mm_movehdup_ps(max4));
+            const float amax = _mm_cvtss_f32(max4);
+
+            const float d = amax / ((1 << 7) - 1);
+            const float id = d ? 1.0f / d : 0.0f;
+
+            y[i].d[row_iter] = GGML_FP32_TO_FP16(d);
+
+            const __m256 mul = _mm256_set1_ps(id);
+            v0 = _mm256_round_ps(_mm256_mul_ps(v0, mul), _MM_ROUND_NEAREST);
+            v1 = _mm256_round_ps(_mm256_mul_ps(v1, mul), _MM_ROUND_NEAREST);
+            v2 = _mm256_round_ps(_mm256_mul_ps(v2, mul), _MM_ROUND_NEAREST);
+            v3 = _mm256_round_ps(_mm256_mul_ps(v3, mul), _MM_ROUND_NEAREST);
+
+            // convert to int8, the packs interleave the 128-bit lanes
+            __m256i i01 = _mm256_packs_epi32(_mm256_cvtps_epi32(v0), _mm256_cvtps_epi32(v1));
+            __m256i i23 = _mm256_packs_epi32(_mm256_cvtps_epi32(v2), _mm256_cvtps_epi32(v3));
+            __m256i q   = _mm256_packs_epi16(i01, i23);
+            q = _mm256_permutevar8x32_epi32(q, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+
+            // chunks of 8 values go to the 4 interleaved sub-blocks
+            const __m128i q_lo = _mm256_castsi256_si128(q);
+            const __m128i q_hi = _mm256_extracti128_si256(q, 1);
+            _mm_storel_epi64((__m128i *) (y[i].qs +  0 + 8 * row_iter), q_lo);
+            _mm_storel_epi64((__m128i *) (y[i].qs + 32 + 8 * row_iter), _mm_unpackhi_epi64(q_lo, q_lo));
+            _mm_storel_epi64((__m128i *) (y[i].qs + 64 + 8 * row_iter), q_hi);
+            _mm_storel_epi64((__m128i *) (y[i].qs + 96 + 8 * row_iter), _mm_unpackhi_epi64(q_hi, q_hi));
+        }
+    }
 #else
     // scalar
     const int blck_size_interleave = 8;
@@ -594,6 +642,124 @@ void ggml_gemv_q4_0_4x8_q8_0(int n, float * restrict s, size_t bs, const void *
 #endif
 }
 
+#if defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+// load the quants of a block_q4_0x8: the 4 32-byte chunks hold 8 bytes of each of 4 columns, for the row elements
+// [0, 8) (chunks 0, 1) and [8, 16) (chunks 2, 3) in the low nibbles and [16, 24), [24, 32) in the high nibbles
+// the nibbles are in sign form and are kept in the high half of the bytes (values scaled by 16)
+static inline void ggml_q4_0x8_load_avx2(const block_q4_0x8 * b, __m256i b_lo[4], __m256i b_hi[4]) {
+    const __m256i m4 = _mm256_set1_epi8((char) 0xF0);
+
+    for (int r = 0; r < 4; r++) {
+        const __m256i raw = _mm256_loadu_si256((const __m256i *) (b->qs + 32*r));
+
+        b_lo[r] = _mm256_and_si256(_mm256_slli_epi16(raw, 4), m4);
+        b_hi[r] = _mm256_and_si256(raw, m4);
+    }
+}
+
+// pairwise dot products of signed bytes, accumulated in int32
+static inline __m256i ggml_mul_sum_i8_i32_avx2(const __m256i x, const __m256i y) {
+    const __m256i ax = _mm256_sign_epi8(x, x);
+    const __m256i sy = _mm256_sign_epi8(y, x);
+#if defined(__AVXVNNI__) || (defined(__AVX512VNNI__) && defined(__AVX512VL__))
+    return _mm256_dpbusd_epi32(_mm256_setzero_si256(), ax, sy);
+#else
+    return _mm256_madd_epi16(_mm256_maddubs_epi16(ax, sy), _mm256_set1_epi16(1));
+#endif
+}
+
+static inline __m256i ggml_bcast_i8x8_avx2(const int8_t * x) {
+    int64_t v;
+    memcpy(&v, x, sizeof(v));
+    return _mm256_set1_epi64x(v);
+}
+
+// dot products of the 8 columns of a block_q4_0x8 with the 32 values of a q8_0 block
+// a0, a1, a2, a3 point to the values [0, 8), [8, 16), [16, 24), [24, 32)
+static inline __m256 ggml_q4_0x8_dot_avx2(const __m256i b_lo[4], const __m256i b_hi[4],
+        const int8_t * a0, const int8_t * a1, const int8_t * a2, const int8_t * a3) {
+    const __m256i va0 = ggml_bcast_i8x8_avx2(a0);
+    const __m256i va1 = ggml_bcast_i8x8_avx2(a1);
+    const __m256i va2 = ggml_bcast_i8x8_avx2(a2);
+    const __m256i va3 = ggml_bcast_i8x8_avx2(a3);
+
+    // 2 partial sums per column: columns 0..3 and 4..7
+    __m256i s0 = ggml_mul_sum_i8_i32_avx2(b_lo[0], va0);
+    __m256i s1 = ggml_mul_sum_i8_i32_avx2(b_lo[1], va0);
+    s0 = _mm256_add_epi32(s0, ggml_mul_sum_i8_i32_avx2(b_lo[2], va1));
+    s1 = _mm256_add_epi32(s1, ggml_mul_sum_i8_i32_avx2(b_lo[3], va1));
+    s0 = _mm256_add_epi32(s0, ggml_mul_sum_i8_i32_avx2(b_hi[0], va2));
+    s1 = _mm256_add_epi32(s1, ggml_mul_sum_i8_i32_avx2(b_hi[1], va2));
+    s0 = _mm256_add_epi32(s0, ggml_mul_sum_i8_i32_avx2(b_hi[2], va3));
+    s1 = _mm256_add_epi32(s1, ggml_mul_sum_i8_i32_avx2(b_hi[3], va3));
+
+    // { c0, c1, c4, c5 | c2, c3, c6, c7 } -> { c0 .. c7 }
+    __m256i s = _mm256_hadd_epi32(s0, s1);
+    s = _mm256_permutevar8x32_epi32(s, _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7));
+
+    // undo the scaling of the nibbles, the sums are exact multiples of 16
+    return _mm256_cvtepi32_ps(_mm256_srai_epi32(s, 4));
+}
+#endif
+
+#if defined(__AVX512F__) && defined(__AVX512BW__) && defined(__FMA__) && defined(__F16C__)
+// load the quants of a block_q4_0x8 as 4 vectors of the 8 columns, for the row elements [0, 8), [8, 16), [16, 24)
+// and [24, 32): 2 int32 lanes per column
+// the absolute values (scaled by 16) are kept together with the sign masks that are applied to the q8 operand
+static inline void ggml_q4_0x8_load_avx512(const block_q4_0x8 * b, __m512i b_abs[4], __mmask64 b_neg[4]) {
+    const __m512i m4 = _mm512_set1_epi8((char) 0xF0);
+
+    const __m512i raw0 = _mm512_loadu_si512((const __m512i *) (b->qs +  0));
+    const __m512i raw1 = _mm512_loadu_si512((const __m512i *) (b->qs + 64));
+
+    __m512i v[4];
+    v[0] = _mm512_and_si512(_mm512_slli_epi16(raw0, 4), m4);
+    v[1] = _mm512_and_si512(_mm512_slli_epi16(raw1, 4), m4);
+    v[2] = _mm512_and_si512(raw0, m4);
+    v[3] = _mm512_and_si512(raw1, m4);
+
+    for (int r = 0; r < 4; r++) {
+        b_neg[r] = _mm512_movepi8_mask(v[r]);
+        b_abs[r] = _mm512_abs_epi8(v[r]);
+    }
+}
+
+// the scales of the 8 columns, each duplicated for the 2 lanes of the column
+static inline __m512 ggml_q4_0x8_scales_avx512(const block_q4_0x8 * b) {
+    const __m512 d = _mm512_castps256_ps512(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) b->d)));
+    return _mm512_permutexvar_ps(_mm512_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7), d);
+}
+
+// dot products of the 8 columns with the 32 values of a q8_0 block, a0 .. a3 point to the chunks of 8 values
+// the 2 partial sums of each column are left in separate lanes
+static inline __m512 ggml_q4_0x8_dot_avx512(const __m512i b_abs[4], const __mmask64 b_neg[4],
+        const int8_t * a0, const int8_t * a1, const int8_t * a2, const int8_t * a3) {
+    const int8_t * a[4] = { a0, a1, a2, a3 };
+
+    __m512i sumi = _mm512_setzero_si512();
+    for (int r = 0; r < 4; r++) {
+        int64_t v;
+        memcpy(&v, a[r], sizeof(v));
+        __m512i va = _mm512_set1_epi64(v);
+        va = _mm512_mask_sub_epi8(va, b_neg[r], _mm512_setzero_si512(), va);
+#if defined(__AVX512VNNI__)
+        sumi = _mm512_dpbusd_epi32(sumi, b_abs[r], va);
+#else
+        sumi = _mm512_add_epi32(sumi, _mm512_madd_epi16(_mm512_maddubs_epi16(b_abs[r], va), _mm512_set1_epi16(1)));
+#endif
+    }
+
+    return _mm512_cvtepi32_ps(sumi);
+}
+
+// add the 2 lanes of each column and store the 8 results
+static inline void ggml_q4_0x8_store_avx512(float * s, const __m512 acc) {
+    const __m512 sum = _mm512_add_ps(acc, _mm512_permute_ps(acc, 0xB1));
+    const __m512 res = _mm512_permutexvar_ps(_mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 0, 2, 4, 6, 8, 10, 12, 14), sum);
+    _mm256_storeu_ps(s, _mm512_castps512_ps256(res));
+}
+#endif
+
 void ggml_gemv_q4_0_8x8_q8_0(int n, float * restrict s, size_t bs, const void * restrict vx, const void * restrict vy, int nr, int nc) {
     const int qk = QK8_0;
     const int nb = n / qk;
@@ -697,6 +863,45 @@ void ggml_gemv_q4_0_8x8_q8_0(int n, float * restrict s, size_t bs, const void *
     GGML_ASSERT((ggml_cpu_has_sve() || ggml_cpu_has_matmul_int8()) &&
                 "__ARM_FEATURE_SVE and __ARM_FEATURE_MATMUL_INT8 not defined, use the Q4_0_4_4 quantization format for optimal "
                 "performance");
+#elif defined(__AVX512F__) && defined(__AVX512BW__) && defined(__FMA__) && defined(__F16C__)
+    const block_q8_0 * a_ptr = (const block_q8_0 *) vy;
+    for (int x = 0; x < nc / ncols_interleaved; x++) {
+        const block_q4_0x8 * b_ptr = (const block_q4_0x8 *) vx + (x * nb);
+
+        __m512 acc = _mm512_setzero_ps();
+        for (int l = 0; l < nb; l++) {
+            __m512i  b_abs[4];
+            __mmask64 b_neg[4];
+            ggml_q4_0x8_load_avx512(b_ptr + l, b_abs, b_neg);
+
+            // the nibbles are scaled by 16
+            const __m512 sumi = ggml_q4_0x8_dot_avx512(b_abs, b_neg, a_ptr[l].qs, a_ptr[l].qs + 8, a_ptr[l].qs + 16, a_ptr[l].qs + 24);
+            const __m512 d    = _mm512_mul_ps(ggml_q4_0x8_scales_avx512(b_ptr + l),
+                                              _mm512_set1_ps(GGML_FP16_TO_FP32(a_ptr[l].d) * (1.0f / 16)));
+
+            acc = _mm512_fmadd_ps(sumi, d, acc);
+        }
+        ggml_q4_0x8_store_avx512(s + x * ncols_interleaved, acc);
+    }
+#elif defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+    const block_q8_0 * a_ptr = (const block_q8_0 *) vy;
+    for (int x = 0; x < nc / ncols_interleaved; x++) {
+        const block_q4_0x8 * b_ptr = (const block_q4_0x8 *) vx + (x * nb);
+
+        __m256 acc = _mm256_setzero_ps();
+        for (int l = 0; l < nb; l++) {
+            __m256i b_lo[4];
+            __m256i b_hi[4];
+            ggml_q4_0x8_load_avx2(b_ptr + l, b_lo, b_hi);
+
+            const __m256 sumi = ggml_q4_0x8_dot_avx2(b_lo, b_hi, a_ptr[l].qs, a_ptr[l].qs + 8, a_ptr[l].qs + 16, a_ptr[l].qs + 24);
+            const __m256 d    = _mm256_mul_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) b_ptr[l].d)),
+                                              _mm256_set1_ps(GGML_FP16_TO_FP32(a_ptr[l].d)));
+
+            acc = _mm256_fmadd_ps(sumi, d, acc);
+        }
+        _mm256_storeu_ps(s + x * ncols_interleaved, acc);
+    }
 #else
     float sumf[8];
     int sumi;
@@ -2156,6 +2361,91 @@ void ggml_gemm_q4_0_8x8_q8_0(int n, float * restrict s, size_t bs, const void *
     GGML_ASSERT((ggml_cpu_has_sve() || ggml_cpu_has_matmul_int8()) &&
                 "__ARM_FEATURE_SVE and __ARM_FEATURE_MATMUL_INT8 not defined, use the Q4_0_4_4 quantization format for optimal "
                 "performance");
+#elif defined(__AVX512F__) && defined(__AVX512BW__) && defined(__FMA__) && defined(__F16C__)
+    // groups of columns processed against all the rows, so that their blocks stay in cache
+    const int ncols_group = 4 * ncols_interleaved;
+
+    for (int x0 = 0; x0 < nc; x0 += ncols_group) {
+        const int x1 = MIN(x0 + ncols_group, nc);
+
+        for (int y = 0; y < nr / 4; y++) {
+            const block_q8_0x4 * a_ptr = (const block_q8_0x4 *) vy + (y * nb);
+
+            for (int x = x0 / ncols_interleaved; x < x1 / ncols_interleaved; x++) {
+                const block_q4_0x8 * b_ptr = (const block_q4_0x8 *) vx + (x * nb);
+
+                __m512 acc[4];
+                for (int m = 0; m < 4; m++) {
+                    acc[m] = _mm512_setzero_ps();
+                }
+
+                for (int l = 0; l < nb; l++) {
+                    __m512i  b_abs[4];
+                    __mmask64 b_neg[4];
+                    ggml_q4_0x8_load_avx512(b_ptr + l, b_abs, b_neg);
+
+                    // the nibbles are scaled by 16
+                    const __m512 db = _mm512_mul_ps(ggml_q4_0x8_scales_avx512(b_ptr + l), _mm512_set1_ps(1.0f / 16));
+
+                    // the 4 rows of block_q8_0x4 are interleaved in chunks of 8 values
+                    for (int m = 0; m < 4; m++) {
+                        const int8_t * a = a_ptr[l].qs + m * blocklen;
+
+                        const __m512 sumi = ggml_q4_0x8_dot_avx512(b_abs, b_neg, a, a + 32, a + 64, a + 96);
+                        const __m512 d    = _mm512_mul_ps(db, _mm512_set1_ps(GGML_FP16_TO_FP32(a_ptr[l].d[m])));
+
+                        acc[m] = _mm512_fmadd_ps(sumi, d, acc[m]);
+                    }
+                }
+
+                for (int m = 0; m < 4; m++) {
+                    ggml_q4_0x8_store_avx512(s + (y * 4 + m) * bs + x * ncols_interleaved, acc[m]);
+                }
+            }
+        }
+    }
+#elif defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+    // groups of columns processed against all the rows, so that their blocks stay in cache
+    const int ncols_group = 4 * ncols_interleaved;
+
+    for (int x0 = 0; x0 < nc; x0 += ncols_group) {
+        const int x1 = MIN(x0 + ncols_group, nc);
+
+        for (int y = 0; y < nr / 4; y++) {
+            const block_q8_0x4 * a_ptr = (const block_q8_0x4 *) vy + (y * nb);
+
+            for (int x = x0 / ncols_interleaved; x < x1 / ncols_interleaved; x++) {
+                const block_q4_0x8 * b_ptr = (const block_q4_0x8 *) vx + (x * nb);
+
+                __m256 acc[4];
+                for (int m = 0; m < 4; m++) {
+                    acc[m] = _mm256_setzero_ps();
+                }
+
+                for (int l = 0; l < nb; l++) {
+                    __m256i b_lo[4];
+                    __m256i b_hi[4];
+                    ggml_q4_0x8_load_avx2(b_ptr + l, b_lo, b_hi);
+
+                    const __m256 db = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) b_ptr[l].d));
+
+                    // the 4 rows of block_q8_0x4 are interleaved in chunks of 8 values
+                    for (int m = 0; m < 4; m++) {
+                        const int8_t * a = a_ptr[l].qs + m * blocklen;
+
+                        const __m256 sumi = ggml_q4_0x8_dot_avx2(b_lo, b_hi, a, a + 32, a + 64, a + 96);
+                        const __m256 d    = _mm256_mul_ps(db, _mm256_set1_ps(GGML_FP16_TO_FP32(a_ptr[l].d[m])));
+
+                        acc[m] = _mm256_fmadd_ps(sumi, d, acc[m]);
+                    }
+                }
+
+                for (int m = 0; m < 4; m++) {
+                    _mm256_storeu_ps(s + (y * 4 + m) * bs + x * ncols_interleaved, acc[m]);
+                }
+            }
+        }
+    }
 #else
     float sumf[4][8];
     int sumi;
@@ -2191,3 +2481,90 @@ void ggml_gemm_q4_0_8x8_q8_0(int n, float * restrict s, size_t bs, const void *
     }
 #endif
 }
+
+// Repacking of already quantized data into the interleaved formats
+
+static void repack_q4_0_nr_bl(void * data, int64_t nrow, int64_t n_per_row, int nrows_interleaved, int blck_size_interleave) {
+    GGML_ASSERT(n_per_row % QK4_0 == 0);
+    GGML_ASSERT(nrow % nrows_interleaved == 0);
+    GGML_ASSERT(nrows_interleaved <= 8);
+
+    const int64_t nb = n_per_row / QK4_0;
+
+    // the interleaved blocks of a group of rows take exactly the space of the rows, so the data can be
+    // repacked in place one group at a time
+    block_q4_0 * tmp = malloc(nrows_interleaved * nb * sizeof(block_q4_0));
+    GGML_ASSERT(tmp != NULL);
+
+    block_q4_0 in[8];
+
+    for (int64_t b = 0; b < nrow; b += nrows_interleaved) {
+        block_q4_0 * src = (block_q4_0 *) data + b * nb;
+        memcpy(tmp, src, nrows_interleaved * nb * sizeof(block_q4_0));
+
+        for (int64_t x = 0; x < nb; x++) {
+            for (int i = 0; i < nrows_interleaved; i++) {
+                in[i] = tmp[i * nb + x];
+            }
+
+            if (nrows_interleaved == 8) {
+                ((block_q4_0x8 *) src)[x] = make_block_q4_0x8(in, blck_size_interleave, 0x88);
+            } else {
+                ((block_q4_0x4 *) src)[x] = make_block_q4_0x4(in, blck_size_interleave, 0x88);
+            }
+        }
+    }
+
+    free(tmp);
+}
+
+enum ggml_type ggml_repack_get_optimal_type(const struct ggml_tensor * tensor) {
+    if (tensor->type != GGML_TYPE_Q4_0 || !ggml_is_contiguous(tensor) ||
+        tensor->ne[2] != 1 || tensor->ne[3] != 1) {
+        return tensor->type;
+    }
+
+    const int64_t nrows = tensor->ne[1];
+
+#if defined(__ARM_FEATURE_SVE)
+    if (ggml_cpu_has_sve() && svcntw() == 8) {
+        return nrows % 8 == 0 ? GGML_TYPE_Q4_0_8_8 : tensor->type;
+    }
+#endif
+#if defined(__ARM_NEON) && defined(__ARM_FEATURE_MATMUL_INT8)
+    if (ggml_cpu_has_matmul_int8() && nrows % 4 == 0) {
+        return GGML_TYPE_Q4_0_4_8;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    if (nrows % 4 == 0) {
+        return GGML_TYPE_Q4_0_4_4;
+    }
+#endif
+#if defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+    if (nrows % 8 == 0) {
+        return GGML_TYPE_Q4_0_8_8;
+    }
+#endif
+
+    UNUSED(nrows);
+
+    return tensor->type;
+}
+
+void ggml_repack_tensor(struct ggml_tensor * tensor, enum ggml_type type) {
+    GGML_ASSERT(tensor->type == GGML_TYPE_Q4_0);
+    GGML_ASSERT(ggml_is_contiguous(tensor));
+
+    const int64_t n_per_row = tensor->ne[0];
+    const int64_t nrows     = ggml_nrows(tensor);
+
+    switch (type) {
+        case GGML_TYPE_Q4_0_4_4: repack_q4_0_nr_bl(tensor->data, nrows, n_per_row, 4, 4); break;
+        case GGML_TYPE_Q4_0_4_8: repack_q4_0_nr_bl(tensor->data, nrows, n_per_row, 4, 8); break;
+        case GGML_TYPE_Q4_0_8_8: repack_q4_0_nr_bl(tensor->data, nrows, n_per_row, 8, 8); break;
+        default:
+            GGML_ASSERT(false && "unsupported repack type");
+    }
+
+    tensor->type = type;
+}
@@ -1622,6 +1622,219 @@ void dequantize_row_q8_0(const block_q8_0 * restrict x, float * restrict y, int6
     }
 }
 
+//
+// multiply-add of a quantized row: y += v*x
+// used to accumulate quantized V rows without dequantizing them to a F32 buffer first
+//
+
+#if defined(__AVX2__) && defined(__FMA__)
+// y[0..31] += d*q[0..31] + b
+static inline void mad_i8_32(float * restrict y, const __m256i q, const __m256 d, const __m256 b) {
+    const __m128i q0 = _mm256_castsi256_si128(q);
+    const __m128i q1 = _mm256_extracti128_si256(q, 1);
+
+    const __m256 f0 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(q0));
+    const __m256 f1 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(q0, 8)));
+    const __m256 f2 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(q1));
+    const __m256 f3 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(q1, 8)));
+
+    _mm256_storeu_ps(y +  0, _mm256_fmadd_ps(f0, d, _mm256_add_ps(_mm256_loadu_ps(y +  0), b)));
+    _mm256_storeu_ps(y +  8, _mm256_fmadd_ps(f1, d, _mm256_add_ps(_mm256_loadu_ps(y +  8), b)));
+    _mm256_storeu_ps(y + 16, _mm256_fmadd_ps(f2, d, _mm256_add_ps(_mm256_loadu_ps(y + 16), b)));
+    _mm256_storeu_ps(y + 24, _mm256_fmadd_ps(f3, d, _mm256_add_ps(_mm256_loadu_ps(y + 24), b)));
+}
+#endif
+
+void ggml_vec_mad_q4_0(int n, float * restrict y, const void * restrict vx, float v) {
+    static const int qk = QK4_0;
+
+    assert(n % qk == 0);
+
+    const int nb = n / qk;
+
+    const block_q4_0 * restrict x = vx;
+
+#if defined(__AVX2__) && defined(__FMA__)
+    const __m256i off8 = _mm256_set1_epi8(8);
+    const __m256  zero = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; i++) {
+        const __m256 d = _mm256_set1_ps(v*GGML_FP16_TO_FP32(x[i].d));
+
+        const __m256i q = _mm256_sub_epi8(bytes_from_nibbles_32(x[i].qs), off8);
+
+        mad_i8_32(y + i*qk, q, d, zero);
+    }
+#else
+    for (int i = 0; i < nb; i++) {
+        const float d = v*GGML_FP16_TO_FP32(x[i].d);
+
+        for (int j = 0; j < qk/2; ++j) {
+            const int x0 = (x[i].qs[j] & 0x0F) - 8;
+            const int x1 = (x[i].qs[j] >>   4) - 8;
+
+            y[i*qk + j + 0   ] += x0*d;
+            y[i*qk + j + qk/2] += x1*d;
+        }
+    }
+#endif
+}
+
+void ggml_vec_mad_q4_1(int n, float * restrict y, const void * restrict vx, float v) {
+    static const int qk = QK4_1;
+
+    assert(n % qk == 0);
+
+    const int nb = n / qk;
+
+    const block_q4_1 * restrict x = vx;
+
+#if defined(__AVX2__) && defined(__FMA__)
+    for (int i = 0; i < nb; i++) {
+        const __m256 d = _mm256_set1_ps(v*GGML_FP16_TO_FP32(x[i].d));
+        const __m256 m = _mm256_set1_ps(v*GGML_FP16_TO_FP32(x[i].m));
+
+        const __m256i q = bytes_from_nibbles_32(x[i].qs);
+
+        mad_i8_32(y + i*qk, q, d, m);
+    }
+#else
+    for (int i = 0; i < nb; i++) {
+        const float d = v*GGML_FP16_TO_FP32(x[i].d);
+        const float m = v*GGML_FP16_TO_FP32(x[i].m);
+
+        for (int j = 0; j < qk/2; ++j) {
+            const int x0 = (x[i].qs[j] & 0x0F);
+            const int x1 = (x[i].qs[j] >>   4);
+
+            y[i*qk + j + 0   ] += x0*d + m;
+            y[i*qk + j + qk/2] += x1*d + m;
+        }
+    }
+#endif
+}
+
+void ggml_vec_mad_q5_0(int n, float * restrict y, const void * restrict vx, float v) {
+    static const int qk = QK5_0;
+
+    assert(n % qk == 0);
+
+    const int nb = n / qk;
+
+    const block_q5_0 * restrict x = vx;
+
+#if defined(__AVX2__) && defined(__FMA__)
+    const __m256i mhi  = _mm256_set1_epi8((char)0xF0);
+    const __m256  zero = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; i++) {
+        const __m256 d = _mm256_set1_ps(v*GGML_FP16_TO_FP32(x[i].d));
+
+        // (q | (h << 4)) - 16
+        __m256i q  = bytes_from_nibbles_32(x[i].qs);
+        __m256i qh = bytes_from_bits_32(x[i].qh);
+        qh = _mm256_andnot_si256(qh, mhi);
+        q  = _mm256_or_si256(q, qh);
+
+        mad_i8_32(y + i*qk, q, d, zero);
+    }
+#else
+    for (int i = 0; i < nb; i++) {
+        const float d = v*GGML_FP16_TO_FP32(x[i].d);
+
+        uint32_t qh;
+        memcpy(&qh, x[i].qh, sizeof(qh));
+
+        for (int j = 0; j < qk/2; ++j) {
+            const uint8_t xh_0 = ((qh >> (j +  0)) << 4) & 0x10;
+            const uint8_t xh_1 = ((qh >> (j + 12))     ) & 0x10;
+
+            const int32_t x0 = ((x[i].qs[j] & 0x0F) | xh_0) - 16;
+            const int32_t x1 = ((x[i].qs[j] >>   4) | xh_1) - 16;
+
+            y[i*qk + j + 0   ] += x0*d;
+            y[i*qk + j + qk/2] += x1*d;
+        }
+    }
+#endif
+}
+
+void ggml_vec_mad_q5_1(int n, float * restrict y, const void * restrict vx, float v) {
+    static const int qk = QK5_1;
+
+    assert(n % qk == 0);
+
+    const int nb = n / qk;
+
+    const block_q5_1 * restrict x = vx;
+
+#if defined(__AVX2__) && defined(__FMA__)
+    const __m256i mhi = _mm256_set1_epi8(0x10);
+
+    for (int i = 0; i < nb; i++) {
+        const __m256 d = _mm256_set1_ps(v*GGML_FP16_TO_FP32(x[i].d));
+        const __m256 m = _mm256_set1_ps(v*GGML_FP16_TO_FP32(x[i].m));
+
+        // q | (h << 4)
+        __m256i q  = bytes_from_nibbles_32(x[i].qs);
+        __m256i qh = bytes_from_bits_32(x[i].qh);
+        qh = _mm256_and_si256(qh, mhi);
+        q  = _mm256_or_si256(q, qh);
+
+        mad_i8_32(y + i*qk, q, d, m);
+    }
+#else
+    for (int i = 0; i < nb; i++) {
+        const float d = v*GGML_FP16_TO_FP32(x[i].d);
+        const float m = v*GGML_FP16_TO_FP32(x[i].m);
+
+        uint32_t qh;
+        memcpy(&qh, x[i].qh, sizeof(qh));
+
+        for (int j = 0; j < qk/2; ++j) {
+            const uint8_t xh_0 = ((qh >> (j +  0)) << 4) & 0x10;
+            const uint8_t xh_1 = ((qh >> (j + 12))     ) & 0x10;
+
+            const int x0 = (x[i].qs[j] & 0x0F) | xh_0;
+            const int x1 = (x[i].qs[j] >>   4) | xh_1;
+
+            y[i*qk + j + 0   ] += x0*d + m;
+            y[i*qk + j + qk/2] += x1*d + m;
+        }
+    }
+#endif
+}
+
+void ggml_vec_mad_q8_0(int n, float * restrict y, const void * restrict vx, float v) {
+    static const int qk = QK8_0;
+
+    assert(n % qk == 0);
+
+    const int nb = n / qk;
+
+    const block_q8_0 * restrict x = vx;
+
+#if defined(__AVX2__) && defined(__FMA__)
+    const __m256 zero = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; i++) {
+        const __m256 d = _mm256_set1_ps(v*GGML_FP16_TO_FP32(x[i].d));
+
+        const __m256i q = _mm256_loadu_si256((const __m256i *) x[i].qs);
+
+        mad_i8_32(y + i*qk, q, d, zero);
+    }
+#else
+    for (int i = 0; i < nb; i++) {
+        const float d = v*GGML_FP16_TO_FP32(x[i].d);
+
+        for (int j = 0; j < qk; ++j) {
+            y[i*qk + j] += x[i].qs[j]*d;
+        }
+    }
+#endif
+}
+
 //
 // 2-6 bit quantization in super-blocks
 //
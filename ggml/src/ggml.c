@@ -27,6 +27,10 @@
 #include <signal.h>
 #if defined(__gnu_linux__)
 #include <syscall.h>
+#include <linux/futex.h>
+#endif
+#if defined(__linux__)
+#include <sys/resource.h>
 #endif
 
 #ifdef GGML_USE_OPENMP
@@ -180,6 +184,11 @@ void ggml_print_backtrace(void) {
 #define GGML_GELU_QUICK_FP16
 
 #define GGML_SOFT_MAX_UNROLL 4
+
+// number of output positions per im2col tile of GGML_OP_CONV_1D
+#define GGML_CONV_1D_TILE 32
+// the im2col rows are zero-padded to a multiple of this, so that the dot products have no scalar leftovers
+#define GGML_CONV_1D_PAD  64
 #define GGML_VEC_DOT_UNROLL  2
 #define GGML_VEC_MAD_UNROLL  32
 
@@ -352,7 +361,20 @@ ggml_bf16_t ggml_fp32_to_bf16(float x) {
 }
 
 void ggml_fp16_to_fp32_row(const ggml_fp16_t * x, float * y, int64_t n) {
-    for (int64_t i = 0; i < n; i++) {
+    int64_t i = 0;
+#if defined(__F16C__)
+    for (; i + 7 < n; i += 8) {
+        __m128i x_vec = _mm_loadu_si128((const __m128i *)(x + i));
+        __m256 y_vec = _mm256_cvtph_ps(x_vec);
+        _mm256_storeu_ps(y + i, y_vec);
+    }
+    for (; i + 3 < n; i += 4) {
+        __m128i x_vec = _mm_loadl_epi64((const __m128i *)(x + i));
+        __m128 y_vec = _mm_cvtph_ps(x_vec);
+        _mm_storeu_ps(y + i, y_vec);
+    }
+#endif
+    for (; i < n; i++) {
         y[i] = GGML_FP16_TO_FP32(x[i]);
     }
 }
@@ -607,6 +629,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_ref           = (ggml_from_float_t) quantize_row_q4_0_ref,
         .vec_dot                  = ggml_vec_dot_q4_0_q8_0,
         .vec_dot_type             = GGML_TYPE_Q8_0,
+        .vec_mad                  = ggml_vec_mad_q4_0,
 #if defined (__ARM_FEATURE_MATMUL_INT8)
         .nrows                    = 2,
 #else
@@ -623,6 +646,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_ref           = (ggml_from_float_t) quantize_row_q4_1_ref,
         .vec_dot                  = ggml_vec_dot_q4_1_q8_1,
         .vec_dot_type             = GGML_TYPE_Q8_1,
+        .vec_mad                  = ggml_vec_mad_q4_1,
 #if defined (__ARM_FEATURE_MATMUL_INT8)
         .nrows                    = 2,
 #else
@@ -663,6 +687,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_ref           = (ggml_from_float_t) quantize_row_q5_0_ref,
         .vec_dot                  = ggml_vec_dot_q5_0_q8_0,
         .vec_dot_type             = GGML_TYPE_Q8_0,
+        .vec_mad                  = ggml_vec_mad_q5_0,
         .nrows                    = 1,
     },
     [GGML_TYPE_Q5_1] = {
@@ -675,6 +700,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_ref           = (ggml_from_float_t) quantize_row_q5_1_ref,
         .vec_dot                  = ggml_vec_dot_q5_1_q8_1,
         .vec_dot_type             = GGML_TYPE_Q8_1,
+        .vec_mad                  = ggml_vec_mad_q5_1,
         .nrows                    = 1,
     },
     [GGML_TYPE_Q8_0] = {
@@ -688,6 +714,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_to_mat        = quantize_mat_q8_0,
         .vec_dot                  = ggml_vec_dot_q8_0_q8_0,
         .vec_dot_type             = GGML_TYPE_Q8_0,
+        .vec_mad                  = ggml_vec_mad_q8_0,
 #if defined (__ARM_FEATURE_MATMUL_INT8)
         .nrows                    = 2,
 #else
@@ -1779,6 +1806,9 @@ struct ggml_context_container {
     struct ggml_context context;
 };
 
+// max number of computed nodes in a phase, bounds the cost of the dependency checks
+#define GGML_GRAPH_MAX_PHASE 16
+
 struct ggml_compute_state_shared {
     const struct ggml_cgraph * cgraph;
     const struct ggml_cplan * cplan;
@@ -1792,9 +1822,11 @@ struct ggml_compute_state_shared {
     ggml_abort_callback abort_callback; // abort ggml_graph_compute when true
     void * abort_callback_data;
 
-    atomic_int current_chunk; // currently processing chunk during mul_mat, shared between all the threads
+    atomic_int current_chunk[GGML_GRAPH_MAX_PHASE]; // currently processing chunk during mul_mat, one for each node of a phase
 
     enum ggml_status ec;
+
+    struct ggml_threadpool * threadpool; // NULL when the threads are created for this graph only
 };
 
 struct ggml_compute_state {
@@ -1807,10 +1839,13 @@ struct ggml_compute_params {
     // ith = thread index, nth = number of threads
     int ith, nth;
 
-    // work buffer for all threads
+    // work buffer for all threads - the part of the current node when it shares a phase with other nodes
     size_t wsize;
     void * wdata;
 
+    // chunk counter of the current node
+    atomic_int * current_chunk;
+
     struct ggml_compute_state_shared * shared;
 };
 
@@ -2580,6 +2615,55 @@ static ggml_float ggml_vec_soft_max_f32(const int n, float * y, const float * x,
     return sum;
 }
 
+float ggml_max_row_f32(const float * x, int64_t n) {
+    int64_t i = 0;
+    float max = -INFINITY;
+#if defined(__AVX512F__)
+    __m512 vmax = _mm512_set1_ps(-INFINITY);
+    for (; i + 15 < n; i += 16) {
+        vmax = _mm512_max_ps(vmax, _mm512_loadu_ps(x + i));
+    }
+    max = _mm512_reduce_max_ps(vmax);
+#elif defined(__AVX__)
+    __m256 vmax = _mm256_set1_ps(-INFINITY);
+    for (; i + 7 < n; i += 8) {
+        vmax = _mm256_max_ps(vmax, _mm256_loadu_ps(x + i));
+    }
+    __m128 vmax4 = _mm_max_ps(_mm256_extractf128_ps(vmax, 1), _mm256_castps256_ps128(vmax));
+    vmax4 = _mm_max_ps(vmax4, _mm_movehl_ps(vmax4, vmax4));
+    vmax4 = _mm_max_ss(vmax4, _mm_shuffle_ps(vmax4, vmax4, 1));
+    max = _mm_cvtss_f32(vmax4);
+#elif defined(__SSE2__)
+    __m128 vmax = _mm_set1_ps(-INFINITY);
+    for (; i + 3 < n; i += 4) {
+        vmax = _mm_max_ps(vmax, _mm_loadu_ps(x + i));
+    }
+    vmax = _mm_max_ps(vmax, _mm_movehl_ps(vmax, vmax));
+    vmax = _mm_max_ss(vmax, _mm_shuffle_ps(vmax, vmax, 1));
+    max = _mm_cvtss_f32(vmax);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t vmax = vdupq_n_f32(-INFINITY);
+    for (; i + 3 < n; i += 4) {
+        vmax = vmaxq_f32(vmax, vld1q_f32(x + i));
+    }
+    max = vmaxvq_f32(vmax);
+#endif
+    for (; i < n; ++i) {
+        max = MAX(max, x[i]);
+    }
+    return max;
+}
+
+double ggml_soft_max_row_f32(const float * x, float * y, int64_t n, float max) {
+    if (max == -INFINITY) {
+        // all elements are -inf
+        memset(y, 0, n*sizeof(float));
+        return 0.0;
+    }
+
+    return ggml_vec_soft_max_f32(n, y, x, max);
+}
+
 inline static float ggml_silu_backward_f32(float x, float dy) {
     const float s = 1.0f/(1.0f + expf(-x));
     return dy*s*(1.0f + x*(1.0f - s));
@@ -2706,6 +2790,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "ROPE",
     "ROPE_BACK",
     "CLAMP",
+    "CONV_1D",
     "CONV_TRANSPOSE_1D",
     "IM2COL",
     "CONV_TRANSPOSE_2D",
@@ -2744,7 +2829,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(GGML_OP_COUNT == 74, "GGML_OP_COUNT != 74");
+static_assert(GGML_OP_COUNT == 75, "GGML_OP_COUNT != 75");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -2794,6 +2879,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "rope(x)",
     "rope_back(x)",
     "clamp(x)",
+    "conv_1d(x)",
     "conv_transpose_1d(x)",
     "im2col(x)",
     "conv_transpose_2d(x)",
@@ -2832,7 +2918,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 74, "GGML_OP_COUNT != 74");
+static_assert(GGML_OP_COUNT == 75, "GGML_OP_COUNT != 75");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -2905,20 +2991,43 @@ inline static void ggml_critical_section_start(void) {
     }
 }
 
-#ifdef GGML_USE_OPENMP
-static void ggml_barrier(struct ggml_compute_state_shared * shared) {
-    if (shared->n_threads == 1) {
-        return;
+// number of CPUs the process may run on
+static int ggml_get_n_cpus(void) {
+    static int n_cpus = 0;
+
+    if (n_cpus == 0) {
+        int n = 0;
+#if defined(__linux__)
+        cpu_set_t cpus;
+        if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+            n = CPU_COUNT(&cpus);
+        }
+#elif defined(_WIN32)
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        n = (int) info.dwNumberOfProcessors;
+#else
+        n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        n_cpus = n > 0 ? n : 1;
     }
 
-    #pragma omp barrier
+    return n_cpus;
 }
-#else
+
 static void ggml_barrier(struct ggml_compute_state_shared * shared) {
     if (shared->n_threads == 1) {
         return;
     }
 
+#ifdef GGML_USE_OPENMP
+    // the threads of a ggml_threadpool are not part of an OpenMP team
+    if (shared->threadpool == NULL) {
+        #pragma omp barrier
+        return;
+    }
+#endif
+
     atomic_int * n_barrier = &shared->n_barrier;
     atomic_int * n_barrier_passed = &shared->n_barrier_passed;
 
@@ -2931,7 +3040,8 @@ static void ggml_barrier(struct ggml_compute_state_shared * shared) {
         atomic_fetch_add(n_barrier_passed, 1);
     } else {
         // wait for other threads
-        const int n_spin_before_sleep = 100000;
+        // spinning only helps when every thread has a CPU, otherwise it delays the threads we are waiting for
+        const int n_spin_before_sleep = n_threads <= ggml_get_n_cpus() ? 100000 : 0;
         while (true) {
             for (int i = 0; i < n_spin_before_sleep; i++) {
                 if (atomic_load(n_barrier_passed) != passed_old) {
@@ -2941,11 +3051,13 @@ static void ggml_barrier(struct ggml_compute_state_shared * shared) {
                 _mm_pause();
             #endif
             }
+            if (atomic_load(n_barrier_passed) != passed_old) {
+                return;
+            }
             sched_yield();
         }
     }
 }
-#endif
 
 // TODO: make this somehow automatically executed
 //       some sort of "sentry" mechanism
@@ -6541,6 +6653,48 @@ struct ggml_tensor* ggml_conv_1d_ph(
     return ggml_conv_1d(ctx, a, b, s, a->ne[0] / 2, d);
 }
 
+// ggml_conv_1d_fused
+
+struct ggml_tensor * ggml_conv_1d_fused(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c,
+        int                   s0,
+        int                   p0,
+        int                   d0,
+        bool                  gelu) {
+    GGML_ASSERT(a->type == GGML_TYPE_F16);
+    GGML_ASSERT(ggml_is_contiguous(a));
+    GGML_ASSERT(a->ne[1] == b->ne[1]);
+    GGML_ASSERT(a->ne[3] == 1 && b->ne[3] == 1);
+    GGML_ASSERT(c == NULL || (c->type == GGML_TYPE_F32 && ggml_is_contiguous(c) && ggml_nelements(c) == a->ne[2]));
+
+    bool is_node = false;
+
+    if (a->grad || b->grad || (c && c->grad)) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    const int64_t ne[4] = {
+        ggml_calc_conv_output_size(b->ne[0], a->ne[0], s0, p0, d0),
+        a->ne[2], b->ne[2], 1,
+    };
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne);
+
+    int32_t params[] = { s0, p0, d0, gelu ? 1 : 0 };
+    ggml_set_op_params(result, params, sizeof(params));
+
+    result->op = GGML_OP_CONV_1D;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = a;
+    result->src[1] = b;
+    result->src[2] = c;
+
+    return result;
+}
+
 // ggml_conv_transpose_1d
 
 static int64_t ggml_calc_conv_transpose_1d_output_size(int64_t ins, int64_t ks, int s, int p, int d) {
@@ -12278,7 +12432,7 @@ UseGgmlGemm1:;
 
     if (ith == 0) {
         // Every thread starts at ith, so the first unprocessed chunk is nth.  This save a bit of coordination right at the start.
-        atomic_store(&params->shared->current_chunk, nth);
+        atomic_store(params->current_chunk, nth);
     }
 
     ggml_barrier(params->shared);
@@ -12389,7 +12543,7 @@ UseGgmlGemm2:;
             break;
         }
 
-        current_chunk = atomic_fetch_add(&params->shared->current_chunk, 1);
+        current_chunk = atomic_fetch_add(params->current_chunk, 1);
     }
 }
 
@@ -13583,6 +13737,19 @@ static void ggml_compute_forward_diag_mask_zero(
 
 // ggml_compute_forward_soft_max
 
+// rows shorter than this are never split across threads
+#define GGML_SOFT_MAX_SPLIT_MIN 4096
+
+// number of threads that process each row of a soft_max with nr rows of nc elements
+// long rows are split when there are fewer rows than threads (e.g. KQ of a single-token decode with a long context)
+static int ggml_soft_max_n_split(int64_t nr, int64_t nc, int nth) {
+    if (nr >= nth) {
+        return 1;
+    }
+
+    return (int) MAX(1, MIN(nth/nr, nc/GGML_SOFT_MAX_SPLIT_MIN));
+}
+
 static void ggml_compute_forward_soft_max_f32(
         const struct ggml_compute_params * params,
               struct ggml_tensor * dst) {
@@ -13619,6 +13786,90 @@ static void ggml_compute_forward_soft_max_f32(
     const int nc = src0->ne[0];
     const int nr = ggml_nrows(src0);
 
+    const bool use_f16 = (src1 && src1->type == GGML_TYPE_F16);
+
+    const int ns = ggml_soft_max_n_split(nr, nc, nth);
+
+    if (ns > 1) {
+        // each row is split in ns parts processed by different threads
+        // the partial max and sum of each part are reduced through the work buffer
+        float * ws = (float *) params->wdata;
+
+        const int i1 = ith/ns; // row
+        const int is = ith%ns; // part of the row
+
+        const int dc = (nc + ns - 1)/ns;
+        const int c0 = i1 < nr ? MIN(dc*is, nc) : 0;
+        const int c1 = i1 < nr ? MIN(c0 + dc, nc) : 0;
+        const int n  = c1 - c0;
+
+        float * sp = NULL;
+        float * dp = NULL;
+
+        float max = -INFINITY;
+
+        if (n > 0) {
+            // ALiBi
+            const uint32_t h = (i1/ne01)%ne02; // head
+            const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+
+            sp = (float *)((char *) src0->data + i1*src0->nb[1]) + c0;
+            dp = (float *)((char *)  dst->data +  i1*dst->nb[1]) + c0;
+
+            // broadcast the mask across rows
+            ggml_fp16_t * mp_f16 = src1 ? (ggml_fp16_t *)((char *) src1->data) + (i1%ne01)*ne00 + c0 : NULL;
+            float       * mp_f32 = src1 ? (float       *)((char *) src1->data) + (i1%ne01)*ne00 + c0 : NULL;
+
+            if (dp != sp) {
+                ggml_vec_cpy_f32(n, dp, sp);
+            }
+            ggml_vec_scale_f32(n, dp, scale);
+            if (mp_f32) {
+                if (use_f16) {
+                    for (int i = 0; i < n; ++i) {
+                        dp[i] += slope*GGML_FP16_TO_FP32(mp_f16[i]);
+                    }
+                } else {
+                    for (int i = 0; i < n; ++i) {
+                        dp[i] += slope*mp_f32[i];
+                    }
+                }
+            }
+
+            ggml_vec_max_f32(n, &max, dp);
+        }
+
+        ws[ith*CACHE_LINE_SIZE_F32 + 0] = max;
+
+        ggml_barrier(params->shared);
+
+        float sum = 0.0f;
+
+        if (n > 0) {
+            for (int j = 0; j < ns; ++j) {
+                max = MAX(max, ws[(i1*ns + j)*CACHE_LINE_SIZE_F32 + 0]);
+            }
+
+            sum = (float) ggml_vec_soft_max_f32(n, dp, dp, max);
+        }
+
+        ws[ith*CACHE_LINE_SIZE_F32 + 1] = sum;
+
+        ggml_barrier(params->shared);
+
+        if (n > 0) {
+            sum = 0.0f;
+            for (int j = 0; j < ns; ++j) {
+                sum += ws[(i1*ns + j)*CACHE_LINE_SIZE_F32 + 1];
+            }
+            assert(sum > 0.0f);
+
+            ggml_vec_scale_f32(n, dp, 1.0f/sum);
+        }
+
+        return;
+    }
+
     // rows per thread
     const int dr = (nr + nth - 1)/nth;
 
@@ -13628,8 +13879,6 @@ static void ggml_compute_forward_soft_max_f32(
 
     float * wp = (float *) params->wdata + (nc + CACHE_LINE_SIZE_F32) * ith;
 
-    const bool use_f16 = (src1 && src1->type == GGML_TYPE_F16);
-
     for (int i1 = ir0; i1 < ir1; i1++) {
         // ALiBi
         const uint32_t h = (i1/ne01)%ne02; // head
@@ -14439,6 +14688,118 @@ static void ggml_compute_forward_conv_transpose_1d(
     }
 }
 
+// ggml_compute_forward_conv_1d
+
+// src0: kernel [OC, IC, K]
+// src1: signal [N, IC, L]
+// src2: bias   [OC] (optional)
+// dst:  result [N, OC, OL]
+static void ggml_compute_forward_conv_1d_f16_f32(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
+    const struct ggml_tensor * src2 = dst->src[2];
+
+    GGML_ASSERT(src0->type == GGML_TYPE_F16);
+    GGML_ASSERT(src1->type == GGML_TYPE_F32);
+    GGML_ASSERT( dst->type == GGML_TYPE_F32);
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const int32_t s0   = ((const int32_t *)(dst->op_params))[0];
+    const int32_t p0   = ((const int32_t *)(dst->op_params))[1];
+    const int32_t d0   = ((const int32_t *)(dst->op_params))[2];
+    const bool    gelu = ((const int32_t *)(dst->op_params))[3] != 0;
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t K  = ne00;
+    const int64_t IC = ne01;
+    const int64_t OC = ne02;
+    const int64_t L  = ne10;
+    const int64_t OL = ne0;
+    const int64_t N  = ne2;
+
+    const int64_t nk     = IC*K;                         // length of the dot products
+    const int64_t nk_pad = GGML_PAD(nk, GGML_CONV_1D_PAD); // row size of the tile
+
+    GGML_ASSERT(nb00 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nb10 == sizeof(float));
+    GGML_ASSERT(nb0  == sizeof(float));
+
+    const float * bias = src2 ? (const float *) src2->data : NULL;
+
+    // each thread builds the im2col rows of a tile of GGML_CONV_1D_TILE output positions in its part of wdata
+    // and computes all output channels for them, the tile stays in cache while the kernel rows are streamed
+    // the last row of the thread's part holds a zero-padded copy of the current kernel row
+    ggml_fp16_t * const wdata  = (ggml_fp16_t *) ((char *) params->wdata + ith*(sizeof(ggml_fp16_t)*(GGML_CONV_1D_TILE + 1)*nk_pad + CACHE_LINE_SIZE));
+    ggml_fp16_t * const kernel = wdata + GGML_CONV_1D_TILE*nk_pad;
+
+    memset(wdata, 0, sizeof(ggml_fp16_t)*(GGML_CONV_1D_TILE + 1)*nk_pad);
+
+    const int64_t n_tiles_l = (OL + GGML_CONV_1D_TILE - 1)/GGML_CONV_1D_TILE;
+
+    for (int64_t it = ith; it < N*n_tiles_l; it += nth) {
+        const int64_t in  = it/n_tiles_l;
+        const int64_t ol0 = (it%n_tiles_l)*GGML_CONV_1D_TILE;
+        const int64_t ol1 = MIN(ol0 + GGML_CONV_1D_TILE, OL);
+
+        // im2col: [IC, L] => [ol1 - ol0, IC*K]
+        for (int64_t iic = 0; iic < IC; iic++) {
+            const float * const src_data = (const float *) ((const char *) src1->data + in*nb12 + iic*nb11);
+
+            for (int64_t iol = ol0; iol < ol1; iol++) {
+                ggml_fp16_t * dst_data = wdata + (iol - ol0)*nk_pad + iic*K;
+
+                for (int64_t ik = 0; ik < K; ik++) {
+                    const int64_t il = iol*s0 + ik*d0 - p0;
+
+                    dst_data[ik] = (il < 0 || il >= L) ? 0 : GGML_FP32_TO_FP16(src_data[il]);
+                }
+            }
+        }
+
+        for (int64_t ioc = 0; ioc < OC; ioc++) {
+            float * const dst_data = (float *) ((char *) dst->data + in*nb2 + ioc*nb1) + ol0;
+
+            memcpy(kernel, (const char *) src0->data + ioc*nb02, sizeof(ggml_fp16_t)*nk);
+
+            const float b = bias ? bias[ioc] : 0.0f;
+
+            for (int64_t iol = ol0; iol < ol1; iol++) {
+                float v = 0.0f;
+                ggml_vec_dot_f16(nk_pad, &v, 0, kernel, 0, wdata + (iol - ol0)*nk_pad, 0, 1);
+                dst_data[iol - ol0] = v + b;
+            }
+
+            if (gelu) {
+                ggml_vec_gelu_f32(ol1 - ol0, dst_data, dst_data);
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_conv_1d(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    switch (src0->type) {
+        case GGML_TYPE_F16:
+            {
+                ggml_compute_forward_conv_1d_f16_f32(params, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 // src0: kernel [OC, IC, KH, KW]
 // src1: image [N, IC, IH, IW]
 // dst:  result [N, OH, OW, IC*KH*KW]
@@ -15123,6 +15484,61 @@ static void ggml_compute_forward_argsort(
 
 // ggml_compute_forward_flash_attn_ext
 
+// the q rows of a (batch, K/V head) group are processed in tiles of up to GGML_FA_TILE_Q rows, so that each
+// K/V row is loaded once per tile instead of once per q row. the softmax is updated once per GGML_FA_TILE_KV
+// K/V rows. when there are too few tiles to balance them across the threads (e.g. single-token decode), the K/V
+// rows are additionally split in chunks of at least GGML_FA_CHUNK_MIN rows and the partial results are merged at the end
+#define GGML_FA_TILE_Q     8
+#define GGML_FA_TILE_KV    32
+#define GGML_FA_CHUNK_MIN  256
+
+struct ggml_flash_attn_ext_split {
+    int64_t nhg; // q heads per group (q heads that share the same K and V heads)
+    int64_t nrg; // q rows per group
+    int64_t ntg; // tiles per group
+    int64_t nt;  // total number of tiles
+    int64_t nc;  // number of K/V chunks per tile
+};
+
+static struct ggml_flash_attn_ext_split ggml_flash_attn_ext_get_split(
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        int nth) {
+    struct ggml_flash_attn_ext_split split;
+
+    const int64_t rk2 = q->ne[2]/k->ne[2];
+    const int64_t rv2 = q->ne[2]/v->ne[2];
+
+    split.nhg = rk2 == rv2 ? rk2 : 1;
+    split.nrg = split.nhg*q->ne[1];
+    split.ntg = (split.nrg + GGML_FA_TILE_Q - 1)/GGML_FA_TILE_Q;
+    split.nt  = split.ntg*(q->ne[2]/split.nhg)*q->ne[3];
+    split.nc  = 1;
+
+    if (split.nt < 4*nth) {
+        // few tiles (e.g. single-token decode with a few K/V heads): split the K/V rows so that the number of
+        // tasks is a multiple of the number of threads and every thread gets the same amount of work
+        int64_t a = split.nt;
+        int64_t b = nth;
+        while (b != 0) {
+            const int64_t t = a % b;
+            a = b;
+            b = t;
+        }
+
+        split.nc = MIN(nth/a, k->ne[1]/GGML_FA_CHUNK_MIN);
+        split.nc = MAX(split.nc, 1);
+    }
+
+    return split;
+}
+
+// per-thread scratch size of ggml_compute_forward_flash_attn_ext_f16 in floats
+static size_t ggml_flash_attn_ext_scratch_size(int64_t D) {
+    return (2*GGML_FA_TILE_Q + 1)*D + 2*GGML_FA_TILE_Q + 2*GGML_FA_TILE_Q*GGML_FA_TILE_KV + CACHE_LINE_SIZE_F32;
+}
+
 static void ggml_compute_forward_flash_attn_ext_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * q,
@@ -15174,17 +15590,16 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     const int64_t rv2 = neq2/nev2;
     const int64_t rv3 = neq3/nev3;
 
-    // parallelize by q rows using ggml_vec_dot_f32
-
-    // total rows in q
-    const int nr = neq1*neq2*neq3;
+    const struct ggml_flash_attn_ext_split split = ggml_flash_attn_ext_get_split(q, k, v, nth);
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
+    const int64_t nhg = split.nhg;
+    const int64_t nrg = split.nrg;
+    const int64_t ntg = split.ntg;
+    const int64_t nt  = split.nt;
+    const int64_t nc  = split.nc;
 
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    // K/V rows per chunk
+    const int64_t dc = (nek1 + nc - 1)/nc;
 
     float scale    = 1.0f;
     float max_bias = 0.0f;
@@ -15202,124 +15617,260 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     ggml_from_float_t const q_to_vec_dot   = type_traits[k_vec_dot_type].from_float;
     ggml_vec_dot_t    const kq_vec_dot     = type_traits[k->type].vec_dot;
     ggml_to_float_t   const v_to_float     = type_traits[v->type].to_float;
+    ggml_vec_mad_t    const v_mad_q        = type_traits[v->type].vec_mad; // fused dequantize + multiply-add of a V row
 
-    // loop over n_batch and n_head
-    for (int ir = ir0; ir < ir1; ++ir) {
-        // q indices
-        const int iq3 = ir/(neq2*neq1);
-        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
-        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
+    const size_t q_row_size = ggml_row_size(k_vec_dot_type, D);
 
-        const uint32_t h = iq2; // head index
-        const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+    float * VKQ32 = (float *) params->wdata + ith*ggml_flash_attn_ext_scratch_size(D); // FP32 VKQ accumulators [GGML_FA_TILE_Q][D]
+    float * V32   = VKQ32 + GGML_FA_TILE_Q*D;       // (temporary) FP32 V row
+    float * Ms    = V32   + D;                      // maximum KQ value of each row
+    float * Ss    = Ms    + GGML_FA_TILE_Q;         // softmax sum of each row
+    float * KQ    = Ss    + GGML_FA_TILE_Q;         // KQ values / softmax of the current and previous blocks [2][GGML_FA_TILE_Q][GGML_FA_TILE_KV]
+    char  * Q_q   = (char *) (KQ + 2*GGML_FA_TILE_Q*GGML_FA_TILE_KV); // Q rows converted to the K vec_dot type
 
-        float S = 0.0f;      // sum
-        float M = -INFINITY; // maximum KQ value
+    // partial results of the K/V chunks: [nt][nc][GGML_FA_TILE_Q][D + 2]
+    float * wpart = (float *) params->wdata + nth*ggml_flash_attn_ext_scratch_size(D);
 
-        float       * VKQ32 = (float       *) params->wdata + ith*(3*D + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulator
-        float       * V32   =                 (VKQ32 + 1*D); // (temporary) FP32 V buffer
-        ggml_fp16_t * VKQ16 = (ggml_fp16_t *) (VKQ32 + 1*D); // (temporary) FP16 VKQ accumulator
-        ggml_fp16_t * Q_q   = (ggml_fp16_t *) (VKQ32 + 2*D); // (temporary) buffer for Q converted to quantized/FP16
+    int64_t             iq1s[GGML_FA_TILE_Q];
+    int64_t             iq2s[GGML_FA_TILE_Q];
+    float               slopes[GGML_FA_TILE_Q];
+    const ggml_fp16_t * mps[GGML_FA_TILE_Q];
 
-        if (v->type == GGML_TYPE_F16) {
-            memset(VKQ16, 0, D*sizeof(ggml_fp16_t));
-        } else {
-            memset(VKQ32, 0, D*sizeof(float));
-        }
+    for (int64_t it = ith; it < nt*nc; it += nth) {
+        const int64_t ic = it % nc; // K/V chunk index
+        const int64_t ti = it / nc; // tile index
 
-        const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1]) : NULL;
+        // group (batch, K/V head) and first row of the tile within the group
+        const int64_t ig  = ti / ntg;
+        const int64_t il0 = (ti % ntg)*GGML_FA_TILE_Q;
+        const int64_t nr  = MIN(GGML_FA_TILE_Q, nrg - il0);
+
+        const int64_t iq3 = ig / (neq2/nhg);
+        const int64_t ih0 = (ig % (neq2/nhg))*nhg;
 
         // k indices
-        const int ik3 = iq3 / rk3;
-        const int ik2 = iq2 / rk2;
+        const int64_t ik3 = iq3 / rk3;
+        const int64_t ik2 = ih0 / rk2;
 
         // v indices
-        const int iv3 = iq3 / rv3;
-        const int iv2 = iq2 / rv2;
+        const int64_t iv3 = iq3 / rv3;
+        const int64_t iv2 = ih0 / rv2;
+
+        for (int64_t r = 0; r < nr; ++r) {
+            const int64_t iq1 = (il0 + r) % N;
+            const int64_t iq2 = ih0 + (il0 + r) / N;
+
+            const uint32_t h = iq2; // head index
+
+            iq1s[r]   = iq1;
+            iq2s[r]   = iq2;
+            slopes[r] = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+            mps[r]    = mask ? (const ggml_fp16_t *)((const char *) mask->data + iq1*mask->nb[1]) : NULL;
+
+            const float * pq = (const float *) ((const char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
+            q_to_vec_dot(pq, Q_q + r*q_row_size, D);
+
+            Ms[r] = -INFINITY;
+            Ss[r] = 0.0f;
+        }
+
+        memset(VKQ32, 0, nr*D*sizeof(float));
 
-        const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
-        q_to_vec_dot(pq, Q_q, D);
+        const int64_t ic0 = ic*dc;
+        const int64_t ic1 = MIN(ic0 + dc, nek1);
 
         // online softmax / attention
-        // loop over n_kv and n_head_kv
+        // the V rows of the previous block are accumulated while the K rows of the current block are processed,
+        // so that the K and V rows are streamed from memory together
         // ref: https://arxiv.org/pdf/2112.05682.pdf
-        for (int64_t ic = 0; ic < nek1; ++ic) {
-            const float mv = mp ? slope*GGML_FP16_TO_FP32(mp[ic]) : 0.0f;
-            if (mv == -INFINITY) {
-                continue;
-            }
+        float * KQ_cur  = KQ;
+        float * KQ_prev = KQ + GGML_FA_TILE_Q*GGML_FA_TILE_KV;
 
-            float s; // KQ value
+        int64_t nb_prev = 0; // K/V rows of the previous block that are left to accumulate
 
-            const char * k_data = (const char *) k->data + ( ic*nbk1 + ik2*nbk2 + ik3*nbk3);
-            kq_vec_dot(D, &s, 0, k_data, 0, Q_q, 0, 1);
+        for (int64_t ib0 = ic0; ib0 < ic1 || nb_prev > 0; ib0 += GGML_FA_TILE_KV) {
+            const int64_t nb = MAX(0, MIN(GGML_FA_TILE_KV, ic1 - ib0));
 
-            s = s*scale + mv; // scale KQ value and apply mask
+            bool any = false;
+            for (int64_t j = 0; j < MAX(nb, nb_prev); ++j) {
+                if (j < nb) {
+                    // KQ = K*Q, each K row is used for all the rows of the tile
+                    const char * k_data = (const char *) k->data + ((ib0 + j)*nbk1 + ik2*nbk2 + ik3*nbk3);
 
-            const float Mold = M;
+                    for (int64_t r = 0; r < nr; ++r) {
+                        const float mv = mps[r] ? slopes[r]*GGML_FP16_TO_FP32(mps[r][ib0 + j]) : 0.0f;
+                        if (mv == -INFINITY) {
+                            KQ_cur[r*GGML_FA_TILE_KV + j] = -INFINITY;
+                            continue;
+                        }
 
-            float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
-            float vs = 1.0f; // post-softmax KQ value, expf(s - M)
+                        float s; // KQ value
+                        kq_vec_dot(D, &s, 0, k_data, 0, Q_q + r*q_row_size, 0, 1);
 
-            const char * v_data = ((const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
+                        KQ_cur[r*GGML_FA_TILE_KV + j] = s*scale + mv; // scale KQ value and apply mask
+                        any = true;
+                    }
+                }
 
-            if (v->type== GGML_TYPE_F16) {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+                if (j < nb_prev) {
+                    // V += v*expf(s - M), each V row is used for all the rows of the tile
+                    bool used = false;
+                    for (int64_t r = 0; r < nr; ++r) {
+                        used = used || KQ_prev[r*GGML_FA_TILE_KV + j] != 0.0f;
+                    }
+                    if (!used) {
+                        continue;
+                    }
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f16(D, VKQ16, ms);
-                } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
-                }
+                    const char * v_data = (const char *) v->data + ((ib0 - GGML_FA_TILE_KV + j)*nbv1 + iv2*nbv2 + iv3*nbv3);
 
-                // V += v*expf(s - M)
-                ggml_vec_mad_f16(D, VKQ16, (const ggml_fp16_t *) v_data, vs);
-            } else {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+                    if (v_mad_q && nr == 1) {
+                        // single row: accumulate the quantized V row directly
+                        v_mad_q(D, VKQ32, v_data, KQ_prev[j]);
+                        continue;
+                    }
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f32(D, VKQ32, ms);
-                } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
+                    const float * vr = (const float *) v_data;
+                    if (v_mad_q) {
+                        memset(V32, 0, D*sizeof(float));
+                        v_mad_q(D, V32, v_data, 1.0f);
+                        vr = V32;
+                    } else if (v->type != GGML_TYPE_F32) {
+                        v_to_float(v_data, V32, D);
+                        vr = V32;
+                    }
+
+                    for (int64_t r = 0; r < nr; ++r) {
+                        const float vs = KQ_prev[r*GGML_FA_TILE_KV + j];
+                        if (vs != 0.0f) {
+                            ggml_vec_mad_f32(D, VKQ32 + r*D, vr, vs);
+                        }
+                    }
                 }
+            }
 
-                v_to_float(v_data, V32, D);
+            nb_prev = 0;
 
-                // V += v*expf(s - M)
-                ggml_vec_mad_f32(D, VKQ32, V32, vs);
+            if (!any) {
+                continue;
             }
 
-            S = S*ms + vs; // scale and increment sum with partial sum
-        }
+            // update the softmax of each row with the block
+            for (int64_t r = 0; r < nr; ++r) {
+                float * kq = KQ_cur + r*GGML_FA_TILE_KV;
 
-        if (v->type == GGML_TYPE_F16) {
-            for (int64_t d = 0; d < D; ++d) {
-                VKQ32[d] = GGML_FP16_TO_FP32(VKQ16[d]);
-            }
-        }
+                float M = Ms[r];
+                for (int64_t j = 0; j < nb; ++j) {
+                    M = MAX(M, kq[j]);
+                }
 
-        // V /= S
-        const float S_inv = 1.0f/S;
-        ggml_vec_scale_f32(D, VKQ32, S_inv);
+                if (M == -INFINITY) {
+                    // all the values so far are masked
+                    memset(kq, 0, nb*sizeof(float));
+                    continue;
+                }
 
-        // dst indices
-        const int i1 = iq1;
-        const int i2 = iq2;
-        const int i3 = iq3;
+                if (M > Ms[r]) {
+                    // new maximum, scale VKQ and KQ sum with expf(Mold - M)
+                    const float ms = expf(Ms[r] - M);
 
-        // original
-        //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
+                    ggml_vec_scale_f32(D, VKQ32 + r*D, ms);
+                    Ss[r] *= ms;
+                    Ms[r]  = M;
+                }
 
-        // permute(0, 2, 1, 3)
-        memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
+                // kq = expf(kq - M)
+                Ss[r] += (float) ggml_vec_soft_max_f32(nb, kq, kq, M);
+            }
+
+            float * tmp = KQ_prev;
+            KQ_prev = KQ_cur;
+            KQ_cur  = tmp;
+
+            nb_prev = nb;
+        }
+
+        if (nc > 1) {
+            // store the partial result of the chunk, merged after all the chunks have been processed
+            for (int64_t r = 0; r < nr; ++r) {
+                float * wp = wpart + ((ti*nc + ic)*GGML_FA_TILE_Q + r)*(D + 2);
+
+                wp[0] = Ms[r];
+                wp[1] = Ss[r];
+                memcpy(wp + 2, VKQ32 + r*D, D*sizeof(float));
+            }
+            continue;
+        }
+
+        for (int64_t r = 0; r < nr; ++r) {
+            float * VKQ = VKQ32 + r*D;
+
+            // V /= S
+            const float S_inv = 1.0f/Ss[r];
+            ggml_vec_scale_f32(D, VKQ, S_inv);
+
+            // dst indices
+            const int64_t i1 = iq1s[r];
+            const int64_t i2 = iq2s[r];
+            const int64_t i3 = iq3;
+
+            // original
+            //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
+
+            // permute(0, 2, 1, 3)
+            memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ, nb1);
+        }
+    }
+
+    if (nc == 1) {
+        return;
+    }
+
+    ggml_barrier(params->shared);
+
+    // merge the partial results of the chunks
+    for (int64_t ir = ith; ir < nt*GGML_FA_TILE_Q; ir += nth) {
+        const int64_t ti = ir / GGML_FA_TILE_Q;
+        const int64_t r  = ir % GGML_FA_TILE_Q;
+
+        const int64_t ig  = ti / ntg;
+        const int64_t il  = (ti % ntg)*GGML_FA_TILE_Q + r;
+        if (il >= nrg) {
+            continue;
+        }
+
+        float M = -INFINITY;
+        for (int64_t ic = 0; ic < nc; ++ic) {
+            M = MAX(M, wpart[((ti*nc + ic)*GGML_FA_TILE_Q + r)*(D + 2)]);
+        }
+
+        float * VKQ = VKQ32;
+        memset(VKQ, 0, D*sizeof(float));
+
+        float S = 0.0f;
+        for (int64_t ic = 0; ic < nc; ++ic) {
+            const float * wp = wpart + ((ti*nc + ic)*GGML_FA_TILE_Q + r)*(D + 2);
+            if (wp[0] == -INFINITY) {
+                continue;
+            }
+
+            const float ms = expf(wp[0] - M);
+
+            S += wp[1]*ms;
+            ggml_vec_mad_f32(D, VKQ, wp + 2, ms);
+        }
+
+        // V /= S
+        const float S_inv = 1.0f/S;
+        ggml_vec_scale_f32(D, VKQ, S_inv);
+
+        // dst indices
+        const int64_t i1 = il % N;
+        const int64_t i2 = (ig % (neq2/nhg))*nhg + il / N;
+        const int64_t i3 = ig / (neq2/nhg);
+
+        // permute(0, 2, 1, 3)
+        memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ, nb1);
     }
 }
 
@@ -16806,6 +17357,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_clamp(params, tensor);
             } break;
+        case GGML_OP_CONV_1D:
+            {
+                ggml_compute_forward_conv_1d(params, tensor);
+            } break;
         case GGML_OP_CONV_TRANSPOSE_1D:
             {
                 ggml_compute_forward_conv_transpose_1d(params, tensor);
@@ -16960,6 +17515,177 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
     }
 }
 
+// fused nodes
+//
+// nodes that are computed together by each thread, without a barrier between them (see ggml_graph_get_fusion)
+// every node still writes its own result, so the other consumers of the intermediate tensors are not affected
+
+#define GGML_FUSION_MAX_NODES 3
+
+enum ggml_fusion_type {
+    GGML_FUSION_NONE,     // a single node
+    GGML_FUSION_RMS_NORM, // [add ->] rms_norm [-> mul], row by row
+    GGML_FUSION_GLU,      // silu/gelu -> mul, row by row
+};
+
+struct ggml_fusion {
+    enum ggml_fusion_type type;
+
+    int n_nodes; // 0 if the node is computed later, together with its consumer
+    struct ggml_tensor * nodes[GGML_FUSION_MAX_NODES];
+};
+
+// row (i1, i2, i3) of a F32 tensor, broadcast along the dims of size 1
+static inline float * ggml_fusion_row(const struct ggml_tensor * t, int64_t i1, int64_t i2, int64_t i3) {
+    return (float *) ((char *) t->data + (i1 % t->ne[1])*t->nb[1] + (i2 % t->ne[2])*t->nb[2] + (i3 % t->ne[3])*t->nb[3]);
+}
+
+static void ggml_compute_forward_fused_rms_norm(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * add,
+        struct ggml_tensor * norm,
+        struct ggml_tensor * mul) {
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t ne0 = norm->ne[0];
+    const int64_t ne1 = norm->ne[1];
+    const int64_t ne2 = norm->ne[2];
+
+    const int64_t nr = ggml_nrows(norm);
+
+    float eps;
+    memcpy(&eps, norm->op_params, sizeof(float));
+
+    GGML_ASSERT(eps > 0.0f);
+
+    // rows per thread
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i3 = ir/(ne2*ne1);
+        const int64_t i2 = (ir - i3*ne2*ne1)/ne1;
+        const int64_t i1 = (ir - i3*ne2*ne1 - i2*ne1);
+
+        if (add) {
+            const int64_t ne10 = add->src[1]->ne[0];
+
+            float * a = ggml_fusion_row(add->src[0], i1, i2, i3);
+            float * b = ggml_fusion_row(add->src[1], i1, i2, i3);
+            float * c = ggml_fusion_row(add,         i1, i2, i3);
+
+            for (int64_t r = 0; r < ne0/ne10; ++r) {
+                ggml_vec_add_f32(ne10, c + r*ne10, a + r*ne10, b);
+            }
+        }
+
+        const float * x = ggml_fusion_row(norm->src[0], i1, i2, i3);
+              float * y = ggml_fusion_row(norm,         i1, i2, i3);
+
+        ggml_float sum = 0.0;
+        for (int64_t i0 = 0; i0 < ne0; i0++) {
+            sum += (ggml_float)(x[i0] * x[i0]);
+        }
+
+        const float mean  = sum/ne0;
+        const float scale = 1.0f/sqrtf(mean + eps);
+
+        if (y != x) {
+            memcpy(y, x, ne0 * sizeof(float));
+        }
+
+        ggml_vec_scale_f32(ne0, y, scale);
+
+        if (mul) {
+            const int64_t ne10 = mul->src[1]->ne[0];
+
+            float * w = ggml_fusion_row(mul->src[1], i1, i2, i3);
+            float * z = ggml_fusion_row(mul,         i1, i2, i3);
+
+            for (int64_t r = 0; r < ne0/ne10; ++r) {
+                ggml_vec_mul_f32(ne10, z + r*ne10, y + r*ne10, w);
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_fused_glu(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * act,
+        struct ggml_tensor * mul) {
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t ne0 = act->ne[0];
+    const int64_t ne1 = act->ne[1];
+    const int64_t ne2 = act->ne[2];
+
+    const int64_t ne10 = mul->src[1]->ne[0];
+
+    const int64_t nr = ggml_nrows(act);
+
+    const enum ggml_unary_op op = ggml_get_unary_op(act);
+
+    // rows per thread
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i3 = ir/(ne2*ne1);
+        const int64_t i2 = (ir - i3*ne2*ne1)/ne1;
+        const int64_t i1 = (ir - i3*ne2*ne1 - i2*ne1);
+
+        const float * x = ggml_fusion_row(act->src[0], i1, i2, i3);
+              float * y = ggml_fusion_row(act,         i1, i2, i3);
+
+        switch (op) {
+            case GGML_UNARY_OP_SILU: ggml_vec_silu_f32(ne0, y, x); break;
+            case GGML_UNARY_OP_GELU: ggml_vec_gelu_f32(ne0, y, x); break;
+            default: GGML_ASSERT(false && "unsupported activation");
+        }
+
+        float * w = ggml_fusion_row(mul->src[1], i1, i2, i3);
+        float * z = ggml_fusion_row(mul,         i1, i2, i3);
+
+        for (int64_t r = 0; r < ne0/ne10; ++r) {
+            ggml_vec_mul_f32(ne10, z + r*ne10, y + r*ne10, w);
+        }
+    }
+}
+
+static void ggml_compute_forward_fused(struct ggml_compute_params * params, const struct ggml_fusion * fusion) {
+    switch (fusion->type) {
+        case GGML_FUSION_NONE:
+            {
+                GGML_ASSERT(fusion->n_nodes == 1);
+                ggml_compute_forward(params, fusion->nodes[0]);
+            } break;
+        case GGML_FUSION_RMS_NORM:
+            {
+                const bool has_add = fusion->nodes[0]->op == GGML_OP_ADD;
+                const bool has_mul = fusion->nodes[fusion->n_nodes - 1]->op == GGML_OP_MUL;
+
+                ggml_compute_forward_fused_rms_norm(params,
+                        has_add ? fusion->nodes[0] : NULL,
+                        fusion->nodes[has_add ? 1 : 0],
+                        has_mul ? fusion->nodes[fusion->n_nodes - 1] : NULL);
+            } break;
+        case GGML_FUSION_GLU:
+            {
+                ggml_compute_forward_fused_glu(params, fusion->nodes[0], fusion->nodes[1]);
+            } break;
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static size_t ggml_hash_size(size_t min_sz) {
@@ -17806,6 +18532,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
+        case GGML_OP_CONV_1D:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_CONV_TRANSPOSE_1D:
             {
                 GGML_ASSERT(false); // TODO: not implemented
@@ -18414,7 +19144,129 @@ static void set_numa_thread_affinity(int thread_n) { UNUSED(thread_n);  }
 static void clear_numa_thread_affinity(void) {}
 #endif
 
-static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
+// thread placement for the workers of ggml_threadpool, applied by each worker to itself
+
+static bool ggml_thread_cpumask_is_valid(const bool * mask) {
+    for (int i = 0; i < GGML_MAX_N_THREADS; i++) {
+        if (mask[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// mask of the next thread: the whole global mask, or with strict_cpu the next CPU of it (round-robin)
+static void ggml_thread_cpumask_next(const bool * global_mask, bool * local_mask, bool strict, int32_t * iter) {
+    if (!strict) {
+        memcpy(local_mask, global_mask, GGML_MAX_N_THREADS);
+        return;
+    }
+
+    memset(local_mask, 0, GGML_MAX_N_THREADS);
+    for (int i = 0; i < GGML_MAX_N_THREADS; i++) {
+        const int idx = (*iter + i) % GGML_MAX_N_THREADS;
+        if (global_mask[idx]) {
+            local_mask[idx] = true;
+            *iter = idx + 1;
+            return;
+        }
+    }
+}
+
+#if defined(__linux__)
+static bool ggml_thread_apply_affinity(const bool * mask) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int i = 0; i < GGML_MAX_N_THREADS && i < CPU_SETSIZE; i++) {
+        if (mask[i]) {
+            CPU_SET(i, &cpus);
+        }
+    }
+
+    // on Linux the affinity is per thread, 0 is the calling thread
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+        fprintf(stderr, "warning: failed to set thread affinity: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static bool ggml_thread_apply_priority(enum ggml_sched_priority prio) {
+    int rv = 0;
+    switch (prio) {
+        case GGML_SCHED_PRIO_NORMAL:   return true;
+        case GGML_SCHED_PRIO_MEDIUM:   rv = setpriority(PRIO_PROCESS, 0,  -5); break;
+        case GGML_SCHED_PRIO_HIGH:     rv = setpriority(PRIO_PROCESS, 0, -10); break;
+        case GGML_SCHED_PRIO_REALTIME:
+            {
+                struct sched_param param = { .sched_priority = sched_get_priority_min(SCHED_FIFO) };
+                rv = sched_setscheduler(0, SCHED_FIFO, &param);
+            } break;
+    }
+
+    if (rv != 0) {
+        fprintf(stderr, "warning: failed to set thread priority %d: %s\n", (int) prio, strerror(errno));
+        return false;
+    }
+    return true;
+}
+#elif defined(_WIN32)
+static bool ggml_thread_apply_affinity(const bool * mask) {
+    // only the first processor group is supported
+    DWORD_PTR bitmask = 0;
+    for (int i = 0; i < GGML_MAX_N_THREADS && i < (int) (8*sizeof(DWORD_PTR)); i++) {
+        if (mask[i]) {
+            bitmask |= (DWORD_PTR) 1 << i;
+        }
+    }
+
+    if (bitmask == 0 || SetThreadAffinityMask(GetCurrentThread(), bitmask) == 0) {
+        fprintf(stderr, "warning: failed to set thread affinity mask 0x%llx\n", (unsigned long long) bitmask);
+        return false;
+    }
+    return true;
+}
+
+static bool ggml_thread_apply_priority(enum ggml_sched_priority prio) {
+    int p = THREAD_PRIORITY_NORMAL;
+    switch (prio) {
+        case GGML_SCHED_PRIO_NORMAL:   return true;
+        case GGML_SCHED_PRIO_MEDIUM:   p = THREAD_PRIORITY_ABOVE_NORMAL;  break;
+        case GGML_SCHED_PRIO_HIGH:     p = THREAD_PRIORITY_HIGHEST;       break;
+        case GGML_SCHED_PRIO_REALTIME: p = THREAD_PRIORITY_TIME_CRITICAL; break;
+    }
+
+    if (!SetThreadPriority(GetCurrentThread(), p)) {
+        fprintf(stderr, "warning: failed to set thread priority %d\n", (int) prio);
+        return false;
+    }
+    return true;
+}
+#else
+// no per-thread affinity on the other platforms (macOS only has affinity hints), the threads keep the inherited one
+static bool ggml_thread_apply_affinity(const bool * mask) {
+    UNUSED(mask);
+    fprintf(stderr, "warning: thread affinity is not supported on this platform\n");
+    return false;
+}
+
+static bool ggml_thread_apply_priority(enum ggml_sched_priority prio) {
+    if (prio != GGML_SCHED_PRIO_NORMAL) {
+        fprintf(stderr, "warning: thread priority is not supported on this platform\n");
+        return false;
+    }
+    return true;
+}
+#endif
+
+static void ggml_thread_apply_placement(const bool * mask, enum ggml_sched_priority prio) {
+    if (ggml_thread_cpumask_is_valid(mask)) {
+        ggml_thread_apply_affinity(mask);
+    }
+    ggml_thread_apply_priority(prio);
+}
+
+static int ggml_get_n_tasks(const struct ggml_tensor * node, int n_threads) {
     int n_tasks = 0;
 
     if (ggml_is_empty(node)) {
@@ -18520,9 +19372,14 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
             } break;
         case GGML_OP_SOFT_MAX:
             {
-                n_tasks = MIN(n_threads, ggml_nrows(node->src[0]));
+                if (ggml_soft_max_n_split(ggml_nrows(node->src[0]), node->src[0]->ne[0], n_threads) > 1) {
+                    n_tasks = n_threads;
+                } else {
+                    n_tasks = MIN(n_threads, ggml_nrows(node->src[0]));
+                }
             } break;
         case GGML_OP_IM2COL:
+        case GGML_OP_CONV_1D:
         case GGML_OP_CONV_TRANSPOSE_1D:
         case GGML_OP_CONV_TRANSPOSE_2D:
             {
@@ -18616,172 +19473,570 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
     return n_tasks;
 }
 
-struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threads) {
-    if (n_threads <= 0) {
-        n_threads = GGML_DEFAULT_N_THREADS;
-    }
+// size of the work buffer used by a node, including the padding between the parts of the threads
+static size_t ggml_graph_node_work_size(const struct ggml_tensor * node, int n_threads) {
+    const int n_tasks = ggml_get_n_tasks(node, n_threads);
 
-    size_t work_size = 0;
+    size_t cur = 0;
 
-    struct ggml_cplan cplan;
-    memset(&cplan, 0, sizeof(struct ggml_cplan));
+    switch (node->op) {
+        case GGML_OP_CPY:
+        case GGML_OP_DUP:
+            {
+                if (ggml_is_quantized(node->type) ||
+                    // F16 -> BF16 and BF16 -> F16 copies go through intermediate F32
+                    (node->src[0]->type == GGML_TYPE_F16  && node->src[1] && node->src[1]->type == GGML_TYPE_BF16) ||
+                    (node->src[0]->type == GGML_TYPE_BF16 && node->src[1] && node->src[1]->type == GGML_TYPE_F16)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_ACC:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_MUL_MAT:
+            {
+                const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
 
-    int max_tasks = 1;
+                if (node->src[1]->type != vec_dot_type) {
+                    cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
+                }
+            } break;
+        case GGML_OP_MUL_MAT_ID:
+            {
+                cur = 0;
+                const struct ggml_tensor * src0 = node->src[0];
+                const struct ggml_tensor * src1 = node->src[1];
+                const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
+                if (src1->type != vec_dot_type) {
+                    cur += ggml_row_size(vec_dot_type, ggml_nelements(src1));
+                }
+                const int n_as = src0->ne[2];
+                cur += GGML_PAD(cur, sizeof(int64_t));       // align
+                cur += n_as * sizeof(int64_t);               // matrix_row_counts
+                cur += n_as * src1->ne[2] * sizeof(int64_t); // matrix_rows
+            } break;
+        case GGML_OP_OUT_PROD:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_ROPE:
+            {
+                cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+            } break;
+        case GGML_OP_CONV_1D:
+            {
+                const int64_t ne00 = node->src[0]->ne[0]; // K
+                const int64_t ne01 = node->src[0]->ne[1]; // Cin
 
-    // thread scheduling for the different operations + work buffer size estimation
-    for (int i = 0; i < cgraph->n_nodes; i++) {
-        struct ggml_tensor * node = cgraph->nodes[i];
+                cur = sizeof(ggml_fp16_t)*(GGML_CONV_1D_TILE + 1)*GGML_PAD(ne00*ne01, GGML_CONV_1D_PAD)*n_tasks;
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_1D:
+            {
+                GGML_ASSERT(node->src[0]->ne[3] == 1);
+                GGML_ASSERT(node->src[1]->ne[2] == 1);
+                GGML_ASSERT(node->src[1]->ne[3] == 1);
+
+                const int64_t ne00 = node->src[0]->ne[0];  // K
+                const int64_t ne01 = node->src[0]->ne[1];  // Cout
+                const int64_t ne02 = node->src[0]->ne[2];  // Cin
+
+                const int64_t ne10 = node->src[1]->ne[0];  // L
+                const int64_t ne11 = node->src[1]->ne[1];  // Cin
+
+                if ((node->src[0]->type == GGML_TYPE_F16 ||
+                     node->src[0]->type == GGML_TYPE_BF16) &&
+                    node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
+                    cur += sizeof(ggml_fp16_t)*ne10*ne11;
+                } else if (node->src[0]->type == GGML_TYPE_F32 &&
+                           node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(float)*ne00*ne01*ne02;
+                    cur += sizeof(float)*ne10*ne11;
+                } else {
+                    GGML_ASSERT(false);
+                }
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_2D:
+            {
+                const int64_t ne00 = node->src[0]->ne[0]; // W
+                const int64_t ne01 = node->src[0]->ne[1]; // H
+                const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
+                const int64_t ne03 = node->src[0]->ne[3]; // Channels In
 
-        const int n_tasks = ggml_get_n_tasks(node, n_threads);
+                const int64_t ne10 = node->src[1]->ne[0]; // W
+                const int64_t ne11 = node->src[1]->ne[1]; // H
+                const int64_t ne12 = node->src[1]->ne[2]; // Channels In
 
-        max_tasks = MAX(max_tasks, n_tasks);
+                cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
+                cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
+            } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                const int64_t ne00 = node->src[0]->ne[0]; // D
 
-        size_t cur = 0;
+                const struct ggml_flash_attn_ext_split split =
+                    ggml_flash_attn_ext_get_split(node->src[0], node->src[1], node->src[2], n_tasks);
 
-        switch (node->op) {
-            case GGML_OP_CPY:
-            case GGML_OP_DUP:
-                {
-                    if (ggml_is_quantized(node->type) ||
-                        // F16 -> BF16 and BF16 -> F16 copies go through intermediate F32
-                        (node->src[0]->type == GGML_TYPE_F16  && node->src[1] && node->src[1]->type == GGML_TYPE_BF16) ||
-                        (node->src[0]->type == GGML_TYPE_BF16 && node->src[1] && node->src[1]->type == GGML_TYPE_F16)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_ADD:
-            case GGML_OP_ADD1:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_ACC:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_MUL_MAT:
-                {
-                    const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
+                cur = sizeof(float)*ggml_flash_attn_ext_scratch_size(ne00)*n_tasks; // Q/VKQ tiles + KQ block /thread
+                if (split.nc > 1) {
+                    cur += sizeof(float)*(ne00 + 2)*GGML_FA_TILE_Q*split.nt*split.nc; // partial results of the K/V chunks
+                }
+            } break;
+        case GGML_OP_FLASH_ATTN_BACK:
+            {
+                const int64_t    D = node->src[0]->ne[0];
+                const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+                const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_BF16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                }
+            } break;
 
-                    if (node->src[1]->type != vec_dot_type) {
-                        cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
-                    }
-                } break;
-            case GGML_OP_MUL_MAT_ID:
-                {
-                    cur = 0;
-                    const struct ggml_tensor * src0 = node->src[0];
-                    const struct ggml_tensor * src1 = node->src[1];
-                    const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
-                    if (src1->type != vec_dot_type) {
-                        cur += ggml_row_size(vec_dot_type, ggml_nelements(src1));
+        case GGML_OP_CROSS_ENTROPY_LOSS:
+            {
+                cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
+            } break;
+        case GGML_OP_COUNT:
+            {
+                GGML_ASSERT(false);
+            } break;
+        default:
+            break;
+    }
+
+    return cur > 0 ? cur + CACHE_LINE_SIZE*(n_threads - 1) : 0;
+}
+
+static size_t ggml_graph_get_schedule_impl(const struct ggml_cgraph * cgraph, int n_threads, size_t work_size, int * phase, int * group);
+
+struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = GGML_DEFAULT_N_THREADS;
+    }
+
+    size_t work_size = 0;
+
+    struct ggml_cplan cplan;
+    memset(&cplan, 0, sizeof(struct ggml_cplan));
+
+    int max_tasks = 1;
+
+    // thread scheduling for the different operations + work buffer size estimation
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        const int n_tasks = ggml_get_n_tasks(node, n_threads);
+
+        max_tasks = MAX(max_tasks, n_tasks);
+
+        work_size = MAX(work_size, ggml_graph_node_work_size(node, n_threads));
+    }
+
+    cplan.n_threads = MIN(max_tasks, n_threads);
+
+    // the nodes of a phase use separate parts of the work buffer
+    if (cplan.n_threads > 1) {
+        work_size = MAX(work_size, ggml_graph_get_schedule_impl(cgraph, cplan.n_threads, SIZE_MAX, NULL, NULL));
+    }
+
+    cplan.work_size = work_size;
+    cplan.work_data = NULL;
+
+    return cplan;
+}
+
+// nodes that are not computed at all
+static bool ggml_graph_node_is_noop(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_VIEW:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return ggml_is_empty(node);
+    }
+}
+
+// nodes that can run in the same phase as other independent nodes
+// each node of a phase gets its own part of the work buffer and its own chunk counter, and all threads compute
+// the nodes of a phase in the same order, so the barriers inside of mul_mat and mul_mat_id are reached by all of them
+static bool ggml_graph_node_can_share_phase(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+            return !ggml_is_quantized(node->src[0]->type);
+        case GGML_OP_DUP:
+        case GGML_OP_CPY:
+        case GGML_OP_CONT:
+            return !ggml_is_quantized(node->type);
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+        case GGML_OP_SQR:
+        case GGML_OP_SQRT:
+        case GGML_OP_LOG:
+        case GGML_OP_SCALE:
+        case GGML_OP_CLAMP:
+        case GGML_OP_CONCAT:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_UNARY:
+        case GGML_OP_ROPE:
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_ID:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool ggml_tensor_data_overlaps(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (a->data == NULL || b->data == NULL) {
+        return true;
+    }
+
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// true if one of the nodes reads or writes memory that the other one writes
+// this catches both the graph edges (including views) and memory reused by the allocator
+static bool ggml_graph_nodes_conflict(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (ggml_tensor_data_overlaps(a, b)) {
+        return true;
+    }
+
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        if (a->src[i] && ggml_tensor_data_overlaps(a->src[i], b)) {
+            return true;
+        }
+        if (b->src[i] && ggml_tensor_data_overlaps(a, b->src[i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// fusion of consecutive dependent nodes
+//
+// like the phases, this is decided by every thread from the graph alone:
+//  - [add ->] rms_norm [-> mul] on consecutive nodes are computed row by row in a single pass
+//  - silu/gelu is moved to its mul consumer (the up projection is usually computed in between),
+//    and both are computed row by row
+// a node is moved only over nodes that do not use its result or overwrite its inputs
+
+// max distance a node is moved to its consumer
+#define GGML_FUSION_MAX_DEFER 8
+
+// the fused kernels compute all nodes of a row in the same thread, so memory shared between the nodes
+// is only allowed for the same rows (in-place nodes), never for rows that another thread computes
+static bool ggml_fusion_rows_compatible(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (!ggml_tensor_data_overlaps(a, b)) {
+        return true;
+    }
+
+    return a->data == b->data && ggml_are_same_shape(a, b) &&
+        a->nb[1] == b->nb[1] && a->nb[2] == b->nb[2] && a->nb[3] == b->nb[3];
+}
+
+static bool ggml_fusion_rows_valid(const struct ggml_fusion * fusion) {
+    const struct ggml_tensor * node0 = fusion->nodes[0];
+
+    for (int f = 0; f < fusion->n_nodes; ++f) {
+        const struct ggml_tensor * node = fusion->nodes[f];
+
+        if (node->type != GGML_TYPE_F32 || node->nb[0] != sizeof(float) || !ggml_are_same_shape(node, node0)) {
+            return false;
+        }
+
+        for (int s = 0; s < GGML_MAX_SRC && node->src[s]; ++s) {
+            const struct ggml_tensor * src = node->src[s];
+
+            if (src->type != GGML_TYPE_F32 || src->nb[0] != sizeof(float) || !ggml_can_repeat(src, node)) {
+                return false;
+            }
+        }
+
+        for (int p = 0; p < f; ++p) {
+            const struct ggml_tensor * prev = fusion->nodes[p];
+
+            if (!ggml_fusion_rows_compatible(prev, node)) {
+                return false;
+            }
+
+            for (int s = 0; s < GGML_MAX_SRC; ++s) {
+                if (prev->src[s] && !ggml_fusion_rows_compatible(prev->src[s], node)) {
+                    return false;
+                }
+                if (node->src[s] && !ggml_fusion_rows_compatible(node->src[s], prev)) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+// check if node i can be computed right before node k
+static bool ggml_fusion_can_defer(const struct ggml_cgraph * cgraph, int i, int k) {
+    for (int j = i + 1; j < k; ++j) {
+        if (ggml_graph_nodes_conflict(cgraph->nodes[j], cgraph->nodes[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// index of the mul that silu/gelu node i is moved to, or -1
+static int ggml_fusion_glu_consumer(const struct ggml_cgraph * cgraph, int i) {
+    struct ggml_tensor * node = cgraph->nodes[i];
+
+    const enum ggml_unary_op op = ggml_get_unary_op(node);
+
+    if (op != GGML_UNARY_OP_SILU && op != GGML_UNARY_OP_GELU) {
+        return -1;
+    }
+
+    const int k_end = MIN(i + GGML_FUSION_MAX_DEFER, cgraph->n_nodes - 1);
+
+    for (int k = i + 1; k <= k_end; ++k) {
+        if (cgraph->nodes[k]->op == GGML_OP_MUL && cgraph->nodes[k]->src[0] == node) {
+            const struct ggml_fusion fusion = { GGML_FUSION_GLU, 2, { node, cgraph->nodes[k] } };
+
+            return ggml_fusion_rows_valid(&fusion) && ggml_fusion_can_defer(cgraph, i, k) ? k : -1;
+        }
+    }
+
+    return -1;
+}
+
+// get the nodes that are computed at node i, returns the number of graph nodes consumed
+static int ggml_graph_get_fusion(const struct ggml_cgraph * cgraph, int i, struct ggml_fusion * fusion) {
+    struct ggml_tensor * node = cgraph->nodes[i];
+
+    fusion->type     = GGML_FUSION_NONE;
+    fusion->n_nodes  = 1;
+    fusion->nodes[0] = node;
+
+    switch (node->op) {
+        case GGML_OP_ADD:
+        case GGML_OP_RMS_NORM:
+            {
+                struct ggml_fusion chain = { GGML_FUSION_RMS_NORM, 1, { node } };
+
+                int j = i + 1;
+
+                if (node->op == GGML_OP_ADD) {
+                    if (j >= cgraph->n_nodes || cgraph->nodes[j]->op != GGML_OP_RMS_NORM || cgraph->nodes[j]->src[0] != node) {
+                        break;
                     }
-                    const int n_as = src0->ne[2];
-                    cur += GGML_PAD(cur, sizeof(int64_t));       // align
-                    cur += n_as * sizeof(int64_t);               // matrix_row_counts
-                    cur += n_as * src1->ne[2] * sizeof(int64_t); // matrix_rows
-                } break;
-            case GGML_OP_OUT_PROD:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                    chain.nodes[chain.n_nodes++] = cgraph->nodes[j++];
+                }
+
+                if (j < cgraph->n_nodes && cgraph->nodes[j]->op == GGML_OP_MUL && cgraph->nodes[j]->src[0] == chain.nodes[chain.n_nodes - 1]) {
+                    chain.nodes[chain.n_nodes++] = cgraph->nodes[j++];
+                }
+
+                // drop the trailing mul if the full chain cannot be fused
+                for (; chain.n_nodes > 1; chain.n_nodes--) {
+                    if (ggml_fusion_rows_valid(&chain)) {
+                        *fusion = chain;
+                        return chain.n_nodes;
                     }
-                } break;
-            case GGML_OP_SOFT_MAX:
-            case GGML_OP_ROPE:
-                {
-                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_1D:
-                {
-                    GGML_ASSERT(node->src[0]->ne[3] == 1);
-                    GGML_ASSERT(node->src[1]->ne[2] == 1);
-                    GGML_ASSERT(node->src[1]->ne[3] == 1);
-
-                    const int64_t ne00 = node->src[0]->ne[0];  // K
-                    const int64_t ne01 = node->src[0]->ne[1];  // Cout
-                    const int64_t ne02 = node->src[0]->ne[2];  // Cin
-
-                    const int64_t ne10 = node->src[1]->ne[0];  // L
-                    const int64_t ne11 = node->src[1]->ne[1];  // Cin
-
-                    if ((node->src[0]->type == GGML_TYPE_F16 ||
-                         node->src[0]->type == GGML_TYPE_BF16) &&
-                        node->src[1]->type == GGML_TYPE_F32) {
-                        cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
-                        cur += sizeof(ggml_fp16_t)*ne10*ne11;
-                    } else if (node->src[0]->type == GGML_TYPE_F32 &&
-                               node->src[1]->type == GGML_TYPE_F32) {
-                        cur += sizeof(float)*ne00*ne01*ne02;
-                        cur += sizeof(float)*ne10*ne11;
-                    } else {
-                        GGML_ASSERT(false);
+                }
+            } break;
+        case GGML_OP_UNARY:
+            {
+                if (ggml_fusion_glu_consumer(cgraph, i) >= 0) {
+                    fusion->n_nodes = 0;
+                }
+            } break;
+        case GGML_OP_MUL:
+            {
+                if (node->src[0]->op != GGML_OP_UNARY) {
+                    break;
+                }
+
+                for (int j = i - 1; j >= MAX(0, i - GGML_FUSION_MAX_DEFER); --j) {
+                    if (cgraph->nodes[j] == node->src[0]) {
+                        if (ggml_fusion_glu_consumer(cgraph, j) == i) {
+                            fusion->type     = GGML_FUSION_GLU;
+                            fusion->n_nodes  = 2;
+                            fusion->nodes[0] = cgraph->nodes[j];
+                            fusion->nodes[1] = node;
+                        }
+                        break;
                     }
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_2D:
-                {
-                    const int64_t ne00 = node->src[0]->ne[0]; // W
-                    const int64_t ne01 = node->src[0]->ne[1]; // H
-                    const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
-                    const int64_t ne03 = node->src[0]->ne[3]; // Channels In
+                }
+            } break;
+        default:
+            break;
+    }
 
-                    const int64_t ne10 = node->src[1]->ne[0]; // W
-                    const int64_t ne11 = node->src[1]->ne[1]; // H
-                    const int64_t ne12 = node->src[1]->ne[2]; // Channels In
+    return 1;
+}
 
-                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
-                    cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
-                } break;
-            case GGML_OP_FLASH_ATTN_EXT:
-                {
-                    const int64_t ne00 = node->src[0]->ne[0]; // D
+static bool ggml_fusion_is_noop(const struct ggml_fusion * fusion) {
+    for (int f = 0; f < fusion->n_nodes; ++f) {
+        if (!ggml_graph_node_is_noop(fusion->nodes[f])) {
+            return false;
+        }
+    }
 
-                    cur = 3*sizeof(float)*ne00*n_tasks; // 3x head size/thread
-                } break;
-            case GGML_OP_FLASH_ATTN_BACK:
-                {
-                    const int64_t    D = node->src[0]->ne[0];
-                    const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
-                    const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_BF16) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    }
-                } break;
+    return true;
+}
 
-            case GGML_OP_CROSS_ENTROPY_LOSS:
-                {
-                    cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
-                } break;
-            case GGML_OP_COUNT:
-                {
-                    GGML_ASSERT(false);
-                } break;
-            default:
-                break;
+// part of the work buffer used by the nodes computed together
+static size_t ggml_fusion_work_size(const struct ggml_fusion * fusion, int n_threads) {
+    size_t size = 0;
+
+    for (int f = 0; f < fusion->n_nodes; ++f) {
+        size = MAX(size, ggml_graph_node_work_size(fusion->nodes[f], n_threads));
+    }
+
+    return GGML_PAD(size, CACHE_LINE_SIZE);
+}
+
+// check if node i can start without a barrier after the nodes [i_start, i) of the current phase
+// wsize_free is the part of the work buffer that the nodes of the phase do not use yet
+// all threads evaluate this on the same graph, so they agree on where the barriers are
+static bool ggml_graph_phase_can_extend(const struct ggml_cgraph * cgraph, int i_start, int i, int n_threads, size_t wsize_free) {
+    struct ggml_fusion fusion;
+    ggml_graph_get_fusion(cgraph, i, &fusion);
+
+    if (ggml_fusion_work_size(&fusion, n_threads) > wsize_free) {
+        return false;
+    }
+
+    // nodes that are not computed here never need a barrier
+    bool is_noop = true;
+
+    for (int f = 0; f < fusion.n_nodes; ++f) {
+        const struct ggml_tensor * node = fusion.nodes[f];
+
+        if (ggml_graph_node_is_noop(node)) {
+            continue;
+        }
+
+        if (!ggml_graph_node_can_share_phase(node)) {
+            return false;
         }
 
-        work_size = MAX(work_size, cur);
+        is_noop = false;
     }
 
-    if (work_size > 0) {
-        work_size += CACHE_LINE_SIZE*(n_threads - 1);
+    if (is_noop) {
+        return true;
     }
 
-    cplan.n_threads = MIN(max_tasks, n_threads);
-    cplan.work_size = work_size;
-    cplan.work_data = NULL;
+    int n_computed = 0;
 
-    return cplan;
+    for (int j = i_start; j < i; ) {
+        struct ggml_fusion prev_fusion;
+        j += ggml_graph_get_fusion(cgraph, j, &prev_fusion);
+
+        for (int p = 0; p < prev_fusion.n_nodes; ++p) {
+            const struct ggml_tensor * prev = prev_fusion.nodes[p];
+
+            if (ggml_graph_node_is_noop(prev)) {
+                continue;
+            }
+
+            if (!ggml_graph_node_can_share_phase(prev)) {
+                return false;
+            }
+
+            for (int f = 0; f < fusion.n_nodes; ++f) {
+                const struct ggml_tensor * node = fusion.nodes[f];
+
+                if (!ggml_graph_node_is_noop(node) && ggml_graph_nodes_conflict(prev, node)) {
+                    return false;
+                }
+            }
+
+            if (++n_computed >= GGML_GRAPH_MAX_PHASE) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// the phases and the fused nodes of the graph, see ggml_graph_compute_thread
+// returns the max part of the work buffer used by a phase
+static size_t ggml_graph_get_schedule_impl(const struct ggml_cgraph * cgraph, int n_threads, size_t work_size, int * phase, int * group) {
+    size_t wsize_max = 0;
+
+    int    n_phases    = 0;
+    int    phase_start = 0;
+    size_t phase_wsize = 0;
+
+    for (int node_n = 0; node_n < cgraph->n_nodes; node_n++) {
+        struct ggml_fusion fusion;
+        node_n += ggml_graph_get_fusion(cgraph, node_n, &fusion) - 1;
+
+        phase_wsize += ggml_fusion_work_size(&fusion, n_threads);
+        wsize_max    = MAX(wsize_max, phase_wsize);
+
+        for (int f = 0; f < fusion.n_nodes && phase && group; ++f) {
+            for (int k = node_n; k >= MAX(0, node_n - GGML_FUSION_MAX_DEFER); --k) {
+                if (cgraph->nodes[k] == fusion.nodes[f]) {
+                    phase[k] = n_phases;
+                    group[k] = node_n;
+                    break;
+                }
+            }
+        }
+
+        if (n_threads > 1 && node_n + 1 < cgraph->n_nodes &&
+            ggml_graph_phase_can_extend(cgraph, phase_start, node_n + 1, n_threads, work_size - MIN(work_size, phase_wsize))) {
+            continue;
+        }
+
+        n_phases++;
+
+        phase_start = node_n + 1;
+        phase_wsize = 0;
+    }
+
+    return wsize_max;
+}
+
+int ggml_graph_get_schedule(const struct ggml_cgraph * cgraph, int n_threads, int * phase, int * group) {
+    const struct ggml_cplan cplan = ggml_graph_plan(cgraph, n_threads);
+
+    ggml_graph_get_schedule_impl(cgraph, cplan.n_threads, cplan.work_size, phase, group);
+
+    return cgraph->n_nodes > 0 ? phase[cgraph->n_nodes - 1] + 1 : 0;
 }
 
 static thread_ret_t ggml_graph_compute_thread(void * data) {
@@ -18793,17 +20048,44 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     set_numa_thread_affinity(state->ith);
 
     struct ggml_compute_params params = {
-        /*.ith   =*/ state->ith,
-        /*.nth   =*/ state->shared->n_threads,
-        /*.wsize =*/ cplan->work_size,
-        /*.wdata =*/ cplan->work_data,
-        /*.shared=*/ state->shared,
+        /*.ith           =*/ state->ith,
+        /*.nth           =*/ state->shared->n_threads,
+        /*.wsize         =*/ cplan->work_size,
+        /*.wdata         =*/ cplan->work_data,
+        /*.current_chunk =*/ &state->shared->current_chunk[0],
+        /*.shared        =*/ state->shared,
     };
 
+    // consecutive nodes that do not depend on each other are computed in the same phase,
+    // with a single barrier at the end of the phase instead of one after each node
+    // each node of the phase uses the next part of the work buffer and the next chunk counter
+    int    phase_start = 0;
+    int    phase_n     = 0; // number of computed nodes in the phase, at most GGML_GRAPH_MAX_PHASE
+    size_t phase_wsize = 0; // part of the work buffer used by them
+
     for (int node_n = 0; node_n < cgraph->n_nodes; node_n++) {
-        struct ggml_tensor * node = cgraph->nodes[node_n];
+        struct ggml_fusion fusion;
+        node_n += ggml_graph_get_fusion(cgraph, node_n, &fusion) - 1;
 
-        ggml_compute_forward(&params, node);
+        if (fusion.n_nodes > 0) {
+            params.wsize         = cplan->work_size - phase_wsize;
+            params.wdata         = cplan->work_data ? (char *) cplan->work_data + phase_wsize : NULL;
+            params.current_chunk = &state->shared->current_chunk[phase_n];
+
+            ggml_compute_forward_fused(&params, &fusion);
+
+            phase_n     += ggml_fusion_is_noop(&fusion) ? 0 : 1;
+            phase_wsize += ggml_fusion_work_size(&fusion, params.nth);
+        }
+
+        if (params.nth > 1 && node_n + 1 < cgraph->n_nodes &&
+            ggml_graph_phase_can_extend(cgraph, phase_start, node_n + 1, params.nth, cplan->work_size - MIN(cplan->work_size, phase_wsize))) {
+            continue;
+        }
+
+        phase_start = node_n + 1;
+        phase_n     = 0;
+        phase_wsize = 0;
 
         if (state->ith == 0 && cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
             state->shared->ec = GGML_STATUS_ABORTED;
@@ -18819,6 +20101,313 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     return 0;
 }
 
+//
+// threadpool
+//
+
+// idle workers wait on n_event, which changes for every new graph and on resume/free
+// the wake-up is skipped when no worker is sleeping, so a busy decode loop never enters the kernel
+
+#if defined(__gnu_linux__)
+typedef int ggml_threadpool_sleep_t;
+#elif defined(_WIN32)
+typedef struct {
+    SRWLOCK            mutex;
+    CONDITION_VARIABLE cond;
+} ggml_threadpool_sleep_t;
+#else
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+} ggml_threadpool_sleep_t;
+#endif
+
+struct ggml_threadpool {
+    struct ggml_compute_state_shared shared; // state of the graph that is being computed
+    struct ggml_compute_state      * workers;
+
+    int n_threads;
+    int n_spin;
+
+    bool * cpumasks; // [n_threads][GGML_MAX_N_THREADS], per-thread affinity
+    enum ggml_sched_priority prio;
+
+    atomic_int n_graph;  // number of graphs submitted to the pool
+    atomic_int n_event;  // changes when the idle workers have to re-check the pool state
+    atomic_int n_active; // workers that have not finished the current graph yet
+    atomic_int n_sleep;  // workers that are sleeping or about to
+    atomic_int paused;
+    atomic_int stop;
+
+    ggml_threadpool_sleep_t sleep;
+};
+
+#if defined(__gnu_linux__)
+static void ggml_threadpool_sleep_init(struct ggml_threadpool * tp) {
+    UNUSED(tp);
+}
+
+static void ggml_threadpool_sleep_free(struct ggml_threadpool * tp) {
+    UNUSED(tp);
+}
+
+// sleep until n_event differs from the given value
+static void ggml_threadpool_sleep(struct ggml_threadpool * tp, int n_event) {
+    syscall(SYS_futex, &tp->n_event, FUTEX_WAIT_PRIVATE, n_event, NULL, NULL, 0);
+}
+
+static void ggml_threadpool_wake(struct ggml_threadpool * tp) {
+    syscall(SYS_futex, &tp->n_event, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#elif defined(_WIN32)
+static void ggml_threadpool_sleep_init(struct ggml_threadpool * tp) {
+    InitializeSRWLock(&tp->sleep.mutex);
+    InitializeConditionVariable(&tp->sleep.cond);
+}
+
+static void ggml_threadpool_sleep_free(struct ggml_threadpool * tp) {
+    UNUSED(tp);
+}
+
+static void ggml_threadpool_sleep(struct ggml_threadpool * tp, int n_event) {
+    AcquireSRWLockExclusive(&tp->sleep.mutex);
+    while (atomic_load(&tp->n_event) == n_event) {
+        SleepConditionVariableSRW(&tp->sleep.cond, &tp->sleep.mutex, INFINITE, 0);
+    }
+    ReleaseSRWLockExclusive(&tp->sleep.mutex);
+}
+
+static void ggml_threadpool_wake(struct ggml_threadpool * tp) {
+    AcquireSRWLockExclusive(&tp->sleep.mutex);
+    ReleaseSRWLockExclusive(&tp->sleep.mutex);
+    WakeAllConditionVariable(&tp->sleep.cond);
+}
+#else
+static void ggml_threadpool_sleep_init(struct ggml_threadpool * tp) {
+    pthread_mutex_init(&tp->sleep.mutex, NULL);
+    pthread_cond_init(&tp->sleep.cond, NULL);
+}
+
+static void ggml_threadpool_sleep_free(struct ggml_threadpool * tp) {
+    pthread_mutex_destroy(&tp->sleep.mutex);
+    pthread_cond_destroy(&tp->sleep.cond);
+}
+
+static void ggml_threadpool_sleep(struct ggml_threadpool * tp, int n_event) {
+    pthread_mutex_lock(&tp->sleep.mutex);
+    while (atomic_load(&tp->n_event) == n_event) {
+        pthread_cond_wait(&tp->sleep.cond, &tp->sleep.mutex);
+    }
+    pthread_mutex_unlock(&tp->sleep.mutex);
+}
+
+static void ggml_threadpool_wake(struct ggml_threadpool * tp) {
+    // taking the lock guarantees that a worker that saw the old n_event is already waiting on the condition
+    pthread_mutex_lock(&tp->sleep.mutex);
+    pthread_mutex_unlock(&tp->sleep.mutex);
+    pthread_cond_broadcast(&tp->sleep.cond);
+}
+#endif
+
+static void ggml_threadpool_notify(struct ggml_threadpool * tp) {
+    atomic_fetch_add(&tp->n_event, 1);
+    if (atomic_load(&tp->n_sleep) > 0) {
+        ggml_threadpool_wake(tp);
+    }
+}
+
+static thread_ret_t ggml_threadpool_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool    * tp    = state->shared->threadpool;
+
+    ggml_thread_apply_placement(tp->cpumasks + state->ith*GGML_MAX_N_THREADS, tp->prio);
+
+    int n_graph_last = 0;
+
+    while (true) {
+        // wait for a new graph: poll for a while, then sleep
+        while (true) {
+            const int n_event = atomic_load(&tp->n_event);
+
+            if (atomic_load(&tp->stop)) {
+                return 0;
+            }
+            if (atomic_load(&tp->n_graph) != n_graph_last) {
+                break;
+            }
+
+            bool changed = false;
+            if (!atomic_load(&tp->paused)) {
+                for (int i = 0; i < tp->n_spin; i++) {
+                    if (atomic_load(&tp->n_event) != n_event) {
+                        changed = true;
+                        break;
+                    }
+                #if defined(__SSE3__)
+                    _mm_pause();
+                #endif
+                }
+            }
+
+            if (!changed) {
+                atomic_fetch_add(&tp->n_sleep, 1);
+                ggml_threadpool_sleep(tp, n_event);
+                atomic_fetch_sub(&tp->n_sleep, 1);
+            }
+        }
+
+        // the main thread does not touch the shared state until all workers have checked in
+        n_graph_last = atomic_load(&tp->n_graph);
+
+        if (state->ith < tp->shared.n_threads) {
+            ggml_graph_compute_thread(state);
+        }
+
+        atomic_fetch_sub(&tp->n_active, 1);
+    }
+}
+
+struct ggml_threadpool_params ggml_threadpool_params_default(int n_threads) {
+    struct ggml_threadpool_params params;
+    memset(&params, 0, sizeof(params));
+
+    params.n_threads  = n_threads > 0 ? n_threads : GGML_DEFAULT_N_THREADS;
+    params.n_spin     = 100000;
+    params.paused     = false;
+    params.strict_cpu = false;
+    params.prio       = GGML_SCHED_PRIO_NORMAL;
+
+    return params;
+}
+
+struct ggml_threadpool * ggml_threadpool_new(const struct ggml_threadpool_params * params) {
+    GGML_ASSERT(params->n_threads > 0);
+    GGML_ASSERT(params->n_spin >= 0);
+
+    struct ggml_threadpool * tp = GGML_MALLOC(sizeof(struct ggml_threadpool));
+    memset(tp, 0, sizeof(struct ggml_threadpool));
+
+    tp->n_threads = params->n_threads;
+    tp->n_spin    = params->n_threads <= ggml_get_n_cpus() ? params->n_spin : 0; // no polling when oversubscribed
+    tp->workers   = GGML_MALLOC(sizeof(struct ggml_compute_state)*params->n_threads);
+    tp->cpumasks  = GGML_MALLOC(sizeof(bool)*GGML_MAX_N_THREADS*params->n_threads);
+    tp->prio      = params->prio;
+
+    // thread 0 is the calling thread, it keeps its own placement and the first CPU of the mask is left for it
+    // the workers take the next CPUs of the mask
+    {
+        int32_t cpu_iter = 0;
+        for (int j = 0; j < tp->n_threads; ++j) {
+            ggml_thread_cpumask_next(params->cpumask, tp->cpumasks + j*GGML_MAX_N_THREADS, params->strict_cpu, &cpu_iter);
+        }
+    }
+
+    tp->shared.threadpool = tp;
+
+    atomic_store(&tp->n_graph,  0);
+    atomic_store(&tp->n_event,  0);
+    atomic_store(&tp->n_active, 0);
+    atomic_store(&tp->n_sleep,  0);
+    atomic_store(&tp->paused,   params->paused);
+    atomic_store(&tp->stop,     0);
+
+    ggml_threadpool_sleep_init(tp);
+
+    for (int j = 0; j < tp->n_threads; ++j) {
+        tp->workers[j] = (struct ggml_compute_state) {
+            .thrd   = 0,
+            .ith    = j,
+            .shared = &tp->shared,
+        };
+    }
+
+    // worker 0 is the thread that computes the graph
+    for (int j = 1; j < tp->n_threads; ++j) {
+        const int rc = ggml_thread_create(&tp->workers[j].thrd, NULL, ggml_threadpool_thread, &tp->workers[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    return tp;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * tp) {
+    if (tp == NULL) {
+        return;
+    }
+
+    atomic_store(&tp->stop, 1);
+    ggml_threadpool_notify(tp);
+
+    for (int j = 1; j < tp->n_threads; j++) {
+        const int rc = ggml_thread_join(tp->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    ggml_threadpool_sleep_free(tp);
+
+    GGML_FREE(tp->cpumasks);
+    GGML_FREE(tp->workers);
+    GGML_FREE(tp);
+}
+
+int ggml_threadpool_get_n_threads(const struct ggml_threadpool * tp) {
+    return tp->n_threads;
+}
+
+void ggml_threadpool_pause(struct ggml_threadpool * tp) {
+    atomic_store(&tp->paused, 1);
+    // make the polling workers go to sleep
+    ggml_threadpool_notify(tp);
+}
+
+void ggml_threadpool_resume(struct ggml_threadpool * tp) {
+    atomic_store(&tp->paused, 0);
+    // make the sleeping workers poll again
+    ggml_threadpool_notify(tp);
+}
+
+static enum ggml_status ggml_graph_compute_threadpool(struct ggml_threadpool * tp, struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
+    // the work buffer is sized for cplan->n_threads, so using fewer threads is fine
+    const int n_threads = MIN(cplan->n_threads, tp->n_threads);
+
+    struct ggml_compute_state_shared * shared = &tp->shared;
+
+    shared->cgraph              = cgraph;
+    shared->cplan               = cplan;
+    shared->n_threads           = n_threads;
+    shared->abort_callback      = NULL;
+    shared->abort_callback_data = NULL;
+    shared->ec                  = GGML_STATUS_SUCCESS;
+    atomic_store(&shared->n_barrier,        0);
+    atomic_store(&shared->n_barrier_passed, 0);
+    for (int i = 0; i < GGML_GRAPH_MAX_PHASE; ++i) {
+        atomic_store(&shared->current_chunk[i], 0);
+    }
+
+    if (n_threads > 1) {
+        atomic_store(&tp->n_active, tp->n_threads - 1);
+        atomic_fetch_add(&tp->n_graph, 1);
+        ggml_threadpool_notify(tp);
+    }
+
+    // this is a work thread too
+    ggml_graph_compute_thread(&tp->workers[0]);
+
+    if (n_threads > 1) {
+        // the workers leave the graph right after the last barrier
+        while (atomic_load(&tp->n_active) != 0) {
+            sched_yield();
+        }
+    }
+
+    // don't leave affinity set on the main thread
+    clear_numa_thread_affinity();
+
+    return shared->ec;
+}
+
 enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     GGML_ASSERT(cplan);
     GGML_ASSERT(cplan->n_threads > 0);
@@ -18834,10 +20423,15 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         /*.n_barrier_passed        =*/ 0,
         /*.abort_callback          =*/ NULL,
         /*.abort_callback_data     =*/ NULL,
-        /*.current_chunk           =*/ 0,
+        /*.current_chunk           =*/ { 0 },
         /*.ec                      =*/ GGML_STATUS_SUCCESS,
+        /*.threadpool              =*/ NULL,
     };
 
+    if (cplan->threadpool != NULL) {
+        return ggml_graph_compute_threadpool(cplan->threadpool, cgraph, cplan);
+    }
+
 #ifdef GGML_USE_OPENMP
     if (n_threads > 1) {
         #pragma omp parallel num_threads(n_threads)
@@ -22031,4 +23625,12 @@ int ggml_cpu_has_matmul_int8(void) {
 #endif
 }
 
+int ggml_cpu_has_openmp(void) {
+#if defined(GGML_USE_OPENMP)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
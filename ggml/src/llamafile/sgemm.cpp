@@ -184,8 +184,23 @@ inline float hsum(__m256 x) {
 #endif // __AVX__
 
 #if defined(__AVX512F__)
+// the 256-bit halves of 512-bit vectors are taken with zero masking: the unmasked extracts (also used by
+// _mm512_reduce_add_ps and the casts) pass an undefined vector to the builtin, which gcc reports as uninitialized
+inline __m256 lo256(__m512 x) {
+    return _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xf, _mm512_castps_pd(x), 0));
+}
+inline __m256 hi256(__m512 x) {
+    return _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xf, _mm512_castps_pd(x), 1));
+}
+inline __m256i lo256(__m512i x) {
+    return _mm512_maskz_extracti64x4_epi64(0xf, x, 0);
+}
+inline __m256i hi256(__m512i x) {
+    return _mm512_maskz_extracti64x4_epi64(0xf, x, 1);
+}
+
 inline float hsum(__m512 x) {
-    return _mm512_reduce_add_ps(x);
+    return hsum(_mm256_add_ps(hi256(x), lo256(x)));
 }
 #endif // __AVX512F__
 
@@ -231,7 +246,7 @@ template <> inline __m512 load(const float *p) {
     return _mm512_loadu_ps(p);
 }
 template <> inline __m512 load(const ggml_fp16_t *p) {
-    return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)p));
+    return _mm512_maskz_cvtph_ps(0xffff, _mm256_loadu_si256((const __m256i *)p)); // masked, see lo256
 }
 #endif // __AVX512F__
 
@@ -813,6 +828,341 @@ class tinyBLAS_Q0_AVX {
 };
 #endif // __AVX__
 
+//////////////////////////////////////////////////////////////////////////////////////////
+// K-QUANT MATRIX MULTIPLICATION
+
+#if defined(__AVX2__)
+template <typename TA>
+struct tinyBLAS_K_traits {
+    static constexpr bool is_signed = false; // quants are unsigned, the offset is applied through the mins
+};
+
+template <>
+struct tinyBLAS_K_traits<block_iq4_xs> {
+    static constexpr bool is_signed = true;
+};
+
+template <typename TA>
+class tinyBLAS_K_AVX {
+  public:
+    tinyBLAS_K_AVX(int64_t k,
+                   const TA *A, int64_t lda,
+                   const block_q8_K *B, int64_t ldb,
+                   float *C, int64_t ldc,
+                   int ith, int nth)
+        : A(A), B(B), C(C), k(k), lda(lda), ldb(ldb), ldc(ldc), ith(ith), nth(nth) {
+    }
+
+    void matmul(int64_t m, int64_t n) {
+        mnpack(0, m, 0, n);
+    }
+
+  private:
+    // A super-block of A expanded to bytes, so that the work of unpacking the quants and the
+    // scales is shared by all the columns of B in the tile. The scales and the mins are given
+    // for the groups of 16 quants of the q8_K bsums.
+    //
+    //     dot = d * Σ scales·(qs·b) - dmin * Σ mins·bsums
+    struct unpacked {
+        __m256i qs[QK_K/32];
+        __m256i mins;
+        alignas(32) int16_t scales[QK_K/16];
+        float d;
+        float dmin;
+    };
+
+    NOINLINE void mnpack(int64_t m0, int64_t m, int64_t n0, int64_t n) {
+        int64_t mc, nc, mp, np;
+        switch ((MIN(m - m0, 4) << 4) | MIN(n - n0, 4)) {
+#if VECTOR_REGISTERS == 32
+        case 0x44:
+            mc = 4;
+            nc = 4;
+            gemm<4, 4>(m0, m, n0, n);
+            break;
+        case 0x43:
+            mc = 4;
+            nc = 3;
+            gemm<4, 3>(m0, m, n0, n);
+            break;
+        case 0x34:
+            mc = 3;
+            nc = 4;
+            gemm<3, 4>(m0, m, n0, n);
+            break;
+        case 0x33:
+            mc = 3;
+            nc = 3;
+            gemm<3, 3>(m0, m, n0, n);
+            break;
+        case 0x42:
+            mc = 4;
+            nc = 2;
+            gemm<4, 2>(m0, m, n0, n);
+            break;
+        case 0x24:
+            mc = 2;
+            nc = 4;
+            gemm<2, 4>(m0, m, n0, n);
+            break;
+#else
+        case 0x44:
+        case 0x43:
+        case 0x42:
+            mc = 4;
+            nc = 2;
+            gemm<4, 2>(m0, m, n0, n);
+            break;
+        case 0x34:
+        case 0x24:
+            mc = 2;
+            nc = 4;
+            gemm<2, 4>(m0, m, n0, n);
+            break;
+        case 0x33:
+#endif
+        case 0x32:
+            mc = 3;
+            nc = 2;
+            gemm<3, 2>(m0, m, n0, n);
+            break;
+        case 0x23:
+            mc = 2;
+            nc = 3;
+            gemm<2, 3>(m0, m, n0, n);
+            break;
+        case 0x41:
+            mc = 4;
+            nc = 1;
+            gemm<4, 1>(m0, m, n0, n);
+            break;
+        case 0x22:
+            mc = 2;
+            nc = 2;
+            gemm<2, 2>(m0, m, n0, n);
+            break;
+        case 0x14:
+            mc = 1;
+            nc = 4;
+            gemm<1, 4>(m0, m, n0, n);
+            break;
+        case 0x31:
+            mc = 3;
+            nc = 1;
+            gemm<3, 1>(m0, m, n0, n);
+            break;
+        case 0x13:
+            mc = 1;
+            nc = 3;
+            gemm<1, 3>(m0, m, n0, n);
+            break;
+        case 0x21:
+            mc = 2;
+            nc = 1;
+            gemm<2, 1>(m0, m, n0, n);
+            break;
+        case 0x12:
+            mc = 1;
+            nc = 2;
+            gemm<1, 2>(m0, m, n0, n);
+            break;
+        case 0x11:
+            mc = 1;
+            nc = 1;
+            gemm<1, 1>(m0, m, n0, n);
+            break;
+        default:
+            return;
+        }
+        mp = m0 + (m - m0) / mc * mc;
+        np = n0 + (n - n0) / nc * nc;
+        mnpack(mp, m, n0, np);
+        mnpack(m0, m, np, n);
+    }
+
+    template <int RM, int RN>
+    NOINLINE void gemm(int64_t m0, int64_t m, int64_t n0, int64_t n) {
+        int64_t ytiles = (m - m0) / RM;
+        int64_t xtiles = (n - n0) / RN;
+        int64_t tiles = xtiles * ytiles;
+        int64_t duty = (tiles + nth - 1) / nth;
+        int64_t start = duty * ith;
+        int64_t end = start + duty;
+        if (end > tiles)
+            end = tiles;
+        for (int64_t job = start; job < end; ++job) {
+            int64_t ii = m0 + job / xtiles * RM;
+            int64_t jj = n0 + job % xtiles * RN;
+            __m256 Cv[RN][RM] = {};
+            unpacked Au[RM];
+            for (int64_t l = 0; l < k; ++l) {
+                const block_q8_K *b[RN];
+                for (int64_t j = 0; j < RN; ++j)
+                    b[j] = B + ldb * (jj + j) + l;
+                for (int64_t i = 0; i < RM; ++i)
+                    unpack(A + lda * (ii + i) + l, &Au[i]);
+                for (int64_t i = 0; i < RM; ++i) {
+                    __m256i sumi[RN];
+                    dot<RN>(Au[i], b, sumi);
+                    for (int64_t j = 0; j < RN; ++j) {
+                        const __m256i bsums = _mm256_loadu_si256((const __m256i *)b[j]->bsums);
+                        Cv[j][i] = madd(_mm256_set1_ps(Au[i].d * b[j]->d),
+                                        _mm256_cvtepi32_ps(sumi[j]),
+                                        Cv[j][i]);
+                        Cv[j][i] = madd(_mm256_set1_ps(-Au[i].dmin * b[j]->d),
+                                        _mm256_cvtepi32_ps(_mm256_madd_epi16(Au[i].mins, bsums)),
+                                        Cv[j][i]);
+                    }
+                }
+            }
+            for (int64_t j = 0; j < RN; ++j)
+                for (int64_t i = 0; i < RM; ++i)
+                    C[ldc * (jj + j) + (ii + i)] = hsum(Cv[j][i]);
+        }
+    }
+
+    // integer dot products of an unpacked super-block with RN q8_K blocks, weighted by the scales
+    template <int RN>
+    static inline void dot(const unpacked &u, const block_q8_K *const *b, __m256i *sumi) {
+        const bool is_signed = tinyBLAS_K_traits<TA>::is_signed;
+#if defined(__AVX512BW__)
+        // 2 chunks of 32 quants at a time, the 4 groups of 16 have their own scale
+        const __m512i idx = _mm512_set_epi64(0x0003000300030003, 0x0003000300030003, 0x0002000200020002, 0x0002000200020002,
+                                             0x0001000100010001, 0x0001000100010001, 0x0000000000000000, 0x0000000000000000);
+        __m512i acc[RN] = {};
+        for (int c = 0; c < QK_K/32; c += 2) {
+            __m512i a = _mm512_loadu_si512((const __m512i *)&u.qs[c]);
+            const __mmask64 neg = is_signed ? _mm512_movepi8_mask(a) : 0;
+            if (is_signed)
+                a = _mm512_abs_epi8(a);
+            const __m512i sc = _mm512_permutexvar_epi16(idx, _mm512_castsi128_si512(
+                _mm_loadl_epi64((const __m128i *)(u.scales + 2*c))));
+            for (int j = 0; j < RN; ++j) {
+                __m512i bq = _mm512_loadu_si512((const __m512i *)(b[j]->qs + 32*c));
+                if (is_signed)
+                    bq = _mm512_mask_sub_epi8(bq, neg, _mm512_setzero_si512(), bq);
+                acc[j] = _mm512_add_epi32(acc[j], _mm512_madd_epi16(_mm512_maddubs_epi16(a, bq), sc));
+            }
+        }
+        for (int j = 0; j < RN; ++j)
+            sumi[j] = _mm256_add_epi32(lo256(acc[j]), hi256(acc[j]));
+#else
+        for (int j = 0; j < RN; ++j)
+            sumi[j] = _mm256_setzero_si256();
+        for (int c = 0; c < QK_K/32; ++c) {
+            const __m256i a = is_signed ? _mm256_sign_epi8(u.qs[c], u.qs[c]) : u.qs[c];
+            const __m256i sc = MM256_SET_M128I(_mm_set1_epi16(u.scales[2*c + 1]),
+                                               _mm_set1_epi16(u.scales[2*c + 0]));
+            for (int j = 0; j < RN; ++j) {
+                __m256i bq = _mm256_loadu_si256((const __m256i *)(b[j]->qs + 32*c));
+                if (is_signed)
+                    bq = _mm256_sign_epi8(bq, u.qs[c]);
+                sumi[j] = _mm256_add_epi32(sumi[j], _mm256_madd_epi16(_mm256_maddubs_epi16(a, bq), sc));
+            }
+        }
+#endif
+    }
+
+    // 6-bit scales and mins of the 8 sub-blocks of Q4_K and Q5_K
+    static inline void unpack_scales_mins_k4(const uint8_t *q, unpacked *u) {
+        const uint32_t kmask1 = 0x3f3f3f3f;
+        const uint32_t kmask2 = 0x0f0f0f0f;
+        const uint32_t kmask3 = 0x03030303;
+        uint32_t utmp[4];
+        memcpy(utmp, q, 12);
+        utmp[3] = ((utmp[2] >> 4) & kmask2) | (((utmp[1] >> 6) & kmask3) << 4);
+        const uint32_t uaux = utmp[1] & kmask1;
+        utmp[1] = (utmp[2] & kmask2) | (((utmp[0] >> 6) & kmask3) << 4);
+        utmp[2] = uaux;
+        utmp[0] &= kmask1;
+        // 8 scales followed by 8 mins, each repeated for the 2 groups of 16 of the sub-block
+        const __m128i sm = _mm_set_epi32(utmp[3], utmp[2], utmp[1], utmp[0]);
+        _mm256_store_si256((__m256i *)u->scales, _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(sm, sm)));
+        u->mins = _mm256_cvtepu8_epi16(_mm_unpackhi_epi8(sm, sm));
+    }
+
+    static inline void unpack(const block_q4_K *b, unpacked *u) {
+        const __m256i m4 = _mm256_set1_epi8(15);
+        for (int j = 0; j < QK_K/64; ++j) {
+            const __m256i q = _mm256_loadu_si256((const __m256i *)(b->qs + 32*j));
+            u->qs[2*j + 0] = _mm256_and_si256(q, m4);
+            u->qs[2*j + 1] = _mm256_and_si256(_mm256_srli_epi16(q, 4), m4);
+        }
+        unpack_scales_mins_k4(b->scales, u);
+        u->d = unhalf(b->d);
+        u->dmin = unhalf(b->dmin);
+    }
+
+    static inline void unpack(const block_q5_K *b, unpacked *u) {
+        const __m256i m4 = _mm256_set1_epi8(15);
+        const __m256i hbit = _mm256_set1_epi8(16);
+        const __m256i qh = _mm256_loadu_si256((const __m256i *)b->qh);
+        for (int j = 0; j < QK_K/64; ++j) {
+            const __m256i q = _mm256_loadu_si256((const __m256i *)(b->qs + 32*j));
+            const __m256i mlo = _mm256_set1_epi8(1 << (2*j + 0));
+            const __m256i mhi = _mm256_set1_epi8(1 << (2*j + 1));
+            const __m256i hlo = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(qh, mlo), mlo), hbit);
+            const __m256i hhi = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(qh, mhi), mhi), hbit);
+            u->qs[2*j + 0] = _mm256_or_si256(_mm256_and_si256(q, m4), hlo);
+            u->qs[2*j + 1] = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q, 4), m4), hhi);
+        }
+        unpack_scales_mins_k4(b->scales, u);
+        u->d = unhalf(b->d);
+        u->dmin = unhalf(b->dmin);
+    }
+
+    static inline void unpack(const block_q6_K *b, unpacked *u) {
+        const __m256i m4 = _mm256_set1_epi8(15);
+        const __m256i m2 = _mm256_set1_epi8(3 << 4);
+        for (int n = 0; n < QK_K/128; ++n) {
+            const __m256i ql0 = _mm256_loadu_si256((const __m256i *)(b->ql + 64*n));
+            const __m256i ql1 = _mm256_loadu_si256((const __m256i *)(b->ql + 64*n + 32));
+            const __m256i qh = _mm256_loadu_si256((const __m256i *)(b->qh + 32*n));
+            u->qs[4*n + 0] = _mm256_or_si256(_mm256_and_si256(ql0, m4),
+                                             _mm256_and_si256(_mm256_slli_epi16(qh, 4), m2));
+            u->qs[4*n + 1] = _mm256_or_si256(_mm256_and_si256(ql1, m4),
+                                             _mm256_and_si256(_mm256_slli_epi16(qh, 2), m2));
+            u->qs[4*n + 2] = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(ql0, 4), m4),
+                                             _mm256_and_si256(qh, m2));
+            u->qs[4*n + 3] = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(ql1, 4), m4),
+                                             _mm256_and_si256(_mm256_srli_epi16(qh, 2), m2));
+        }
+        // the quants are stored with an offset of 32
+        const __m256i sc = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)b->scales));
+        _mm256_store_si256((__m256i *)u->scales, sc);
+        u->mins = _mm256_slli_epi16(sc, 5);
+        u->d = unhalf(b->d);
+        u->dmin = u->d;
+    }
+
+    static inline void unpack(const block_iq4_xs *b, unpacked *u) {
+        const __m128i values = _mm_setr_epi8(-127, -104, -83, -65, -49, -35, -22, -10, 1, 13, 25, 38, 53, 69, 89, 113);
+        const __m128i m4 = _mm_set1_epi8(15);
+        for (int ib = 0; ib < QK_K/32; ++ib) {
+            const __m128i q = _mm_loadu_si128((const __m128i *)(b->qs + 16*ib));
+            u->qs[ib] = MM256_SET_M128I(_mm_shuffle_epi8(values, _mm_and_si128(_mm_srli_epi16(q, 4), m4)),
+                                        _mm_shuffle_epi8(values, _mm_and_si128(q, m4)));
+            const int ls = ((b->scales_l[ib/2] >> 4*(ib%2)) & 0xf) | (((b->scales_h >> 2*ib) & 3) << 4);
+            u->scales[2*ib + 0] = ls - 32;
+            u->scales[2*ib + 1] = ls - 32;
+        }
+        u->mins = _mm256_setzero_si256();
+        u->d = unhalf(b->d);
+        u->dmin = 0.0f;
+    }
+
+    const TA *const A;
+    const block_q8_K *const B;
+    float *const C;
+    const int64_t k;
+    const int64_t lda;
+    const int64_t ldb;
+    const int64_t ldc;
+    const int ith;
+    const int nth;
+};
+#endif // __AVX2__
+
 } // namespace
 
 /**
@@ -1006,6 +1356,78 @@ bool llamafile_sgemm(int64_t m, int64_t n, int64_t k, const void *A, int64_t lda
 #endif
     }
 
+    case GGML_TYPE_Q4_K: {
+        if (Btype != GGML_TYPE_Q8_K)
+            return false;
+#if defined(__AVX2__)
+        if (n < 2)
+            return false;
+        tinyBLAS_K_AVX<block_q4_K> tb{
+            k, (const block_q4_K *)A, lda,
+            (const block_q8_K *)B, ldb,
+            (float *)C, ldc,
+            ith, nth};
+        tb.matmul(m, n);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    case GGML_TYPE_Q5_K: {
+        if (Btype != GGML_TYPE_Q8_K)
+            return false;
+#if defined(__AVX2__)
+        if (n < 2)
+            return false;
+        tinyBLAS_K_AVX<block_q5_K> tb{
+            k, (const block_q5_K *)A, lda,
+            (const block_q8_K *)B, ldb,
+            (float *)C, ldc,
+            ith, nth};
+        tb.matmul(m, n);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    case GGML_TYPE_Q6_K: {
+        if (Btype != GGML_TYPE_Q8_K)
+            return false;
+#if defined(__AVX2__)
+        if (n < 2)
+            return false;
+        tinyBLAS_K_AVX<block_q6_K> tb{
+            k, (const block_q6_K *)A, lda,
+            (const block_q8_K *)B, ldb,
+            (float *)C, ldc,
+            ith, nth};
+        tb.matmul(m, n);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    case GGML_TYPE_IQ4_XS: {
+        if (Btype != GGML_TYPE_Q8_K)
+            return false;
+#if defined(__AVX2__)
+        if (n < 2)
+            return false;
+        tinyBLAS_K_AVX<block_iq4_xs> tb{
+            k, (const block_iq4_xs *)A, lda,
+            (const block_q8_K *)B, ldb,
+            (float *)C, ldc,
+            ith, nth};
+        tb.matmul(m, n);
+        return true;
+#else
+        return false;
+#endif
+    }
+
     default:
         return false;
     }
@@ -293,6 +293,7 @@ extern "C" {
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
+        bool repack_tensors; // repack Q4_0 weights into the interleaved layout of the CPU (disables mmap)
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -829,6 +830,17 @@ extern "C" {
     // Get the number of threads used for prompt and batch processing (multiple token).
     LLAMA_API uint32_t llama_n_threads_batch(struct llama_context * ctx);
 
+    // Attach CPU thread pools that are reused across the graphs instead of creating the threads for every graph
+    // threadpool is meant for generation and threadpool_batch for batch processing (either can be NULL),
+    // a pool is only used when its number of threads matches the number of threads of the graph
+    // the pools are not owned by the context and must stay alive until they are detached or the context is freed
+    LLAMA_API void llama_attach_threadpool(
+               struct llama_context * ctx,
+            struct ggml_threadpool * threadpool,
+            struct ggml_threadpool * threadpool_batch);
+
+    LLAMA_API void llama_detach_threadpool(struct llama_context * ctx);
+
     // Set whether the model is in embeddings mode or not
     // If true, embeddings will be returned but logits will not
     LLAMA_API void llama_set_embeddings(struct llama_context * ctx, bool embeddings);
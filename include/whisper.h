@@ -117,6 +117,12 @@ extern "C" {
         bool  use_gpu;
         bool  flash_attn;
         int   gpu_device;  // CUDA device
+        bool  use_mmap;    // map the weights from the model file when loading into CPU memory (whisper_init_from_file only)
+
+        // [EXPERIMENTAL] data type of the per-state KV caches (GGML_TYPE_F16, GGML_TYPE_Q8_0 or GGML_TYPE_Q4_0)
+        // the V caches are quantized only when flash_attn is enabled
+        enum ggml_type type_kv_self;
+        enum ggml_type type_kv_cross;
 
         // [EXPERIMENTAL] Token-level timestamps with DTW
         bool dtw_token_timestamps;
@@ -252,6 +258,23 @@ extern "C" {
     WHISPER_API void whisper_free_params(struct whisper_full_params * params);
     WHISPER_API void whisper_free_context_params(struct whisper_context_params * params);
 
+    // [EXPERIMENTAL] State snapshots for resumable streaming
+    // A snapshot holds the text context carried between whisper_full() calls, the language, the results of the last
+    // whisper_full() call and, with with_kv, the self- and cross-attention KV caches.
+    // With the KV caches and params.encoder_cache, a whisper_full() call on the same audio window after the restore
+    // skips the encoder and the decoding of the prompt.
+    // It can be restored into a state of a context created from the same model with the same KV cache types and flash_attn setting.
+    // whisper_state_get_data returns the number of bytes written, or 0 if size is too small
+    // whisper_state_set_data returns the number of bytes read, or 0 on failure - the state is left unchanged
+    WHISPER_API size_t whisper_state_get_size(struct whisper_context * ctx, bool with_kv);
+    WHISPER_API size_t whisper_state_get_size_from_state(struct whisper_context * ctx, struct whisper_state * state, bool with_kv);
+
+    WHISPER_API size_t whisper_state_get_data(struct whisper_context * ctx, uint8_t * dst, size_t size, bool with_kv);
+    WHISPER_API size_t whisper_state_get_data_from_state(struct whisper_context * ctx, struct whisper_state * state, uint8_t * dst, size_t size, bool with_kv);
+
+    WHISPER_API size_t whisper_state_set_data(struct whisper_context * ctx, const uint8_t * src, size_t size);
+    WHISPER_API size_t whisper_state_set_data_with_state(struct whisper_context * ctx, struct whisper_state * state, const uint8_t * src, size_t size);
+
     // Convert RAW PCM audio to log mel spectrogram.
     // The resulting spectrogram is stored inside the default state of the provided whisper context.
     // Returns 0 on success
@@ -487,10 +510,26 @@ extern "C" {
         // note: these can significantly reduce the quality of the output
         bool debug_mode;        // enable debug_mode provides extra info (eg. Dump log_mel)
         int  audio_ctx;         // overwrite the audio context size (0 = use default)
+        bool encoder_cache;     // skip the encoder when the mel window and audio_ctx are the same as in the last encoder pass of the state
+        int   n_text_layer_exit; // skip the decoder layers after this one when the logits are confident (0 = disabled)
+        float text_exit_thold;   // min difference between the probabilities of the top 2 tokens to exit early
 
         // [EXPERIMENTAL] [TDRZ] tinydiarize
         bool tdrz_enable;       // enable tinydiarize speaker turn detection
 
+        // [EXPERIMENTAL] energy-based voice activity detection
+        // silent regions of the input are skipped, timestamps still refer to the original input
+        bool  vad;                // enable the voice activity detection pre-pass
+        float vad_thold;          // speech threshold between the noise floor (0.0) and the speech level (1.0)
+        int   vad_min_silence_ms; // only skip silences that are at least this long
+        int   vad_speech_pad_ms;  // audio to keep on each side of a speech region
+
+        // [EXPERIMENTAL] speculative decoding
+        // a smaller model with the same vocabulary proposes tokens which are then verified with a single batched decode
+        // used only for greedy sampling at temperature 0 - the output is the same as without a draft model
+        struct whisper_context * draft_ctx; // draft model (nullptr = disabled), its default state is used (not with whisper_full_parallel)
+        int n_draft;                        // max number of tokens proposed by the draft model per step (>= 1, limited by the text context)
+
         // A regular expression that matches tokens to suppress
         const char * suppress_regex;
 
@@ -506,6 +545,12 @@ extern "C" {
         const char * language;
         bool detect_language;
 
+        // [EXPERIMENTAL] fast language detection
+        // detect the language from a reduced encoder window at the start of the audio instead of the full 30 s
+        // when the window matches audio_ctx, the encoder output is reused for the first transcription window
+        int  lang_detect_ms;    // length of the detection window in ms (0 = full window, same as audio_ctx)
+        bool lang_detect_cache; // reuse the language detected in a previous call with the same state (per-stream cache)
+
         // common decoding parameters:
         bool suppress_blank;    // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/decoding.py#L89
         bool suppress_non_speech_tokens; // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
@@ -2755,6 +2755,9 @@ struct llama_context {
 #endif
     ggml_backend_t backend_cpu = nullptr;
 
+    // not owned, see llama_attach_threadpool
+    ggml_threadpool * threadpool       = nullptr;
+    ggml_threadpool * threadpool_batch = nullptr;
 
     const llama_model & model;
 
@@ -5938,6 +5941,7 @@ static bool llm_load_tensors(
         int main_gpu,
         const float * tensor_split,
         bool use_mlock,
+        bool repack_tensors,
         llama_progress_callback progress_callback,
         void * progress_callback_user_data) {
     model.t_start_us = ggml_time_us();
@@ -7693,6 +7697,26 @@ static bool llm_load_tensors(
         }
     }
 
+    if (repack_tensors) {
+        // only weights that are used exclusively by the CPU backend through mat mul
+        int n_repacked = 0;
+        for (auto & it : model.tensors_by_name) {
+            ggml_tensor * cur = it.second;
+            if (cur->buffer == nullptr || ggml_backend_buffer_get_type(cur->buffer) != ggml_backend_cpu_buffer_type()) {
+                continue;
+            }
+            if (cur == model.tok_embd || ggml_n_dims(cur) != 2) {
+                continue;
+            }
+            const enum ggml_type type = ggml_repack_get_optimal_type(cur);
+            if (type != cur->type) {
+                ggml_repack_tensor(cur, type);
+                n_repacked++;
+            }
+        }
+        LLAMA_LOG_INFO("%s: repacked %d tensors\n", __func__, n_repacked);
+    }
+
     if (use_mmap_buffer) {
         for (auto & mapping : ml.mappings) {
             model.mappings.emplace_back(std::move(mapping));
@@ -7708,6 +7732,12 @@ static bool llm_load_tensors(
 // Returns 0 on success, -1 on error, and -2 on cancellation via llama_progress_callback
 static int llama_model_load(const std::string & fname, llama_model & model, llama_model_params & params) {
     try {
+        if (params.repack_tensors && params.use_mmap) {
+            // the tensors are repacked in place, so the data must not be backed by the model file
+            LLAMA_LOG_INFO("%s: repacking tensors, disabling mmap\n", __func__);
+            params.use_mmap = false;
+        }
+
         llama_model_loader ml(fname, params.use_mmap, params.check_tensors, params.kv_overrides);
 
         model.hparams.vocab_only = params.vocab_only;
@@ -7759,7 +7789,7 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
 
         if (!llm_load_tensors(
             ml, model, params.n_gpu_layers, params.split_mode,  params.main_gpu, params.tensor_split, params.use_mlock,
-            params.progress_callback, params.progress_callback_user_data
+            params.repack_tensors, params.progress_callback, params.progress_callback_user_data
         )) {
             return -2;
         }
@@ -14453,7 +14483,15 @@ static void llama_graph_compute(
 #endif
 
     if (lctx.backend_cpu != nullptr) {
+        ggml_threadpool * threadpool = nullptr;
+        if (lctx.threadpool && ggml_threadpool_get_n_threads(lctx.threadpool) == n_threads) {
+            threadpool = lctx.threadpool;
+        } else if (lctx.threadpool_batch && ggml_threadpool_get_n_threads(lctx.threadpool_batch) == n_threads) {
+            threadpool = lctx.threadpool_batch;
+        }
+
         ggml_backend_cpu_set_n_threads(lctx.backend_cpu, n_threads);
+        ggml_backend_cpu_set_threadpool(lctx.backend_cpu, threadpool);
         ggml_backend_cpu_set_abort_callback(lctx.backend_cpu, lctx.abort_callback, lctx.abort_callback_data);
     }
 #ifdef GGML_USE_BLAS
@@ -18797,6 +18835,7 @@ struct llama_model_params llama_model_default_params() {
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
+        /*.repack_tensors              =*/ false,
     };
 
 #ifdef GGML_USE_METAL
@@ -20841,6 +20880,16 @@ uint32_t llama_n_threads_batch(struct llama_context * ctx) {
     return ctx->cparams.n_threads_batch;
 }
 
+void llama_attach_threadpool(struct llama_context * ctx, struct ggml_threadpool * threadpool, struct ggml_threadpool * threadpool_batch) {
+    ctx->threadpool       = threadpool;
+    ctx->threadpool_batch = threadpool_batch;
+}
+
+void llama_detach_threadpool(struct llama_context * ctx) {
+    ctx->threadpool       = nullptr;
+    ctx->threadpool_batch = nullptr;
+}
+
 void llama_set_abort_callback(struct llama_context * ctx, bool (*abort_callback)(void * data), void * abort_callback_data) {
     ctx->abort_callback      = abort_callback;
     ctx->abort_callback_data = abort_callback_data;
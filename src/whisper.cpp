@@ -34,22 +34,45 @@
 #include <atomic>
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <cstdio>
 #include <cstdarg>
 #include <cstring>
 #include <fstream>
+#include <condition_variable>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 #include <regex>
 #include <random>
 #include <functional>
 #include <codecvt>
 
+#ifdef __has_include
+    #if __has_include(<unistd.h>)
+        #include <unistd.h>
+        #if defined(_POSIX_MAPPED_FILES)
+            #include <sys/mman.h>
+            #include <fcntl.h>
+        #endif
+    #endif
+#endif
+
+#if defined(_WIN32)
+    #define WIN32_LEAN_AND_MEAN
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#endif
+
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
@@ -157,6 +180,7 @@ static void whisper_log_callback_default(ggml_log_level level, const char * text
 
 //#define WHISPER_USE_FLASH_FF
 #define WHISPER_MAX_DECODERS 8
+#define WHISPER_SEQ_ID_PROMPT (2*WHISPER_MAX_DECODERS) // keeps the prompt in the KV cache during whisper_full
 #define WHISPER_MAX_NODES 4096
 
 //
@@ -185,12 +209,14 @@ static bool ggml_graph_compute_helper(
 static bool ggml_graph_compute_helper(
       ggml_backend_sched_t   sched,
         struct ggml_cgraph * graph,
-                       int   n_threads) {
+                       int   n_threads,
+    struct ggml_threadpool * threadpool) {
 
     for (int i = 0; i < ggml_backend_sched_get_n_backends(sched); ++i) {
         ggml_backend_t backend = ggml_backend_sched_get_backend(sched, i);
         if (ggml_backend_is_cpu(backend)) {
             ggml_backend_cpu_set_n_threads(backend, n_threads);
+            ggml_backend_cpu_set_threadpool(backend, threadpool);
         }
 #ifdef GGML_USE_BLAS
         if (ggml_backend_is_blas(backend)) {
@@ -405,7 +431,7 @@ struct whisper_vocab {
 
     int n_vocab = 51864;
 
-    std::map<token, id> token_to_id;
+    std::unordered_map<token, id> token_to_id;
     std::map<id, token> id_to_token;
 
     // reference: https://github.com/openai/whisper/blob/248b6cb124225dd263bb9bd32d060b6517e067f8/whisper/tokenizer.py#L334-L349
@@ -728,6 +754,9 @@ struct whisper_model {
     // the model backend data is read-only and can be shared between processors
     ggml_backend_buffer_t buffer = nullptr;
 
+    // CPU buffer wrapping the mapped model file - tensors allocated in it point directly into the mapping
+    ggml_backend_buffer_t buffer_mmap = nullptr;
+
     // tensors
     int n_loaded;
     std::map<std::string, struct ggml_tensor *> tensors;
@@ -743,7 +772,46 @@ struct whisper_grammar {
     std::vector<std::vector<const whisper_grammar_element *>>   stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
-    whisper_partial_utf8 partial_utf8;
+    whisper_partial_utf8 partial_utf8 = {};
+
+    whisper_grammar() = default;
+
+    whisper_grammar(
+            std::vector<std::vector<whisper_grammar_element>>         rules,
+            std::vector<std::vector<const whisper_grammar_element *>> stacks)
+        : rules(std::move(rules)), stacks(std::move(stacks)) {}
+
+    whisper_grammar(whisper_grammar &&) = default;
+    whisper_grammar & operator=(whisper_grammar &&) = default;
+
+    whisper_grammar(const whisper_grammar & other) {
+        *this = other;
+    }
+
+    // the stacks point into the rules, so they have to be rebased onto the copied rules
+    whisper_grammar & operator=(const whisper_grammar & other) {
+        if (this == &other) {
+            return *this;
+        }
+
+        rules        = other.rules;
+        stacks       = other.stacks;
+        partial_utf8 = other.partial_utf8;
+
+        for (auto & stack : stacks) {
+            for (auto & pos : stack) {
+                for (size_t i = 0; i < rules.size(); ++i) {
+                    const whisper_grammar_element * src = other.rules[i].data();
+                    if (pos >= src && pos < src + other.rules[i].size()) {
+                        pos = rules[i].data() + (pos - src);
+                        break;
+                    }
+                }
+            }
+        }
+
+        return *this;
+    }
 };
 
 struct whisper_grammar_candidate {
@@ -752,6 +820,36 @@ struct whisper_grammar_candidate {
     whisper_partial_utf8   partial_utf8;
 };
 
+// prefix tree of the text tokens, keyed by the decoded code points
+// used to evaluate the grammar once per shared prefix instead of once per token
+struct whisper_token_trie {
+    struct node {
+        std::vector<std::pair<uint32_t, int32_t>> children; // (code point, node index), sorted by code point
+
+        std::vector<whisper_token> ends; // tokens that end at this node with a complete code point
+
+        // tokens that end at this node with an incomplete (or invalid) UTF-8 sequence
+        std::vector<std::pair<whisper_token, whisper_partial_utf8>> ends_partial;
+    };
+
+    std::vector<node> nodes;
+
+    std::vector<whisper_token> ids; // all tokens in the trie, sorted
+};
+
+// rejected tokens per grammar state, shared by all decoders of a whisper_state
+struct whisper_grammar_cache {
+    std::mutex mutex;
+
+    whisper_token_trie trie;
+
+    // the rules the cached entries were computed for
+    std::vector<std::vector<whisper_grammar_element>> rules;
+
+    // key: the grammar stacks as (rule, offset) pairs - value: the accepted tokens (sorted)
+    std::map<std::vector<int32_t>, std::vector<whisper_token>> accepted;
+};
+
 struct whisper_sequence {
     std::vector<whisper_token_data> tokens;
 
@@ -766,6 +864,21 @@ struct whisper_sequence {
 };
 
 // TAGS: WHISPER_DECODER_INIT
+struct whisper_probs_stats {
+    whisper_token id;  // most likely token
+    whisper_token tid; // most likely timestamp token (-1 if none)
+
+    double sum_ts;     // total probability of the timestamp tokens
+    double max_ts;     // probability of the most likely timestamp token
+};
+
+// a block of the logits [i0, i1) and its max
+struct whisper_logits_block {
+    int   i0;
+    int   i1;
+    float max;
+};
+
 struct whisper_decoder {
     // the currently generated sequence of tokens
     whisper_sequence sequence;
@@ -785,6 +898,15 @@ struct whisper_decoder {
     std::vector<float> logits;
     std::vector<float> logprobs;
 
+    // statistics of the probs, computed together with them in whisper_process_logits
+    whisper_probs_stats probs_stats;
+
+    // the most likely tokens, sorted by probability - computed by whisper_process_logits
+    std::vector<whisper_token> top;
+
+    // maxima of the blocks of logits, used to find the max and the top tokens
+    std::vector<whisper_logits_block> logits_blocks;
+
     // work container used to avoid memory allocations
     std::vector<whisper_pair<double, whisper_vocab::id>> logits_id;
 
@@ -798,6 +920,105 @@ struct whisper_aheads_masks {
     ggml_backend_buffer_t buffer = nullptr;
 };
 
+// tokens that are suppressed by whisper_process_logits regardless of the decoded sequence
+// resolved once per whisper_full call, see whisper_suppress_init()
+struct whisper_suppress {
+    std::vector<whisper_token> pre;  // applied before the logits filter callback
+    std::vector<whisper_token> post; // applied after the logits filter callback
+};
+
+// a contiguous region of speech, in units of 10 ms
+struct whisper_vad_span {
+    int64_t t_proc; // start in the processed (speech-only) audio
+    int64_t t_orig; // start in the original input
+    int64_t len;
+};
+
+// worker threads owned by the state, reused across the whisper_full calls
+// used to process the decoders in parallel without creating new threads for every sampled token
+struct whisper_thread_pool {
+    whisper_thread_pool(int n_threads) {
+        for (int i = 1; i < n_threads; ++i) {
+            workers.emplace_back([this]() { worker(); });
+        }
+    }
+
+    ~whisper_thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv_job.notify_all();
+
+        for (auto & w : workers) {
+            w.join();
+        }
+    }
+
+    int size() const {
+        return workers.size() + 1;
+    }
+
+    // run the job on all threads, including the calling one, and wait for it to finish
+    void run(const std::function<void()> & fn) {
+        if (workers.empty()) {
+            fn();
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job       = &fn;
+            n_pending = workers.size();
+            generation++;
+        }
+        cv_job.notify_all();
+
+        fn();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [this]() { return n_pending == 0; });
+        job = nullptr;
+    }
+
+private:
+    void worker() {
+        uint64_t generation_done = 0;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv_job.wait(lock, [&]() { return stop || generation != generation_done; });
+            if (stop) {
+                return;
+            }
+
+            generation_done = generation;
+
+            const auto * fn = job;
+
+            lock.unlock();
+            (*fn)();
+            lock.lock();
+
+            if (--n_pending == 0) {
+                cv_done.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers;
+
+    std::mutex              mutex;
+    std::condition_variable cv_job;
+    std::condition_variable cv_done;
+
+    const std::function<void()> * job = nullptr;
+
+    int      n_pending  = 0;
+    uint64_t generation = 0;
+    bool     stop       = false;
+};
+
 struct whisper_state {
     int64_t t_sample_us = 0;
     int64_t t_encode_us = 0;
@@ -813,6 +1034,7 @@ struct whisper_state {
     int32_t n_prompt = 0; // number of decoder calls with n_tokens >  1  (prompt encoding)
     int32_t n_fail_p = 0; // number of logprob threshold failures
     int32_t n_fail_h = 0; // number of entropy threshold failures
+    int32_t n_exit   = 0; // number of tokens decoded with early exit
 
     // unified self-attention KV cache for all decoders
     whisper_kv_cache kv_self;
@@ -832,8 +1054,14 @@ struct whisper_state {
 
     whisper_decoder decoders[WHISPER_MAX_DECODERS];
 
+    // threads used by whisper_full to process the decoders in parallel
+    std::unique_ptr<whisper_thread_pool> workers;
+
     std::vector<ggml_backend_t> backends;
 
+    // CPU worker threads reused across the graphs (not needed with OpenMP)
+    struct ggml_threadpool * threadpool = nullptr;
+
     // - stores meta info about the intermediate tensors into the `meta` buffers
     whisper_sched sched_conv;
     whisper_sched sched_encode;
@@ -853,6 +1081,12 @@ struct whisper_state {
     std::vector<whisper_segment> result_all;
     std::vector<whisper_token>   prompt_past;
 
+    // the prompt that is stored in kv_self under WHISPER_SEQ_ID_PROMPT and the logits of its last token
+    // valid until kv_cross or kv_self are overwritten - a prompt decoded against the same encoder output
+    // (temperature fallback, cached encoder output, restored snapshot) is not decoded again
+    std::vector<whisper_token> prompt_cached;
+    std::vector<float>         prompt_logits;
+
     int lang_id = 0; // english by default
 
     std::string path_model; // populated by whisper_init_from_file_with_params()
@@ -865,6 +1099,10 @@ struct whisper_state {
     whisper_openvino_context * ctx_openvino = nullptr;
 #endif
 
+    whisper_suppress suppress;
+
+    whisper_grammar_cache grammar_cache;
+
     // [EXPERIMENTAL] token-level timestamps data
     int64_t t_beg  = 0;
     int64_t t_last = 0;
@@ -876,10 +1114,136 @@ struct whisper_state {
     // [EXPERIMENTAL] Token-level timestamps with DTW
     whisper_aheads_masks aheads_masks;
     ggml_tensor * aheads_cross_QKs = nullptr;
-    std::vector<float> aheads_cross_QKs_data;
 
     // [EXPERIMENTAL] speed-up techniques
     int32_t exp_n_audio_ctx = 0; // 0 - use default
+
+    // [EXPERIMENTAL] encoder output cache
+    // key of the mel window that embd_enc and kv_cross currently hold, the encoder is skipped when it is evaluated again
+    bool     exp_encoder_cache = false;
+    bool     enc_cache_valid   = false;
+    uint64_t enc_cache_hash    = 0;
+    int32_t  enc_cache_n_ctx   = 0;
+    int32_t  enc_cache_n_len   = 0;
+
+    // [EXPERIMENTAL] fast language detection - last detected language, reused when lang_detect_cache is set
+    int lang_detect_id = -1;
+    std::vector<float> lang_detect_probs;
+
+    // [EXPERIMENTAL] early exit from the decoder
+    int32_t exp_n_text_layer_exit = 0; // 0 - disabled
+    float   exp_text_exit_thold   = 0.0f;
+
+    struct ggml_context * ctx_exit    = nullptr;
+    ggml_backend_buffer_t buffer_exit = nullptr;
+    struct ggml_tensor  * embd_exit   = nullptr; // hidden state at the exit layer
+
+    // [EXPERIMENTAL] voice activity detection
+    // maps the speech-only audio that is transcribed back to the original input
+    std::vector<whisper_vad_span> vad_spans;
+};
+
+// read-only mapping of the whole model file
+struct whisper_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
+
+    whisper_mmap() = default;
+    whisper_mmap(const whisper_mmap &) = delete;
+
+#if defined(_POSIX_MAPPED_FILES)
+    static constexpr bool SUPPORTED = true;
+
+    bool init(const char * fname) {
+        const int fd = open(fname, O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+
+        const off_t n = lseek(fd, 0, SEEK_END);
+        if (n <= 0) {
+            close(fd);
+            return false;
+        }
+
+        void * ptr = mmap(NULL, n, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (ptr == MAP_FAILED) {
+            return false;
+        }
+
+        addr = ptr;
+        size = n;
+
+        // the weights are touched on the first encode anyway - start paging them in now
+        if (posix_madvise(addr, size, POSIX_MADV_WILLNEED)) {
+            WHISPER_LOG_WARN("%s: posix_madvise(.., POSIX_MADV_WILLNEED) failed: %s\n", __func__, strerror(errno));
+        }
+
+        return true;
+    }
+
+    ~whisper_mmap() {
+        if (addr) {
+            munmap(addr, size);
+        }
+    }
+#elif defined(_WIN32)
+    static constexpr bool SUPPORTED = true;
+
+    bool init(const char * fname) {
+        const int n_wide = MultiByteToWideChar(CP_UTF8, 0, fname, -1, NULL, 0);
+        if (n_wide <= 0) {
+            return false;
+        }
+
+        std::wstring fname_wide(n_wide, 0);
+        MultiByteToWideChar(CP_UTF8, 0, fname, -1, &fname_wide[0], n_wide);
+
+        HANDLE hFile = CreateFileW(fname_wide.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+
+        LARGE_INTEGER n;
+        if (!GetFileSizeEx(hFile, &n) || n.QuadPart <= 0) {
+            CloseHandle(hFile);
+            return false;
+        }
+
+        HANDLE hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        CloseHandle(hFile);
+
+        if (hMapping == NULL) {
+            return false;
+        }
+
+        void * ptr = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(hMapping);
+
+        if (ptr == NULL) {
+            return false;
+        }
+
+        addr = ptr;
+        size = n.QuadPart;
+
+        return true;
+    }
+
+    ~whisper_mmap() {
+        if (addr) {
+            UnmapViewOfFile(addr);
+        }
+    }
+#else
+    static constexpr bool SUPPORTED = false;
+
+    bool init(const char * /*fname*/) {
+        return false;
+    }
+#endif
 };
 
 struct whisper_context {
@@ -897,6 +1261,8 @@ struct whisper_context {
     whisper_state * state = nullptr;
 
     std::string path_model; // populated by whisper_init_from_file_with_params()
+
+    std::unique_ptr<whisper_mmap> mapping; // must outlive model.buffer_mmap
 };
 
 struct whisper_global {
@@ -916,7 +1282,8 @@ static void read_safe(whisper_model_loader * loader, T & dest) {
 static bool whisper_kv_cache_init(
              struct whisper_kv_cache & cache,
                       ggml_backend_t   backend,
-                           ggml_type   wtype,
+                           ggml_type   type_k,
+                           ggml_type   type_v,
                              int64_t   n_text_state,
                              int64_t   n_text_layer,
                                  int   n_ctx) {
@@ -942,8 +1309,8 @@ static bool whisper_kv_cache_init(
         return false;
     }
 
-    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    cache.k = ggml_new_tensor_1d(cache.ctx, type_k, n_elements);
+    cache.v = ggml_new_tensor_1d(cache.ctx, type_v, n_elements);
 
     cache.buffer = ggml_backend_alloc_ctx_tensors(cache.ctx, backend);
     if (!cache.buffer) {
@@ -1322,7 +1689,71 @@ static ggml_backend_buffer_type_t whisper_default_buffer_type(const whisper_cont
     return result;
 }
 
-// load the model from a ggml file
+static bool whisper_gguf_get_i32(const struct gguf_context * ctx, const char * key, int32_t & dst) {
+    const int kid = gguf_find_key(ctx, key);
+    if (kid < 0) {
+        WHISPER_LOG_ERROR("%s: key '%s' not found in model file\n", __func__, key);
+        return false;
+    }
+
+    switch (gguf_get_kv_type(ctx, kid)) {
+        case GGUF_TYPE_UINT32: dst = (int32_t) gguf_get_val_u32(ctx, kid); return true;
+        case GGUF_TYPE_INT32:  dst =           gguf_get_val_i32(ctx, kid); return true;
+        default:
+            WHISPER_LOG_ERROR("%s: key '%s' has unexpected type %s\n", __func__, key, gguf_type_name(gguf_get_kv_type(ctx, kid)));
+            return false;
+    }
+}
+
+// GGUF vocabs store the token bytes with the GPT-2 byte-to-unicode mapping, so that they are valid UTF-8
+static bool whisper_gguf_token_to_bytes(const char * text, std::string & dst) {
+    static const std::vector<int> cpt_to_byte = [] {
+        std::vector<int> result(324, -1);
+
+        int n = 0;
+        for (int b = 0; b < 256; ++b) {
+            const bool printable = (b >= '!' && b <= '~') || (b >= 0xA1 && b <= 0xAC) || (b >= 0xAE && b <= 0xFF);
+            result[printable ? b : 256 + n++] = b;
+        }
+
+        return result;
+    }();
+
+    dst.clear();
+
+    for (const uint8_t * p = (const uint8_t *) text; *p; ) {
+        uint32_t cpt;
+        if (p[0] < 0x80) {
+            cpt = p[0];
+            p += 1;
+        } else if ((p[0] & 0xE0) == 0xC0 && (p[1] & 0xC0) == 0x80) {
+            cpt = ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+            p += 2;
+        } else {
+            return false;
+        }
+
+        if (cpt >= cpt_to_byte.size() || cpt_to_byte[cpt] < 0) {
+            return false;
+        }
+
+        dst += (char) cpt_to_byte[cpt];
+    }
+
+    return true;
+}
+
+// change the type of a weight tensor that has not been allocated yet
+static void whisper_tensor_set_type(struct ggml_tensor * tensor, ggml_type type) {
+    tensor->type  = type;
+    tensor->nb[0] = ggml_type_size(type);
+    tensor->nb[1] = tensor->nb[0]*(tensor->ne[0]/ggml_blck_size(type));
+    for (int i = 2; i < GGML_MAX_DIMS; i++) {
+        tensor->nb[i] = tensor->nb[i - 1]*tensor->ne[i - 1];
+    }
+}
+
+// load the model from a ggml or a GGUF file
 //
 // file format:
 //
@@ -1333,6 +1764,9 @@ static ggml_backend_buffer_type_t whisper_default_buffer_type(const whisper_cont
 //
 // see the convert-pt-to-ggml.py script for details
 //
+// GGUF files store the hparams as "whisper.*" keys, the vocab in "tokenizer.ggml.tokens" and the mel filters
+// as the "mel_filters" tensor - see the convert_whisper_ggml_to_gguf.py script. they can be loaded only from a file
+//
 static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
     WHISPER_LOG_INFO("%s: loading model\n", __func__);
 
@@ -1343,11 +1777,98 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     auto & model = wctx.model;
     auto & vocab = wctx.vocab;
 
+    // when loading from a file into CPU memory, map the file so that the weights can be used in place
+    // the header is still parsed through the loader - count the consumed bytes to know where the tensor data starts
+    struct whisper_loader_offset {
+        whisper_model_loader * loader;
+        size_t offset;
+    };
+
+    whisper_loader_offset loader_offset = { loader, 0 };
+    whisper_model_loader loader_counting = {};
+
+#if !defined(GGML_BIG_ENDIAN)
+    if (wctx.params.use_mmap && whisper_mmap::SUPPORTED && !wctx.path_model.empty() &&
+        whisper_default_buffer_type(wctx.params) == ggml_backend_cpu_buffer_type()) {
+        wctx.mapping.reset(new whisper_mmap());
+        if (!wctx.mapping->init(wctx.path_model.c_str())) {
+            WHISPER_LOG_WARN("%s: failed to mmap '%s' - falling back to reading the weights\n", __func__, wctx.path_model.c_str());
+            wctx.mapping.reset();
+        }
+    }
+#endif
+
+    if (wctx.mapping) {
+        loader_counting.context = &loader_offset;
+
+        loader_counting.read = [](void * ctx, void * output, size_t read_size) {
+            whisper_loader_offset * lo = (whisper_loader_offset *) ctx;
+            const size_t n = lo->loader->read(lo->loader->context, output, read_size);
+            lo->offset += n;
+            return n;
+        };
+
+        loader_counting.eof = [](void * ctx) {
+            whisper_loader_offset * lo = (whisper_loader_offset *) ctx;
+            return lo->loader->eof(lo->loader->context);
+        };
+
+        loader_counting.close = [](void * ctx) {
+            whisper_loader_offset * lo = (whisper_loader_offset *) ctx;
+            lo->loader->close(lo->loader->context);
+        };
+
+        loader = &loader_counting;
+    }
+
+    std::unique_ptr<gguf_context, decltype(&gguf_free)> gguf(nullptr, gguf_free);
+    std::unique_ptr<ggml_context, decltype(&ggml_free)> gguf_meta(nullptr, ggml_free);
+
     // verify magic
     {
         uint32_t magic;
         read_safe(loader, magic);
-        if (magic != GGML_FILE_MAGIC) {
+        if (memcmp(&magic, GGUF_MAGIC, sizeof(magic)) == 0) {
+#if defined(GGML_BIG_ENDIAN)
+            WHISPER_LOG_ERROR("%s: GGUF models are not supported on big-endian hosts\n", __func__);
+            return false;
+#endif
+            if (wctx.path_model.empty()) {
+                WHISPER_LOG_ERROR("%s: GGUF models can only be loaded from a file\n", __func__);
+                return false;
+            }
+
+            struct ggml_context * meta = nullptr;
+
+            struct gguf_init_params params = {
+                /*.no_alloc =*/ true,
+                /*.ctx      =*/ &meta,
+            };
+
+            gguf.reset(gguf_init_from_file(wctx.path_model.c_str(), params));
+            gguf_meta.reset(meta);
+
+            if (!gguf) {
+                WHISPER_LOG_ERROR("%s: failed to read GGUF metadata from '%s'\n", __func__, wctx.path_model.c_str());
+                return false;
+            }
+
+            const int kid_arch = gguf_find_key(gguf.get(), "general.architecture");
+            if (kid_arch < 0 || gguf_get_kv_type(gguf.get(), kid_arch) != GGUF_TYPE_STRING ||
+                strcmp(gguf_get_val_str(gguf.get(), kid_arch), "whisper") != 0) {
+                WHISPER_LOG_ERROR("%s: GGUF model is not a whisper model\n", __func__);
+                return false;
+            }
+
+            const int kid_split = gguf_find_key(gguf.get(), "split.count");
+            if (kid_split >= 0 && gguf_get_kv_type(gguf.get(), kid_split) == GGUF_TYPE_UINT16 && gguf_get_val_u16(gguf.get(), kid_split) > 1) {
+                WHISPER_LOG_ERROR("%s: split GGUF models are not supported - merge them with gguf-split --merge\n", __func__);
+                return false;
+            }
+
+            WHISPER_LOG_INFO("%s: GGUF v%d, %d tensors, alignment %zu\n", __func__,
+                    gguf_get_version(gguf.get()), gguf_get_n_tensors(gguf.get()), gguf_get_alignment(gguf.get()));
+        } else if (magic != GGML_FILE_MAGIC) {
             WHISPER_LOG_ERROR("%s: invalid model data (bad magic)\n", __func__);
             return false;
         }
@@ -1357,17 +1878,44 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     {
         auto & hparams = model.hparams;
 
-        read_safe(loader, hparams.n_vocab);
-        read_safe(loader, hparams.n_audio_ctx);
-        read_safe(loader, hparams.n_audio_state);
-        read_safe(loader, hparams.n_audio_head);
-        read_safe(loader, hparams.n_audio_layer);
-        read_safe(loader, hparams.n_text_ctx);
-        read_safe(loader, hparams.n_text_state);
-        read_safe(loader, hparams.n_text_head);
-        read_safe(loader, hparams.n_text_layer);
-        read_safe(loader, hparams.n_mels);
-        read_safe(loader, hparams.ftype);
+        if (gguf) {
+            const gguf_context * gctx = gguf.get();
+
+            int32_t qntvr = 0;
+
+            const bool ok =
+                whisper_gguf_get_i32(gctx, "whisper.vocab_size",                 hparams.n_vocab)       &&
+                whisper_gguf_get_i32(gctx, "whisper.audio.context_length",       hparams.n_audio_ctx)   &&
+                whisper_gguf_get_i32(gctx, "whisper.audio.embedding_length",     hparams.n_audio_state) &&
+                whisper_gguf_get_i32(gctx, "whisper.audio.attention.head_count", hparams.n_audio_head)  &&
+                whisper_gguf_get_i32(gctx, "whisper.audio.block_count",          hparams.n_audio_layer) &&
+                whisper_gguf_get_i32(gctx, "whisper.text.context_length",        hparams.n_text_ctx)    &&
+                whisper_gguf_get_i32(gctx, "whisper.text.embedding_length",      hparams.n_text_state)  &&
+                whisper_gguf_get_i32(gctx, "whisper.text.attention.head_count",  hparams.n_text_head)   &&
+                whisper_gguf_get_i32(gctx, "whisper.text.block_count",           hparams.n_text_layer)  &&
+                whisper_gguf_get_i32(gctx, "whisper.mel_count",                  hparams.n_mels)        &&
+                whisper_gguf_get_i32(gctx, "general.file_type",                  hparams.ftype)         &&
+                (gguf_find_key(gctx, "general.quantization_version") < 0 ||
+                 whisper_gguf_get_i32(gctx, "general.quantization_version",      qntvr));
+
+            if (!ok) {
+                return false;
+            }
+
+            hparams.ftype += qntvr*GGML_QNT_VERSION_FACTOR;
+        } else {
+            read_safe(loader, hparams.n_vocab);
+            read_safe(loader, hparams.n_audio_ctx);
+            read_safe(loader, hparams.n_audio_state);
+            read_safe(loader, hparams.n_audio_head);
+            read_safe(loader, hparams.n_audio_layer);
+            read_safe(loader, hparams.n_text_ctx);
+            read_safe(loader, hparams.n_text_state);
+            read_safe(loader, hparams.n_text_head);
+            read_safe(loader, hparams.n_text_layer);
+            read_safe(loader, hparams.n_mels);
+            read_safe(loader, hparams.ftype);
+        }
 
         assert(hparams.n_text_state == hparams.n_audio_state);
 
@@ -1422,24 +1970,54 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         WHISPER_LOG_INFO("%s: ftype         = %d\n", __func__, model.hparams.ftype);
         WHISPER_LOG_INFO("%s: qntvr         = %d\n", __func__, qntvr);
         WHISPER_LOG_INFO("%s: type          = %d (%s%s)\n", __func__, model.type, g_model_name.at(model.type).c_str(), mver.c_str());
+        if (hparams.n_text_layer != hparams.n_audio_layer) {
+            WHISPER_LOG_INFO("%s: distilled decoder (%d encoder layers, %d decoder layers)\n", __func__, hparams.n_audio_layer, hparams.n_text_layer);
+        }
     }
 
     // load mel filters
     {
         auto & filters = wctx.model.filters;
 
-        read_safe(loader, filters.n_mel);
-        read_safe(loader, filters.n_fft);
+        if (gguf) {
+            // the data is read together with the weights
+            const ggml_tensor * t = ggml_get_tensor(gguf_meta.get(), "mel_filters");
+            if (!t || t->type != GGML_TYPE_F32 || ggml_n_dims(t) != 2) {
+                WHISPER_LOG_ERROR("%s: missing or invalid 'mel_filters' tensor in model file\n", __func__);
+                return false;
+            }
+
+            filters.n_fft = t->ne[0];
+            filters.n_mel = t->ne[1];
+
+            filters.data.resize(filters.n_mel * filters.n_fft);
+        } else {
+            read_safe(loader, filters.n_mel);
+            read_safe(loader, filters.n_fft);
 
-        filters.data.resize(filters.n_mel * filters.n_fft);
-        loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
-        BYTESWAP_FILTERS(filters);
+            filters.data.resize(filters.n_mel * filters.n_fft);
+            loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
+            BYTESWAP_FILTERS(filters);
+        }
     }
 
     // load vocab
     {
         int32_t n_vocab = 0;
-        read_safe(loader, n_vocab);
+
+        int kid_tokens = -1;
+        if (gguf) {
+            kid_tokens = gguf_find_key(gguf.get(), "tokenizer.ggml.tokens");
+            if (kid_tokens < 0 || gguf_get_kv_type(gguf.get(), kid_tokens) != GGUF_TYPE_ARRAY ||
+                gguf_get_arr_type(gguf.get(), kid_tokens) != GGUF_TYPE_STRING) {
+                WHISPER_LOG_ERROR("%s: missing or invalid 'tokenizer.ggml.tokens' in model file\n", __func__);
+                return false;
+            }
+
+            n_vocab = gguf_get_arr_n(gguf.get(), kid_tokens);
+        } else {
+            read_safe(loader, n_vocab);
+        }
 
         //if (n_vocab != model.hparams.n_vocab) {
         //    WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad vocab size %d != %d)\n",
@@ -1453,6 +2031,18 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         tmp.reserve(128);
 
         for (int i = 0; i < n_vocab; i++) {
+            if (gguf) {
+                if (!whisper_gguf_token_to_bytes(gguf_get_arr_str(gguf.get(), kid_tokens, i), word)) {
+                    WHISPER_LOG_ERROR("%s: invalid token %d in model file\n", __func__, i);
+                    return false;
+                }
+
+                vocab.token_to_id[word] = i;
+                vocab.id_to_token[i] = word;
+
+                continue;
+            }
+
             uint32_t len;
             read_safe(loader, len);
 
@@ -1746,42 +2336,296 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         }
     }
 
-    // allocate tensors in the backend buffers
-    model.buffer = ggml_backend_alloc_ctx_tensors_from_buft(model.ctx, whisper_default_buffer_type(wctx.params));
-    if (!model.buffer) {
-        WHISPER_LOG_ERROR("%s: failed to allocate memory for the model\n", __func__);
-        return false;
-    }
-
-    size_t size_main = ggml_backend_buffer_get_size(model.buffer);
-    WHISPER_LOG_INFO("%s: %8s total size = %8.2f MB\n", __func__, ggml_backend_buffer_name(model.buffer), size_main / 1e6);
-
-    // load weights
-    {
-        size_t total_size = 0;
+    // location of the tensor data in the model file, when known before reading it
+    struct whisper_weight {
+        ggml_tensor * tensor; // nullptr for the mel filters
+        size_t offset;
+    };
 
-        model.n_loaded = 0;
+    std::vector<whisper_weight> weights;
 
-        std::vector<char> read_buf;
+    if (gguf) {
+        const gguf_context * gctx = gguf.get();
 
-        while (true) {
-            int32_t n_dims;
-            int32_t length;
-            int32_t ttype;
+        const size_t data_offset = gguf_get_data_offset(gctx);
 
-            read_safe(loader, n_dims);
-            read_safe(loader, length);
-            read_safe(loader, ttype);
+        for (int i = 0; i < gguf_get_n_tensors(gctx); ++i) {
+            const char * name = gguf_get_tensor_name(gctx, i);
+            const size_t offset = data_offset + gguf_get_tensor_offset(gctx, i);
 
-            if (loader->eof(loader->context)) {
-                break;
+            if (strcmp(name, "mel_filters") == 0) {
+                weights.push_back({ nullptr, offset });
+                continue;
             }
 
-            int32_t nelements = 1;
-            int32_t ne[4] = { 1, 1, 1, 1 };
-            for (int i = 0; i < n_dims; ++i) {
-                read_safe(loader, ne[i]);
-                nelements *= ne[i];
+            auto it = model.tensors.find(name);
+            if (it == model.tensors.end()) {
+                WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name);
+                return false;
+            }
+
+            ggml_tensor * tensor = it->second;
+            const ggml_tensor * meta = ggml_get_tensor(gguf_meta.get(), name);
+
+            if (!ggml_are_same_shape(tensor, meta)) {
+                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
+                        __func__, name, (int) meta->ne[0], (int) meta->ne[1], (int) meta->ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+                return false;
+            }
+
+            if (meta->type != tensor->type) {
+                // the matrices can be stored in any type supported by ggml_mul_mat, including the repacked CPU types
+                // the token embedding is also used with ggml_get_rows, which cannot read the repacked types
+                const bool repacked = meta->type == GGML_TYPE_Q4_0_4_4 || meta->type == GGML_TYPE_Q4_0_4_8 || meta->type == GGML_TYPE_Q4_0_8_8;
+
+                if (tensor->type != wctx.wtype || ggml_n_dims(tensor) != 2 || tensor->ne[0] % ggml_blck_size(meta->type) != 0 ||
+                    (repacked && tensor == model.d_te)) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has unsupported type %s in model file, expected %s\n",
+                            __func__, name, ggml_type_name(meta->type), ggml_type_name(tensor->type));
+                    return false;
+                }
+
+                whisper_tensor_set_type(tensor, meta->type);
+            }
+
+            weights.push_back({ tensor, offset });
+        }
+
+        // read the data in file order, so that the loader never has to seek backwards
+        std::sort(weights.begin(), weights.end(), [](const whisper_weight & a, const whisper_weight & b) {
+            return a.offset < b.offset;
+        });
+    } else if (wctx.mapping) {
+        // scan the tensor headers in the mapping - the regular load loop below reports malformed or unexpected tensors
+        const uint8_t * data = (const uint8_t *) wctx.mapping->addr;
+        const size_t    size = wctx.mapping->size;
+
+        size_t offset = loader_offset.offset;
+
+        while (offset + 3*sizeof(int32_t) <= size) {
+            int32_t n_dims;
+            int32_t length;
+            int32_t ttype;
+
+            memcpy(&n_dims, data + offset + 0*sizeof(int32_t), sizeof(int32_t));
+            memcpy(&length, data + offset + 1*sizeof(int32_t), sizeof(int32_t));
+            memcpy(&ttype,  data + offset + 2*sizeof(int32_t), sizeof(int32_t));
+            offset += 3*sizeof(int32_t);
+
+            if (n_dims < 0 || n_dims > 4 || length < 0 || ttype < 0 || ttype >= GGML_TYPE_COUNT ||
+                offset + n_dims*sizeof(int32_t) + length > size) {
+                break;
+            }
+
+            int64_t nelements = 1;
+            for (int i = 0; i < n_dims; ++i) {
+                int32_t ne;
+                memcpy(&ne, data + offset, sizeof(int32_t));
+                offset += sizeof(int32_t);
+                nelements *= ne;
+            }
+
+            const std::string name((const char *) data + offset, length);
+            offset += length;
+
+            if (nelements <= 0 || ggml_blck_size(ggml_type(ttype)) <= 0 || nelements % ggml_blck_size(ggml_type(ttype)) != 0) {
+                break;
+            }
+
+            const size_t nbytes = ggml_row_size(ggml_type(ttype), nelements);
+            if (offset + nbytes > size) {
+                break;
+            }
+
+            auto it = model.tensors.find(name);
+            if (it != model.tensors.end() && it->second->type == ggml_type(ttype) && ggml_nbytes(it->second) == nbytes) {
+                weights.push_back({ it->second, offset });
+            }
+
+            offset += nbytes;
+        }
+    }
+
+    // point every tensor whose data is suitably aligned in the file directly into the mapping
+    if (wctx.mapping) {
+        model.buffer_mmap = ggml_backend_cpu_buffer_from_ptr(wctx.mapping->addr, wctx.mapping->size);
+
+        for (const auto & w : weights) {
+            ggml_tensor * tensor = w.tensor;
+
+            if (!tensor || tensor->data || w.offset + ggml_nbytes(tensor) > wctx.mapping->size) {
+                continue;
+            }
+
+            // the CPU kernels use unaligned SIMD loads, but the scalar fields must be naturally aligned
+            const size_t align = ggml_is_quantized(tensor->type) ? sizeof(ggml_fp16_t) : ggml_type_size(tensor->type);
+
+            uint8_t * addr = (uint8_t *) wctx.mapping->addr + w.offset;
+
+            if (((uintptr_t) addr) % align == 0) {
+                ggml_backend_tensor_alloc(model.buffer_mmap, tensor, addr);
+            }
+        }
+    }
+
+    // allocate the remaining tensors in the backend buffers
+    size_t n_mapped = 0;
+    size_t size_mapped = 0;
+
+    for (const auto & kv : model.tensors) {
+        if (kv.second->buffer && kv.second->buffer == model.buffer_mmap) {
+            n_mapped++;
+            size_mapped += ggml_nbytes(kv.second);
+        }
+    }
+
+    if (n_mapped < model.tensors.size()) {
+        model.buffer = ggml_backend_alloc_ctx_tensors_from_buft(model.ctx, whisper_default_buffer_type(wctx.params));
+        if (!model.buffer) {
+            WHISPER_LOG_ERROR("%s: failed to allocate memory for the model\n", __func__);
+            return false;
+        }
+
+        size_t size_main = ggml_backend_buffer_get_size(model.buffer);
+        WHISPER_LOG_INFO("%s: %8s total size = %8.2f MB\n", __func__, ggml_backend_buffer_name(model.buffer), size_main / 1e6);
+    }
+
+    if (model.buffer_mmap) {
+        WHISPER_LOG_INFO("%s: %8s mapped size = %8.2f MB (%zu/%zu tensors)\n", __func__, "mmap", size_mapped / 1e6, n_mapped, model.tensors.size());
+    }
+
+    // from here on, the tensor data is read from the mapping instead of the loader
+    struct whisper_mmap_reader {
+        const uint8_t * data;
+        size_t size;
+        size_t offset;
+    };
+
+    whisper_mmap_reader mmap_reader = {};
+    whisper_model_loader loader_mmap = {};
+
+    if (wctx.mapping) {
+        mmap_reader = { (const uint8_t *) wctx.mapping->addr, wctx.mapping->size, gguf ? sizeof(uint32_t) : loader_offset.offset };
+
+        loader_mmap.context = &mmap_reader;
+
+        loader_mmap.read = [](void * ctx, void * output, size_t read_size) {
+            whisper_mmap_reader * mr = (whisper_mmap_reader *) ctx;
+            const size_t n = std::min(read_size, mr->size - std::min(mr->offset, mr->size));
+            memcpy(output, mr->data + mr->offset, n);
+            mr->offset += n;
+            return n;
+        };
+
+        loader_mmap.eof = [](void * ctx) {
+            whisper_mmap_reader * mr = (whisper_mmap_reader *) ctx;
+            return mr->offset >= mr->size;
+        };
+
+        loader_mmap.close = [](void * /*ctx*/) { };
+
+        loader = &loader_mmap;
+    }
+
+    // load weights
+    {
+        size_t total_size = 0;
+
+        model.n_loaded = 0;
+
+        std::vector<char> read_buf;
+
+        if (gguf) {
+            // the loader is past the magic and only moves forward
+            size_t offset_cur = sizeof(uint32_t);
+
+            auto read_at = [&](size_t offset, void * dst, size_t size) {
+                if (wctx.mapping && offset > offset_cur) {
+                    // skip over the mapped tensors without copying them
+                    mmap_reader.offset = offset_cur = offset;
+                }
+
+                // only a short read is checked for the end of the file - the data of the last tensor ends exactly at it
+                auto read_n = [&](void * buf, size_t n) {
+                    size_t n_read = 0;
+                    while (n_read < n) {
+                        const size_t n_cur = loader->read(loader->context, (char *) buf + n_read, n - n_read);
+                        if (n_cur < n - n_read && (n_cur == 0 || loader->eof(loader->context))) {
+                            return false;
+                        }
+
+                        n_read     += n_cur;
+                        offset_cur += n_cur;
+                    }
+
+                    return true;
+                };
+
+                while (offset_cur < offset) {
+                    read_buf.resize(std::min<size_t>(offset - offset_cur, 1024*1024));
+
+                    if (!read_n(read_buf.data(), read_buf.size())) {
+                        return false;
+                    }
+                }
+
+                return offset == offset_cur && read_n(dst, size);
+            };
+
+            for (const auto & w : weights) {
+                ggml_tensor * tensor = w.tensor;
+
+                if (!tensor) {
+                    if (!read_at(w.offset, model.filters.data.data(), model.filters.data.size()*sizeof(float))) {
+                        WHISPER_LOG_ERROR("%s: failed to read the mel filters from model file\n", __func__);
+                        return false;
+                    }
+                    continue;
+                }
+
+                bool ok = true;
+
+                if (model.buffer_mmap && tensor->buffer == model.buffer_mmap) {
+                    // the tensor already points at its data in the mapping
+                } else if (ggml_backend_buffer_is_host(model.buffer)) {
+                    ok = read_at(w.offset, tensor->data, ggml_nbytes(tensor));
+                } else {
+                    std::vector<char> tmp(ggml_nbytes(tensor));
+
+                    ok = read_at(w.offset, tmp.data(), tmp.size());
+                    if (ok) {
+                        ggml_backend_tensor_set(tensor, tmp.data(), 0, tmp.size());
+                    }
+                }
+
+                if (!ok) {
+                    WHISPER_LOG_ERROR("%s: failed to read tensor '%s' from model file\n", __func__, ggml_get_name(tensor));
+                    return false;
+                }
+
+                total_size += ggml_nbytes(tensor);
+                model.n_loaded++;
+            }
+        }
+
+        while (!gguf) {
+            int32_t n_dims;
+            int32_t length;
+            int32_t ttype;
+
+            read_safe(loader, n_dims);
+            read_safe(loader, length);
+            read_safe(loader, ttype);
+
+            if (loader->eof(loader->context)) {
+                break;
+            }
+
+            int32_t nelements = 1;
+            int32_t ne[4] = { 1, 1, 1, 1 };
+            for (int i = 0; i < n_dims; ++i) {
+                read_safe(loader, ne[i]);
+                nelements *= ne[i];
             }
 
             std::string name;
@@ -1821,7 +2665,10 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
             //printf("%s: [%5.5s] %s\n", __func__, ggml_backend_name(backend), name.c_str());
 
-            if (ggml_backend_buffer_is_host(model.buffer)) {
+            if (model.buffer_mmap && tensor->buffer == model.buffer_mmap) {
+                // the tensor already points at its data in the mapping
+                mmap_reader.offset += ggml_nbytes(tensor);
+            } else if (ggml_backend_buffer_is_host(model.buffer)) {
                 // for the CPU and Metal backend, we can read directly into the tensor
                 loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
                 BYTESWAP_TENSOR(tensor);
@@ -1849,7 +2696,13 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         }
     }
 
-    ggml_backend_buffer_set_usage(model.buffer, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+    if (model.buffer) {
+        ggml_backend_buffer_set_usage(model.buffer, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+    }
+
+    if (model.buffer_mmap) {
+        ggml_backend_buffer_set_usage(model.buffer_mmap, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+    }
 
     wctx.t_load_us = ggml_time_us() - t_start_us;
 
@@ -1927,7 +2780,12 @@ static struct ggml_cgraph * whisper_build_graph_conv(
 
     if (!whisper_encode_external(wstate)) {
         // convolution + gelu
-        {
+        // on the CPU, use the fused kernel that does not need the full im2col buffer
+        if (ggml_backend_is_cpu(wstate.backends[0]) &&
+            model.e_conv_1_w->type == GGML_TYPE_F16 && model.e_conv_2_w->type == GGML_TYPE_F16) {
+            cur = ggml_conv_1d_fused(ctx0, model.e_conv_1_w, mel, model.e_conv_1_b, 1, model.e_conv_1_w->ne[0]/2, 1, true);
+            cur = ggml_conv_1d_fused(ctx0, model.e_conv_2_w, cur, model.e_conv_2_b, 2, model.e_conv_2_w->ne[0]/2, 1, true);
+        } else {
             cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
             cur = ggml_add(ctx0, cur, model.e_conv_1_b);
 
@@ -2255,15 +3113,15 @@ static struct ggml_cgraph * whisper_build_graph_cross(
 
         if (wctx.params.flash_attn) {
             k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx_pad));
+                    ggml_row_size(wstate.kv_cross.k->type, n_state)*(il*n_ctx_pad));
 
             v = ggml_view_1d(ctx0, wstate.kv_cross.v, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.v)*n_state)*(il*n_ctx_pad));
+                    ggml_row_size(wstate.kv_cross.v->type, n_state)*(il*n_ctx_pad));
         } else {
             Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
 
             k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
+                    ggml_row_size(wstate.kv_cross.k->type, n_state)*(il*n_ctx));
 
             v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
                     (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
@@ -2281,6 +3139,47 @@ static struct ggml_cgraph * whisper_build_graph_cross(
     return gf;
 }
 
+// FNV-1a hash of the mel frames that are the input of the conv graph for the given offset
+static uint64_t whisper_mel_window_hash(const whisper_state & wstate, int mel_offset, int n_ctx, int & n_len) {
+    const ggml_tensor * mel = wstate.mel.tensor;
+
+    const int i0 = std::min(mel_offset,           int(mel->ne[0]));
+    const int i1 = std::min(mel_offset + 2*n_ctx, int(mel->ne[0]));
+
+    n_len = i1 - i0;
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    std::vector<uint32_t> row(n_len);
+    for (int j = 0; j < mel->ne[1]; ++j) {
+        ggml_backend_tensor_get(mel, row.data(), j*mel->nb[1] + i0*sizeof(float), n_len*sizeof(float));
+        for (const uint32_t v : row) {
+            hash = (hash ^ v) * 0x100000001b3ULL;
+        }
+    }
+
+    return hash;
+}
+
+// without OpenMP, ggml would otherwise create and join the CPU threads for every graph
+static struct ggml_threadpool * whisper_state_threadpool(whisper_state & wstate, int n_threads) {
+    if (ggml_cpu_has_openmp() || n_threads <= 1) {
+        return nullptr;
+    }
+
+    if (wstate.threadpool && ggml_threadpool_get_n_threads(wstate.threadpool) != n_threads) {
+        ggml_threadpool_free(wstate.threadpool);
+        wstate.threadpool = nullptr;
+    }
+
+    if (wstate.threadpool == nullptr) {
+        const struct ggml_threadpool_params params = ggml_threadpool_params_default(n_threads);
+        wstate.threadpool = ggml_threadpool_new(&params);
+    }
+
+    return wstate.threadpool;
+}
+
 // evaluate the encoder with the given state
 //
 // given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
@@ -2300,6 +3199,25 @@ static bool whisper_encode_internal(
                    void * abort_callback_data) {
     const int64_t t_start_us = ggml_time_us();
 
+    uint64_t enc_hash  = 0;
+    int      enc_n_len = 0;
+
+    const int enc_n_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+
+    if (wstate.exp_encoder_cache) {
+        enc_hash = whisper_mel_window_hash(wstate, mel_offset, enc_n_ctx, enc_n_len);
+
+        if (wstate.enc_cache_valid && wstate.enc_cache_hash == enc_hash && wstate.enc_cache_n_ctx == enc_n_ctx && wstate.enc_cache_n_len == enc_n_len) {
+            WHISPER_LOG_DEBUG("%s: reusing the cached encoder output\n", __func__);
+
+            return !(abort_callback && abort_callback(abort_callback_data));
+        }
+    }
+
+    // the cross-attention cache is overwritten below, together with the prompt decoded against it
+    wstate.enc_cache_valid = false;
+    wstate.prompt_cached.clear();
+
     // conv
     {
         auto & sched = wstate.sched_conv.sched;
@@ -2311,7 +3229,7 @@ static bool whisper_encode_internal(
             return false;
         }
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, whisper_state_threadpool(wstate, n_threads))) {
             return false;
         }
 
@@ -2338,7 +3256,7 @@ static bool whisper_encode_internal(
             return false;
         }
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, whisper_state_threadpool(wstate, n_threads))) {
             return false;
         }
     }
@@ -2354,7 +3272,7 @@ static bool whisper_encode_internal(
             return false;
         }
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, whisper_state_threadpool(wstate, n_threads))) {
             return false;
         }
     }
@@ -2362,15 +3280,71 @@ static bool whisper_encode_internal(
     wstate.t_encode_us += ggml_time_us() - t_start_us;
     wstate.n_encode++;
 
+    if (wstate.exp_encoder_cache) {
+        wstate.enc_cache_valid = true;
+        wstate.enc_cache_hash  = enc_hash;
+        wstate.enc_cache_n_ctx = enc_n_ctx;
+        wstate.enc_cache_n_len = enc_n_len;
+    }
+
     return !(abort_callback && abort_callback(abort_callback_data));
 }
 
+// store the self-attention K and V of the batch in the layer il of the cache, starting at cell kv_head
+static void whisper_build_kv_store(
+     struct ggml_context * ctx0,
+      struct ggml_cgraph * gf,
+   const whisper_context & wctx,
+  const whisper_kv_cache & kv_self,
+      struct ggml_tensor * Kcur,
+      struct ggml_tensor * Vcur,
+                     int   il,
+                     int   n_tokens,
+                     int   kv_head) {
+    const int n_ctx   = kv_self.size;
+    const int n_state = Kcur->ne[0];
+
+    struct ggml_tensor * k;
+    struct ggml_tensor * v;
+
+    if (wctx.params.flash_attn) {
+        k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
+                ggml_row_size(kv_self.k->type, n_state)*(il*n_ctx + kv_head));
+
+        v = ggml_view_1d(ctx0, kv_self.v, n_tokens*n_state,
+                ggml_row_size(kv_self.v->type, n_state)*(il*n_ctx + kv_head));
+    } else {
+        Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_tokens));
+
+        k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
+                ggml_row_size(kv_self.k->type, n_state)*(il*n_ctx + kv_head));
+
+        v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_state,
+                (   n_ctx)*ggml_element_size(kv_self.v),
+                (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
+    }
+
+    ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
+    ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
+}
+
+// [EXPERIMENTAL] early exit
+// the decoder can be evaluated in parts, so that the last layers are skipped when the logits at the exit layer
+// (wstate.exp_n_text_layer_exit) are confident enough
+enum whisper_decoder_part {
+    WHISPER_DECODER_FULL,    // all layers
+    WHISPER_DECODER_HEAD,    // layers before the exit layer, the hidden state is saved in wstate.embd_exit
+    WHISPER_DECODER_TAIL,    // remaining layers, starting from wstate.embd_exit
+    WHISPER_DECODER_KV_FILL, // only the self-attention K/V of the remaining layers, computed from wstate.embd_exit
+};
+
 static struct ggml_cgraph * whisper_build_graph_decoder(
          whisper_context & wctx,
          whisper_state   & wstate,
      const whisper_batch & batch,
                     bool   save_alignment_heads_QKs,
-                    bool   worst_case) {
+                    bool   worst_case,
+    whisper_decoder_part   part = WHISPER_DECODER_FULL) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
@@ -2393,6 +3367,10 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
     const int32_t n_kv    = worst_case ? n_ctx            : kv_self.n;
     const int32_t kv_head = worst_case ? n_ctx - n_tokens : kv_self.head;
 
+    // range of layers to evaluate
+    const int il0 = part == WHISPER_DECODER_TAIL || part == WHISPER_DECODER_KV_FILL ? wstate.exp_n_text_layer_exit : 0;
+    const int il1 = part == WHISPER_DECODER_HEAD                                    ? wstate.exp_n_text_layer_exit : n_layer;
+
     //WHISPER_LOG_DEBUG("%s: n_past = %d, n_tokens = %d, n_audio_ctx = %d, n_ctx = %d\n", __func__, n_past, n_tokens, n_audio_ctx, n_ctx);
 
     struct ggml_init_params params = {
@@ -2405,34 +3383,74 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
     ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
 
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
-    ggml_set_name(embd, "embd");
-    ggml_set_input(embd);
-
-    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
-    ggml_set_name(position, "position");
-    ggml_set_input(position);
-
     const float KQscale = pow(float(n_state_head), -0.25);
 
-    struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD), 1);
-    ggml_set_name(KQ_mask, "KQ_mask");
-    ggml_set_input(KQ_mask);
+    struct ggml_tensor * cur;
 
-    struct ggml_tensor * KQ_mask_f16 = ggml_cast(ctx0, KQ_mask, GGML_TYPE_F16);
+    if (il0 == 0) {
+        struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        ggml_set_name(embd, "embd");
+        ggml_set_input(embd);
+
+        struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        ggml_set_name(position, "position");
+        ggml_set_input(position);
 
-    // token encoding + position encoding
-    struct ggml_tensor * cur =
-        ggml_add(ctx0,
+        // token encoding + position encoding
+        cur = ggml_add(ctx0,
                 ggml_get_rows(ctx0, model.d_te, embd),
                 ggml_get_rows(ctx0, model.d_pe, position));
+    } else {
+        cur = ggml_view_2d(ctx0, wstate.embd_exit, n_state, n_tokens, wstate.embd_exit->nb[1], 0);
+    }
 
     struct ggml_tensor * inpL = cur;
 
+    // [EXPERIMENTAL] early exit - propagate the hidden state of the exit layer to the K/V of the skipped layers
+    if (part == WHISPER_DECODER_KV_FILL) {
+        for (int il = il0; il < il1; ++il) {
+            const auto & layer = model.layers_decoder[il];
+
+            cur = ggml_norm(ctx0, inpL, hparams.eps);
+
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        cur,
+                        layer.attn_ln_0_w),
+                    layer.attn_ln_0_b);
+
+            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
+                    layer.attn_k_w,
+                    cur);
+
+            Kcur = ggml_scale(ctx0, Kcur, KQscale);
+
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                    layer.attn_v_w,
+                    cur);
+
+            Vcur = ggml_add(ctx0,
+                        Vcur,
+                        layer.attn_v_b);
+
+            whisper_build_kv_store(ctx0, gf, wctx, kv_self, Kcur, Vcur, il, n_tokens, kv_head);
+        }
+
+        ggml_free(ctx0);
+
+        return gf;
+    }
+
+    struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD), 1);
+    ggml_set_name(KQ_mask, "KQ_mask");
+    ggml_set_input(KQ_mask);
+
+    struct ggml_tensor * KQ_mask_f16 = ggml_cast(ctx0, KQ_mask, GGML_TYPE_F16);
+
     // [EXPERIMENTAL] Token-level timestamps with DTW
     struct ggml_tensor * aheads_cross_QKs = nullptr;
 
-    for (int il = 0; il < n_layer; ++il) {
+    for (int il = il0; il < il1; ++il) {
         const auto & layer = model.layers_decoder[il];
 
         // norm
@@ -2476,28 +3494,7 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                             Vcur,
                             layer.attn_v_b);
 
-                struct ggml_tensor * k;
-                struct ggml_tensor * v;
-
-                if (wctx.params.flash_attn) {
-                    k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
-
-                    v = ggml_view_1d(ctx0, kv_self.v, n_tokens*n_state,
-                            (ggml_element_size(kv_self.v)*n_state)*(il*n_ctx + kv_head));
-                } else {
-                    Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_tokens));
-
-                    k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
-
-                    v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_state,
-                            (   n_ctx)*ggml_element_size(kv_self.v),
-                            (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
-                }
-
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
+                whisper_build_kv_store(ctx0, gf, wctx, kv_self, Kcur, Vcur, il, n_tokens, kv_head);
             }
 
             // ------
@@ -2510,17 +3507,17 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
             struct ggml_tensor * K =
                 ggml_view_3d(ctx0, kv_self.k,
                         n_state_head, n_kv, n_head,
-                        ggml_element_size(kv_self.k)*n_state,
-                        ggml_element_size(kv_self.k)*n_state_head,
-                        ggml_element_size(kv_self.k)*n_state*n_ctx*il);
+                        ggml_row_size(kv_self.k->type, n_state),
+                        ggml_row_size(kv_self.k->type, n_state_head),
+                        ggml_row_size(kv_self.k->type, n_state)*n_ctx*il);
 
             if (wctx.params.flash_attn) {
                 struct ggml_tensor * V =
                     ggml_view_3d(ctx0, kv_self.v,
                             n_state_head, n_kv, n_head,
-                            ggml_element_size(kv_self.v)*n_state,
-                            ggml_element_size(kv_self.v)*n_state_head,
-                            ggml_element_size(kv_self.v)*n_state*n_ctx*il);
+                            ggml_row_size(kv_self.v->type, n_state),
+                            ggml_row_size(kv_self.v->type, n_state_head),
+                            ggml_row_size(kv_self.v->type, n_state)*n_ctx*il);
 
                 cur = ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask_f16, 1.0f, 0.0f);
 
@@ -2593,16 +3590,16 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                 struct ggml_tensor * Kcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.k,
                             n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx_pad*il);
+                            ggml_row_size(wstate.kv_cross.k->type, n_state),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state)*n_audio_ctx_pad*il);
 
                 struct ggml_tensor * Vcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.v,
                             n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state,
-                            ggml_element_size(wstate.kv_cross.v)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state*n_audio_ctx_pad*il);
+                            ggml_row_size(wstate.kv_cross.v->type, n_state),
+                            ggml_row_size(wstate.kv_cross.v->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.v->type, n_state)*n_audio_ctx_pad*il);
 
                 cur = ggml_flash_attn_ext(ctx0, Q, Kcross, Vcross, nullptr, KQscale, 0.0f);
 
@@ -2611,9 +3608,9 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                 struct ggml_tensor * Kcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.k,
                             n_state_head, n_audio_ctx, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx*il);
+                            ggml_row_size(wstate.kv_cross.k->type, n_state),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state)*n_audio_ctx*il);
 
                 struct ggml_tensor * Vcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.v,
@@ -2714,6 +3711,10 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
     cur = inpL;
 
+    if (part == WHISPER_DECODER_HEAD) {
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, cur, ggml_view_2d(ctx0, wstate.embd_exit, n_state, n_tokens, wstate.embd_exit->nb[1], 0)));
+    }
+
     // norm
     {
         cur = ggml_norm(ctx0, cur, hparams.eps);
@@ -2749,6 +3750,61 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
     return gf;
 }
 
+// [EXPERIMENTAL] early exit
+// difference between the probabilities of the two most likely tokens
+static float whisper_exit_margin(const float * logits, int n_vocab) {
+    float max0 = -INFINITY;
+    float max1 = -INFINITY;
+
+    for (int i = 0; i < n_vocab; ++i) {
+        if (logits[i] > max0) {
+            max1 = max0;
+            max0 = logits[i];
+        } else if (logits[i] > max1) {
+            max1 = logits[i];
+        }
+    }
+
+    double sum = 0.0;
+    for (int i = 0; i < n_vocab; ++i) {
+        sum += expf(logits[i] - max0);
+    }
+
+    return (1.0f - expf(max1 - max0))/sum;
+}
+
+// [EXPERIMENTAL] early exit
+// the hidden state at the exit layer is only allocated once an exit layer is configured
+static bool whisper_exit_init(whisper_state & wstate, const whisper_hparams & hparams) {
+    if (wstate.embd_exit != nullptr) {
+        return true;
+    }
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
+
+    wstate.ctx_exit = ggml_init(params);
+
+    ggml_tensor * embd_exit = ggml_new_tensor_2d(wstate.ctx_exit, GGML_TYPE_F32, hparams.n_text_state, hparams.n_text_ctx);
+
+    wstate.buffer_exit = ggml_backend_alloc_ctx_tensors(wstate.ctx_exit, wstate.backends[0]);
+    if (!wstate.buffer_exit) {
+        WHISPER_LOG_ERROR("%s: failed to allocate memory for the early exit state\n", __func__);
+        ggml_free(wstate.ctx_exit);
+        wstate.ctx_exit = nullptr;
+        return false;
+    }
+
+    wstate.embd_exit = embd_exit;
+
+    WHISPER_LOG_INFO("%s: early exit state size = %7.2f MB\n", __func__, ggml_nbytes(embd_exit) / 1e6);
+
+    return true;
+}
+
 // evaluate the decoder
 //
 // given text prompt + audio features -> computes the logits for the next token
@@ -2777,8 +3833,6 @@ static bool whisper_decode_internal(
 
     auto & logits_out = wstate.logits;
 
-    struct ggml_tensor * logits;
-
     // find KV slot for the batch
     {
         auto & kv_self = wstate.kv_self;
@@ -2798,74 +3852,115 @@ static bool whisper_decode_internal(
     {
         auto & sched = wstate.sched_decode.sched;
 
-        ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstate, batch, save_alignment_heads_QKs, false);
+        // evaluate a part of the decoder graph and extract the resulting logits
+        auto compute = [&](whisper_decoder_part part) {
+            ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstate, batch, save_alignment_heads_QKs, false, part);
 
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
-        }
+            if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+                // should never happen as we pre-allocate the memory
+                return false;
+            }
 
-        // set the inputs
-        {
-            struct ggml_tensor * embd = ggml_graph_get_tensor(gf, "embd");
-            ggml_backend_tensor_set(embd, batch.token, 0, n_tokens*ggml_element_size(embd));
-        }
+            // set the inputs
+            if (struct ggml_tensor * embd = ggml_graph_get_tensor(gf, "embd")) {
+                ggml_backend_tensor_set(embd, batch.token, 0, n_tokens*ggml_element_size(embd));
+            }
 
-        {
-            struct ggml_tensor * position = ggml_graph_get_tensor(gf, "position");
-            for (int i = 0; i < n_tokens; ++i) {
-                const int32_t val = batch.pos[i];
-                ggml_backend_tensor_set(position, &val, i*sizeof(int32_t), sizeof(int32_t));
+            if (struct ggml_tensor * position = ggml_graph_get_tensor(gf, "position")) {
+                for (int i = 0; i < n_tokens; ++i) {
+                    const int32_t val = batch.pos[i];
+                    ggml_backend_tensor_set(position, &val, i*sizeof(int32_t), sizeof(int32_t));
+                }
             }
-        }
 
-        {
-            struct ggml_tensor * KQ_mask = ggml_graph_get_tensor(gf, "KQ_mask");
+            if (struct ggml_tensor * KQ_mask = ggml_graph_get_tensor(gf, "KQ_mask")) {
+                auto & kv_self = wstate.kv_self;
 
-            auto & kv_self = wstate.kv_self;
+                const int32_t n_kv = kv_self.n;
 
-            const int32_t n_kv = kv_self.n;
+                wstate.inp_mask.resize(ggml_nelements(KQ_mask));
 
-            wstate.inp_mask.resize(ggml_nelements(KQ_mask));
+                float * data = wstate.inp_mask.data();
+                memset(data, 0, ggml_nbytes(KQ_mask));
 
-            float * data = wstate.inp_mask.data();
-            memset(data, 0, ggml_nbytes(KQ_mask));
+                for (int h = 0; h < 1; ++h) {
+                    for (int j = 0; j < n_tokens; ++j) {
+                        const whisper_pos    pos    = batch.pos[j];
+                        const whisper_seq_id seq_id = batch.seq_id[j][0];
 
-            for (int h = 0; h < 1; ++h) {
-                for (int j = 0; j < n_tokens; ++j) {
-                    const whisper_pos    pos    = batch.pos[j];
-                    const whisper_seq_id seq_id = batch.seq_id[j][0];
+                        for (int i = 0; i < n_kv; ++i) {
+                            if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
+                                data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
+                            }
+                        }
+                    }
 
-                    for (int i = 0; i < n_kv; ++i) {
-                        if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                            data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
+                    for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
+                        for (int j = 0; j < n_kv; ++j) {
+                            data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
                         }
                     }
                 }
 
-                for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                    for (int j = 0; j < n_kv; ++j) {
-                        data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                    }
+                ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
+            }
+
+            if (!ggml_graph_compute_helper(sched, gf, n_threads, whisper_state_threadpool(wstate, n_threads))) {
+                return false;
+            }
+
+            if (part == WHISPER_DECODER_KV_FILL) {
+                return true;
+            }
+
+            struct ggml_tensor * logits = gf->nodes[gf->n_nodes - 1];
+
+            logits_out.resize(n_tokens*n_vocab);
+            for (int i = 0; i < n_tokens; i++) {
+                if (batch.logits[i] == 0) {
+                    continue;
                 }
+                ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*i), sizeof(float)*n_vocab);
             }
 
-            ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
-        }
+            return true;
+        };
 
-        logits = gf->nodes[gf->n_nodes - 1];
+        // [EXPERIMENTAL] early exit
+        // only used when the logits of all tokens are needed (i.e. not for the prompt)
+        bool use_exit =
+            wstate.exp_n_text_layer_exit > 0 && wstate.exp_n_text_layer_exit < hparams.n_text_layer &&
+            wstate.embd_exit != nullptr && !save_alignment_heads_QKs && !wctx.params.dtw_token_timestamps;
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
-            return false;
+        for (int i = 0; use_exit && i < n_tokens; ++i) {
+            use_exit = batch.logits[i] != 0;
         }
-    }
 
-    logits_out.resize(n_tokens*n_vocab);
-    for (int i = 0; i < n_tokens; i++) {
-        if (batch.logits[i] == 0) {
-            continue;
+        if (!use_exit) {
+            if (!compute(WHISPER_DECODER_FULL)) {
+                return false;
+            }
+        } else {
+            if (!compute(WHISPER_DECODER_HEAD)) {
+                return false;
+            }
+
+            bool confident = true;
+            for (int i = 0; confident && i < n_tokens; ++i) {
+                confident = whisper_exit_margin(logits_out.data() + n_vocab*i, n_vocab) >= wstate.exp_text_exit_thold;
+            }
+
+            if (confident) {
+                if (!compute(WHISPER_DECODER_KV_FILL)) {
+                    return false;
+                }
+                wstate.n_exit += n_tokens;
+            } else {
+                if (!compute(WHISPER_DECODER_TAIL)) {
+                    return false;
+                }
+            }
         }
-        ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*i), sizeof(float)*n_vocab);
     }
 
     if (batch.n_tokens > 1) {
@@ -3234,63 +4329,158 @@ static whisper_mel_calc * whisper_mel_calc_create(ggml_backend_t backend, const
     return new mel_calc_cpu(backend, filters);
 }
 
-// split text into tokens
+// split the text into words
 //
 // ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
 //
-// Regex (Python):
-// r"""'s|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+"""
-//
-// Regex (C++):
+// matches the GPT-2 pattern with ASCII character classes:
 // R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
 //
-static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
+static std::vector<std::string> whisper_split_words(const std::string & text) {
+    enum { CLS_SPACE, CLS_ALPHA, CLS_DIGIT, CLS_OTHER };
+
+    const auto cls = [](char c) {
+        switch (c) {
+            case ' ': case '\t': case '\n': case '\v': case '\f': case '\r':
+                return CLS_SPACE;
+        }
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+            return CLS_ALPHA;
+        }
+        if (c >= '0' && c <= '9') {
+            return CLS_DIGIT;
+        }
+        return CLS_OTHER;
+    };
+
     std::vector<std::string> words;
 
-    // first split the text into words
-    {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+    const size_t n = text.size();
+
+    size_t pos = 0;
+    while (pos < n) {
+        // contractions
+        if (text[pos] == '\'' && pos + 1 < n) {
+            const char c1 = text[pos + 1];
+            const char c2 = pos + 2 < n ? text[pos + 2] : 0;
 
-        std::regex re(pat);
-        std::smatch m;
+            size_t len = 0;
+            if (c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd') {
+                len = 2;
+            } else if ((c1 == 'r' && c2 == 'e') || (c1 == 'v' && c2 == 'e') || (c1 == 'l' && c2 == 'l')) {
+                len = 3;
+            }
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
+            if (len > 0) {
+                words.push_back(text.substr(pos, len));
+                pos += len;
+                continue;
             }
-            str = m.suffix();
         }
-    }
 
-    // find the longest tokens that form the words:
-    std::vector<whisper_vocab::id> tokens;
-    for (const auto & word : words) {
-        if (word.empty()) continue;
+        // a run of letters, digits or other characters with an optional leading space
+        {
+            const size_t start = text[pos] == ' ' ? pos + 1 : pos;
 
-        int i = 0;
-        int n = word.size();
-        while (i < n) {
-            int j = n;
-            bool found = false;
-            while (j > i) {
-                auto sub = word.substr(i, j-i);
-                auto it = vocab.token_to_id.find(sub);
-                if (it != vocab.token_to_id.end()) {
-                    tokens.push_back(it->second);
-                    i = j;
-                    found = true;
-                    break;
+            if (start < n && cls(text[start]) != CLS_SPACE) {
+                const auto c = cls(text[start]);
+
+                size_t end = start + 1;
+                while (end < n && cls(text[end]) == c) {
+                    end++;
                 }
-                --j;
+
+                words.push_back(text.substr(pos, end - pos));
+                pos = end;
+                continue;
             }
-            if (!found) {
-                WHISPER_LOG_ERROR("unknown token\n");
-                ++i;
+        }
+
+        // whitespace - the last space before a word is left for the word
+        {
+            size_t end = pos + 1;
+            while (end < n && cls(text[end]) == CLS_SPACE) {
+                end++;
+            }
+
+            if (end < n && end - pos > 1) {
+                end--;
             }
+
+            words.push_back(text.substr(pos, end - pos));
+            pos = end;
+        }
+    }
+
+    return words;
+}
+
+// byte-level BPE - the merge priority of a pair is the id of the merged token (as in tiktoken)
+static void whisper_bpe_word(const whisper_vocab & vocab, const std::string & word, std::vector<whisper_vocab::id> & tokens) {
+    const auto rank = [&](size_t offset, size_t len) {
+        const auto it = vocab.token_to_id.find(word.substr(offset, len));
+        return it != vocab.token_to_id.end() && it->second < vocab.token_eot ? it->second : -1;
+    };
+
+    {
+        const int id = rank(0, word.size());
+        if (id >= 0) {
+            tokens.push_back(id);
+            return;
+        }
+    }
+
+    // start of each part - merging two parts removes the start of the second one
+    std::vector<size_t> parts(word.size() + 1);
+    for (size_t i = 0; i < parts.size(); ++i) {
+        parts[i] = i;
+    }
+
+    // rank of the merge of part i and part i + 1
+    std::vector<int> ranks(word.size(), -1);
+    for (size_t i = 0; i + 2 < parts.size(); ++i) {
+        ranks[i] = rank(parts[i], parts[i + 2] - parts[i]);
+    }
+
+    while (parts.size() > 2) {
+        size_t best = 0;
+        for (size_t i = 1; i + 2 < parts.size(); ++i) {
+            if (ranks[i] >= 0 && (ranks[best] < 0 || ranks[i] < ranks[best])) {
+                best = i;
+            }
+        }
+
+        if (ranks[best] < 0) {
+            break;
+        }
+
+        parts.erase(parts.begin() + best + 1);
+        ranks.erase(ranks.begin() + best + 1);
+
+        ranks[best] = best + 2 < parts.size() ? rank(parts[best], parts[best + 2] - parts[best]) : -1;
+        if (best > 0) {
+            ranks[best - 1] = rank(parts[best - 1], parts[best + 1] - parts[best - 1]);
         }
     }
 
+    for (size_t i = 0; i + 1 < parts.size(); ++i) {
+        const int id = rank(parts[i], parts[i + 1] - parts[i]);
+        if (id < 0) {
+            WHISPER_LOG_ERROR("unknown token\n");
+            continue;
+        }
+        tokens.push_back(id);
+    }
+}
+
+// split text into tokens
+static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
+    std::vector<whisper_vocab::id> tokens;
+
+    for (const auto & word : whisper_split_words(text)) {
+        whisper_bpe_word(vocab, word, tokens);
+    }
+
     return tokens;
 }
 
@@ -3371,7 +4561,13 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     // in theory, there can be a case where this is not enough, but in practice it should always be enough
     const int factor = 3;
 
-    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
+    // without flash attention the V caches are stored transposed, which is not possible with quantized types
+    const ggml_type type_self_k  = ctx->params.type_kv_self;
+    const ggml_type type_self_v  = ctx->params.flash_attn ? ctx->params.type_kv_self  : ctx->itype;
+    const ggml_type type_cross_k = ctx->params.type_kv_cross;
+    const ggml_type type_cross_v = ctx->params.flash_attn ? ctx->params.type_kv_cross : ctx->itype;
+
+    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], type_self_k, type_self_v,
                 ctx->model.hparams.n_text_state,
                 ctx->model.hparams.n_text_layer,
                 GGML_PAD(ctx->model.hparams.n_text_ctx, 256)*factor)) {
@@ -3382,10 +4578,11 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
 
     {
         const size_t memory_size = ggml_nbytes(state->kv_self.k) + ggml_nbytes(state->kv_self.v);
-        WHISPER_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1e6);
+        WHISPER_LOG_INFO("%s: kv self size  = %7.2f MB (K: %s, V: %s)\n", __func__, memory_size / 1e6,
+                ggml_type_name(state->kv_self.k->type), ggml_type_name(state->kv_self.v->type));
     }
 
-    if (!whisper_kv_cache_init(state->kv_cross, state->backends[0], ctx->itype,
+    if (!whisper_kv_cache_init(state->kv_cross, state->backends[0], type_cross_k, type_cross_v,
                 ctx->model.hparams.n_text_state,
                 ctx->model.hparams.n_text_layer,
                 GGML_PAD(ctx->model.hparams.n_audio_ctx, 256))) {
@@ -3396,10 +4593,11 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
 
     {
         const size_t memory_size = ggml_nbytes(state->kv_cross.k) + ggml_nbytes(state->kv_cross.v);
-        WHISPER_LOG_INFO("%s: kv cross size = %7.2f MB\n", __func__, memory_size / 1e6);
+        WHISPER_LOG_INFO("%s: kv cross size = %7.2f MB (K: %s, V: %s)\n", __func__, memory_size / 1e6,
+                ggml_type_name(state->kv_cross.k->type), ggml_type_name(state->kv_cross.v->type));
     }
 
-    if (!whisper_kv_cache_init(state->kv_pad, state->backends[0], ctx->itype,
+    if (!whisper_kv_cache_init(state->kv_pad, state->backends[0], ctx->itype, ctx->itype,
                 ctx->model.hparams.n_audio_state,
                 1,
                 GGML_PAD(ctx->model.hparams.n_audio_ctx, 256))) {
@@ -3585,6 +4783,10 @@ struct whisper_context_params whisper_context_default_params() {
         /*.use_gpu              =*/ true,
         /*.flash_attn           =*/ false,
         /*.gpu_device           =*/ 0,
+        /*.use_mmap             =*/ true,
+
+        /*.type_kv_self         =*/ GGML_TYPE_F16,
+        /*.type_kv_cross        =*/ GGML_TYPE_F16,
 
         /*.dtw_token_timestamps =*/ false,
         /*.dtw_aheads_preset    =*/ WHISPER_AHEADS_NONE,
@@ -3598,6 +4800,59 @@ struct whisper_context_params whisper_context_default_params() {
     return result;
 }
 
+static struct whisper_context * whisper_init_with_params_no_state_impl(struct whisper_model_loader * loader, struct whisper_context_params params, const char * path_model) {
+    ggml_time_init();
+
+    if (params.flash_attn && params.dtw_token_timestamps) {
+        WHISPER_LOG_WARN("%s: dtw_token_timestamps is not supported with flash_attn - disabling\n", __func__);
+        params.dtw_token_timestamps = false;
+    }
+
+    for (ggml_type * type : { &params.type_kv_self, &params.type_kv_cross }) {
+        switch (*type) {
+            case GGML_TYPE_F32:
+            case GGML_TYPE_F16:
+                break;
+            case GGML_TYPE_Q8_0:
+            case GGML_TYPE_Q4_0:
+                if (!params.flash_attn) {
+                    WHISPER_LOG_WARN("%s: quantized V cache requires flash_attn - only the K cache will be quantized\n", __func__);
+                }
+                break;
+            default:
+                WHISPER_LOG_WARN("%s: unsupported KV cache type %s - using f16\n", __func__, ggml_type_name(*type));
+                *type = GGML_TYPE_F16;
+                break;
+        }
+    }
+
+    WHISPER_LOG_INFO("%s: use gpu    = %d\n", __func__, params.use_gpu);
+    WHISPER_LOG_INFO("%s: flash attn = %d\n", __func__, params.flash_attn);
+    WHISPER_LOG_INFO("%s: gpu_device = %d\n", __func__, params.gpu_device);
+    WHISPER_LOG_INFO("%s: use mmap   = %d\n", __func__, params.use_mmap);
+    WHISPER_LOG_INFO("%s: dtw        = %d\n", __func__, params.dtw_token_timestamps);
+    WHISPER_LOG_INFO("%s: kv self    = %s\n", __func__, ggml_type_name(params.type_kv_self));
+    WHISPER_LOG_INFO("%s: kv cross   = %s\n", __func__, ggml_type_name(params.type_kv_cross));
+
+    whisper_context * ctx = new whisper_context;
+    ctx->params = params;
+
+    if (path_model) {
+        ctx->path_model = path_model;
+    }
+
+    if (!whisper_model_load(loader, *ctx)) {
+        loader->close(loader->context);
+        WHISPER_LOG_ERROR("%s: failed to load model\n", __func__);
+        delete ctx;
+        return nullptr;
+    }
+
+    loader->close(loader->context);
+
+    return ctx;
+}
+
 struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
     WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
 #ifdef _MSC_VER
@@ -3620,7 +4875,7 @@ struct whisper_context * whisper_init_from_file_with_params_no_state(const char
     loader.read = [](void * ctx, void * output, size_t read_size) {
         std::ifstream * fin = (std::ifstream*)ctx;
         fin->read((char *)output, read_size);
-        return read_size;
+        return (size_t) fin->gcount();
     };
 
     loader.eof = [](void * ctx) {
@@ -3633,13 +4888,7 @@ struct whisper_context * whisper_init_from_file_with_params_no_state(const char
         fin->close();
     };
 
-    auto ctx = whisper_init_with_params_no_state(&loader, params);
-
-    if (ctx) {
-        ctx->path_model = path_model;
-    }
-
-    return ctx;
+    return whisper_init_with_params_no_state_impl(&loader, params, path_model);
 }
 
 struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * buffer, size_t buffer_size, struct whisper_context_params params) {
@@ -3680,31 +4929,7 @@ struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * bu
 }
 
 struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
-    ggml_time_init();
-
-    if (params.flash_attn && params.dtw_token_timestamps) {
-        WHISPER_LOG_WARN("%s: dtw_token_timestamps is not supported with flash_attn - disabling\n", __func__);
-        params.dtw_token_timestamps = false;
-    }
-
-    WHISPER_LOG_INFO("%s: use gpu    = %d\n", __func__, params.use_gpu);
-    WHISPER_LOG_INFO("%s: flash attn = %d\n", __func__, params.flash_attn);
-    WHISPER_LOG_INFO("%s: gpu_device = %d\n", __func__, params.gpu_device);
-    WHISPER_LOG_INFO("%s: dtw        = %d\n", __func__, params.dtw_token_timestamps);
-
-    whisper_context * ctx = new whisper_context;
-    ctx->params = params;
-
-    if (!whisper_model_load(loader, *ctx)) {
-        loader->close(loader->context);
-        WHISPER_LOG_ERROR("%s: failed to load model\n", __func__);
-        delete ctx;
-        return nullptr;
-    }
-
-    loader->close(loader->context);
-
-    return ctx;
+    return whisper_init_with_params_no_state_impl(loader, params, nullptr);
 }
 
 struct whisper_context * whisper_init_from_file_with_params(const char * path_model, struct whisper_context_params params) {
@@ -3778,10 +5003,16 @@ struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loa
 
 void whisper_free_state(struct whisper_state * state) {
     if (state) {
+        ggml_threadpool_free(state->threadpool);
+        state->threadpool = nullptr;
+
         whisper_kv_cache_free(state->kv_self);
         whisper_kv_cache_free(state->kv_cross);
         whisper_kv_cache_free(state->kv_pad);
 
+        ggml_free(state->ctx_exit);
+        ggml_backend_buffer_free(state->buffer_exit);
+
         whisper_mel_free(state->mel);
 
         delete state->mel_calc;
@@ -3821,28 +5052,521 @@ void whisper_free_state(struct whisper_state * state) {
     }
 }
 
-void whisper_free(struct whisper_context * ctx) {
-    if (ctx) {
-        ggml_free(ctx->model.ctx);
+void whisper_free(struct whisper_context * ctx) {
+    if (ctx) {
+        ggml_free(ctx->model.ctx);
+
+        ggml_backend_buffer_free(ctx->model.buffer);
+        ggml_backend_buffer_free(ctx->model.buffer_mmap);
+
+        whisper_free_state(ctx->state);
+
+        delete ctx;
+    }
+}
+
+void whisper_free_context_params(struct whisper_context_params * params) {
+    if (params) {
+        delete params;
+    }
+}
+
+void whisper_free_params(struct whisper_full_params * params) {
+    if (params) {
+        delete params;
+    }
+}
+
+//
+// state snapshots
+//
+
+#define WHISPER_STATE_MAGIC   0x77737374u // 'wsst'
+#define WHISPER_STATE_VERSION 2
+
+// writes the snapshot into dst or, with dst == nullptr, only counts the bytes
+struct whisper_state_writer {
+    uint8_t * dst;
+    size_t    size;
+
+    size_t n  = 0;
+    bool   ok = true;
+
+    void write(const void * src, size_t len) {
+        if (dst) {
+            if (n + len > size) {
+                ok = false;
+            } else {
+                memcpy(dst + n, src, len);
+            }
+        }
+        n += len;
+    }
+
+    void write_tensor(const ggml_tensor * t, size_t offset, size_t len) {
+        if (dst) {
+            if (n + len > size) {
+                ok = false;
+            } else {
+                ggml_backend_tensor_get(t, dst + n, offset, len);
+            }
+        }
+        n += len;
+    }
+
+    template<typename T>
+    void write_val(const T & val) {
+        write(&val, sizeof(val));
+    }
+};
+
+struct whisper_state_reader {
+    const uint8_t * src;
+    size_t          size;
+
+    size_t n  = 0;
+    bool   ok = true;
+
+    void read(void * dst, size_t len) {
+        if (!ok || n + len > size) {
+            ok = false;
+            return;
+        }
+        memcpy(dst, src + n, len);
+        n += len;
+    }
+
+    void read_tensor(ggml_tensor * t, size_t offset, size_t len) {
+        if (!ok || n + len > size || offset + len > ggml_nbytes(t)) {
+            ok = false;
+            return;
+        }
+        ggml_backend_tensor_set(t, src + n, offset, len);
+        n += len;
+    }
+
+    void skip(size_t len) {
+        if (!ok || n + len > size) {
+            ok = false;
+            return;
+        }
+        n += len;
+    }
+
+    template<typename T>
+    T read_val() {
+        T val = {};
+        read(&val, sizeof(val));
+        return val;
+    }
+
+    // number of elements that follow - bounded by the remaining data
+    size_t read_count(size_t elem_size) {
+        const size_t count = read_val<uint32_t>();
+        if (!ok || count > (size - n)/elem_size) {
+            ok = false;
+            return 0;
+        }
+        return count;
+    }
+};
+
+// the first n_cells cells of each layer - without flash attention, V is stored transposed
+static size_t whisper_state_kv_size(const whisper_kv_cache & cache, int n_text_state, int n_text_layer, bool v_trans, uint32_t n_cells) {
+    const size_t k_row = ggml_row_size(cache.k->type, n_text_state);
+    const size_t v_row = v_trans ? n_text_state*ggml_type_size(cache.v->type) : ggml_row_size(cache.v->type, n_text_state);
+
+    return (size_t) n_text_layer*n_cells*(k_row + v_row);
+}
+
+static void whisper_state_write_kv(whisper_state_writer & w, const whisper_kv_cache & cache, int n_text_state, int n_text_layer, bool v_trans, uint32_t n_cells) {
+    const size_t k_row = ggml_row_size(cache.k->type, n_text_state);
+    const size_t v_row = ggml_row_size(cache.v->type, n_text_state);
+    const size_t v_el  = ggml_type_size(cache.v->type);
+
+    for (int il = 0; il < n_text_layer; ++il) {
+        w.write_tensor(cache.k, il*cache.size*k_row, n_cells*k_row);
+    }
+
+    for (int il = 0; il < n_text_layer; ++il) {
+        if (v_trans) {
+            for (int i = 0; i < n_text_state; ++i) {
+                w.write_tensor(cache.v, (il*n_text_state + i)*cache.size*v_el, n_cells*v_el);
+            }
+        } else {
+            w.write_tensor(cache.v, il*cache.size*v_row, n_cells*v_row);
+        }
+    }
+}
+
+static void whisper_state_read_kv(whisper_state_reader & r, whisper_kv_cache & cache, int n_text_state, int n_text_layer, bool v_trans, uint32_t n_cells) {
+    const size_t k_row = ggml_row_size(cache.k->type, n_text_state);
+    const size_t v_row = ggml_row_size(cache.v->type, n_text_state);
+    const size_t v_el  = ggml_type_size(cache.v->type);
+
+    for (int il = 0; il < n_text_layer; ++il) {
+        r.read_tensor(cache.k, il*cache.size*k_row, n_cells*k_row);
+    }
+
+    for (int il = 0; il < n_text_layer; ++il) {
+        if (v_trans) {
+            for (int i = 0; i < n_text_state; ++i) {
+                r.read_tensor(cache.v, (il*n_text_state + i)*cache.size*v_el, n_cells*v_el);
+            }
+        } else {
+            r.read_tensor(cache.v, il*cache.size*v_row, n_cells*v_row);
+        }
+    }
+}
+
+static void whisper_state_write(struct whisper_context * ctx, struct whisper_state * state, whisper_state_writer & w, bool with_kv) {
+    const auto & hparams = ctx->model.hparams;
+
+    w.write_val<uint32_t>(WHISPER_STATE_MAGIC);
+    w.write_val<uint32_t>(WHISPER_STATE_VERSION);
+
+    // identifies the model the snapshot belongs to
+    w.write_val<int32_t>(hparams.n_vocab);
+    w.write_val<int32_t>(hparams.n_text_state);
+    w.write_val<int32_t>(hparams.n_text_layer);
+
+    w.write_val<int32_t>(state->lang_id);
+
+    w.write_val<uint32_t>(state->prompt_past.size());
+    w.write(state->prompt_past.data(), state->prompt_past.size()*sizeof(whisper_token));
+
+    w.write_val<int64_t>(state->t_beg);
+    w.write_val<int64_t>(state->t_last);
+    w.write_val<whisper_token>(state->tid_last);
+
+    w.write_val<uint32_t>(state->result_all.size());
+    for (const auto & segment : state->result_all) {
+        w.write_val<int64_t>(segment.t0);
+        w.write_val<int64_t>(segment.t1);
+
+        w.write_val<uint32_t>(segment.text.size());
+        w.write(segment.text.data(), segment.text.size());
+
+        w.write_val<uint32_t>(segment.tokens.size());
+        for (const auto & token : segment.tokens) {
+            w.write_val<whisper_token>(token.id);
+            w.write_val<whisper_token>(token.tid);
+            w.write_val<float>(token.p);
+            w.write_val<float>(token.plog);
+            w.write_val<float>(token.pt);
+            w.write_val<float>(token.ptsum);
+            w.write_val<int64_t>(token.t0);
+            w.write_val<int64_t>(token.t1);
+            w.write_val<int64_t>(token.t_dtw);
+            w.write_val<float>(token.vlen);
+        }
+
+        w.write_val<uint8_t>(segment.speaker_turn_next);
+    }
+
+    w.write_val<uint8_t>(with_kv);
+
+    if (!with_kv) {
+        return;
+    }
+
+    w.write_val<uint8_t>(ctx->params.flash_attn);
+
+    // self-attention: the cells up to the last used one
+    {
+        const auto & cache = state->kv_self;
+
+        const uint32_t n_cells = whisper_kv_cache_cell_max(cache);
+
+        w.write_val<int32_t>(cache.k->type);
+        w.write_val<int32_t>(cache.v->type);
+        w.write_val<uint32_t>(cache.size);
+        w.write_val<uint32_t>(cache.head);
+        w.write_val<uint32_t>(n_cells);
+
+        for (uint32_t i = 0; i < n_cells; ++i) {
+            const auto & cell = cache.cells[i];
+
+            w.write_val<whisper_pos>(cell.pos);
+            w.write_val<uint32_t>(cell.seq_id.size());
+            for (const auto & id : cell.seq_id) {
+                w.write_val<whisper_seq_id>(id);
+            }
+        }
+
+        whisper_state_write_kv(w, cache, hparams.n_text_state, hparams.n_text_layer, !ctx->params.flash_attn, n_cells);
+
+        // the prompt kept in the cache and the logits of its last token
+        w.write_val<uint32_t>(state->prompt_cached.size());
+        w.write(state->prompt_cached.data(), state->prompt_cached.size()*sizeof(whisper_token));
+
+        if (!state->prompt_cached.empty()) {
+            w.write(state->prompt_logits.data(), hparams.n_vocab*sizeof(float));
+        }
+    }
+
+    // cross-attention: the whole cache and the key of the mel window it was computed from
+    {
+        const auto & cache = state->kv_cross;
+
+        w.write_val<int32_t>(cache.k->type);
+        w.write_val<int32_t>(cache.v->type);
+        w.write_val<uint32_t>(cache.size);
+
+        w.write_val<uint8_t>(state->enc_cache_valid);
+        w.write_val<uint64_t>(state->enc_cache_hash);
+        w.write_val<int32_t>(state->enc_cache_n_ctx);
+        w.write_val<int32_t>(state->enc_cache_n_len);
+
+        w.write_tensor(cache.k, 0, ggml_nbytes(cache.k));
+        w.write_tensor(cache.v, 0, ggml_nbytes(cache.v));
+    }
+}
+
+size_t whisper_state_get_size_from_state(struct whisper_context * ctx, struct whisper_state * state, bool with_kv) {
+    whisper_state_writer w = { nullptr, 0 };
+    whisper_state_write(ctx, state, w, with_kv);
+
+    return w.n;
+}
+
+size_t whisper_state_get_size(struct whisper_context * ctx, bool with_kv) {
+    return whisper_state_get_size_from_state(ctx, ctx->state, with_kv);
+}
+
+size_t whisper_state_get_data_from_state(struct whisper_context * ctx, struct whisper_state * state, uint8_t * dst, size_t size, bool with_kv) {
+    whisper_state_writer w = { dst, size };
+    whisper_state_write(ctx, state, w, with_kv);
+
+    if (!w.ok) {
+        WHISPER_LOG_ERROR("%s: buffer too small - %zu bytes needed, got %zu\n", __func__, w.n, size);
+        return 0;
+    }
+
+    return w.n;
+}
+
+size_t whisper_state_get_data(struct whisper_context * ctx, uint8_t * dst, size_t size, bool with_kv) {
+    return whisper_state_get_data_from_state(ctx, ctx->state, dst, size, with_kv);
+}
+
+size_t whisper_state_set_data_with_state(struct whisper_context * ctx, struct whisper_state * state, const uint8_t * src, size_t size) {
+    const auto & hparams = ctx->model.hparams;
+
+    whisper_state_reader r = { src, size };
+
+    if (r.read_val<uint32_t>() != WHISPER_STATE_MAGIC || r.read_val<uint32_t>() != WHISPER_STATE_VERSION) {
+        WHISPER_LOG_ERROR("%s: invalid state data (bad magic or version)\n", __func__);
+        return 0;
+    }
+
+    const int32_t n_vocab      = r.read_val<int32_t>();
+    const int32_t n_text_state = r.read_val<int32_t>();
+    const int32_t n_text_layer = r.read_val<int32_t>();
+
+    if (n_vocab != hparams.n_vocab || n_text_state != hparams.n_text_state || n_text_layer != hparams.n_text_layer) {
+        WHISPER_LOG_ERROR("%s: state data belongs to a different model\n", __func__);
+        return 0;
+    }
+
+    const auto token_valid = [n_vocab](whisper_token id) {
+        return id >= 0 && id < n_vocab;
+    };
+
+    // everything is read and validated before the state is modified
+
+    const int32_t lang_id = r.read_val<int32_t>();
+
+    std::vector<whisper_token> prompt_past(r.read_count(sizeof(whisper_token)));
+    r.read(prompt_past.data(), prompt_past.size()*sizeof(whisper_token));
+
+    const int64_t       t_beg    = r.read_val<int64_t>();
+    const int64_t       t_last   = r.read_val<int64_t>();
+    const whisper_token tid_last = r.read_val<whisper_token>();
+
+    bool valid = lang_id >= 0 && lang_id <= whisper_lang_max_id() && token_valid(tid_last) &&
+        std::all_of(prompt_past.begin(), prompt_past.end(), token_valid);
+
+    // t0, t1, text size, tokens size and speaker_turn_next
+    std::vector<whisper_segment> result_all(r.read_count(2*sizeof(int64_t) + 2*sizeof(uint32_t) + sizeof(uint8_t)));
+    for (auto & segment : result_all) {
+        segment.t0 = r.read_val<int64_t>();
+        segment.t1 = r.read_val<int64_t>();
+
+        segment.text.resize(r.read_count(sizeof(char)));
+        r.read(&segment.text[0], segment.text.size());
+
+        segment.tokens.resize(r.read_count(2*sizeof(whisper_token) + 5*sizeof(float) + 3*sizeof(int64_t)));
+        for (auto & token : segment.tokens) {
+            token.id    = r.read_val<whisper_token>();
+            token.tid   = r.read_val<whisper_token>();
+            token.p     = r.read_val<float>();
+            token.plog  = r.read_val<float>();
+            token.pt    = r.read_val<float>();
+            token.ptsum = r.read_val<float>();
+            token.t0    = r.read_val<int64_t>();
+            token.t1    = r.read_val<int64_t>();
+            token.t_dtw = r.read_val<int64_t>();
+            token.vlen  = r.read_val<float>();
+
+            valid = valid && token_valid(token.id) && (token.tid == -1 || token_valid(token.tid));
+        }
+
+        segment.speaker_turn_next = r.read_val<uint8_t>();
+
+        if (!r.ok || !valid) {
+            break;
+        }
+    }
+
+    const bool with_kv = r.read_val<uint8_t>();
+
+    if (!r.ok) {
+        WHISPER_LOG_ERROR("%s: invalid state data (truncated)\n", __func__);
+        return 0;
+    }
+
+    if (!valid) {
+        WHISPER_LOG_ERROR("%s: invalid state data (language or token id out of range)\n", __func__);
+        return 0;
+    }
+
+    auto & kv_self  = state->kv_self;
+    auto & kv_cross = state->kv_cross;
+
+    const bool v_trans = !ctx->params.flash_attn;
+
+    std::vector<whisper_kv_cell> cells;
+    uint32_t self_head   = 0;
+    size_t   self_offset = 0;
+
+    std::vector<whisper_token> prompt_cached;
+    std::vector<float>         prompt_logits;
+
+    bool     enc_cache_valid = false;
+    uint64_t enc_cache_hash  = 0;
+    int32_t  enc_cache_n_ctx = 0;
+    int32_t  enc_cache_n_len = 0;
+    size_t   cross_offset    = 0;
+
+    if (with_kv) {
+        const bool flash_attn = r.read_val<uint8_t>();
+
+        const ggml_type self_k    = (ggml_type) r.read_val<int32_t>();
+        const ggml_type self_v    = (ggml_type) r.read_val<int32_t>();
+        const uint32_t  self_size = r.read_val<uint32_t>();
+        self_head                 = r.read_val<uint32_t>();
+        const uint32_t  n_cells   = r.read_val<uint32_t>();
+
+        if (!r.ok || flash_attn != ctx->params.flash_attn || self_k != kv_self.k->type || self_v != kv_self.v->type ||
+            self_size != kv_self.size || n_cells > kv_self.size || self_head > kv_self.size) {
+            WHISPER_LOG_ERROR("%s: the KV caches in the state data do not match the context\n", __func__);
+            return 0;
+        }
+
+        cells.resize(n_cells);
+        for (auto & cell : cells) {
+            cell.pos = r.read_val<whisper_pos>();
+
+            const size_t n_seq = r.read_count(sizeof(whisper_seq_id));
+            for (size_t i = 0; i < n_seq; ++i) {
+                const whisper_seq_id id = r.read_val<whisper_seq_id>();
+
+                valid = valid && id >= 0 && id <= WHISPER_SEQ_ID_PROMPT;
+
+                cell.seq_id.insert(id);
+            }
+
+            valid = valid && cell.pos >= -1 && cell.pos < (whisper_pos) kv_self.size;
+
+            if (!r.ok) {
+                break;
+            }
+        }
+
+        self_offset = r.n;
+        r.skip(whisper_state_kv_size(kv_self, hparams.n_text_state, hparams.n_text_layer, v_trans, n_cells));
+
+        prompt_cached.resize(r.read_count(sizeof(whisper_token)));
+        r.read(prompt_cached.data(), prompt_cached.size()*sizeof(whisper_token));
+
+        if (!prompt_cached.empty()) {
+            prompt_logits.resize(n_vocab);
+            r.read(prompt_logits.data(), prompt_logits.size()*sizeof(float));
+        }
+
+        valid = valid && std::all_of(prompt_cached.begin(), prompt_cached.end(), token_valid);
+
+        const ggml_type cross_k    = (ggml_type) r.read_val<int32_t>();
+        const ggml_type cross_v    = (ggml_type) r.read_val<int32_t>();
+        const uint32_t  cross_size = r.read_val<uint32_t>();
+
+        if (r.ok && (cross_k != kv_cross.k->type || cross_v != kv_cross.v->type || cross_size != kv_cross.size)) {
+            WHISPER_LOG_ERROR("%s: the KV caches in the state data do not match the context\n", __func__);
+            return 0;
+        }
+
+        enc_cache_valid = r.read_val<uint8_t>();
+        enc_cache_hash  = r.read_val<uint64_t>();
+        enc_cache_n_ctx = r.read_val<int32_t>();
+        enc_cache_n_len = r.read_val<int32_t>();
+
+        cross_offset = r.n;
+        r.skip(ggml_nbytes(kv_cross.k) + ggml_nbytes(kv_cross.v));
+
+        if (!r.ok) {
+            WHISPER_LOG_ERROR("%s: invalid state data (truncated)\n", __func__);
+            return 0;
+        }
+
+        if (!valid) {
+            WHISPER_LOG_ERROR("%s: invalid state data (KV cell or token id out of range)\n", __func__);
+            return 0;
+        }
+    }
+
+    // the data is valid - restore the state
+    if (with_kv) {
+        whisper_kv_cache_clear(kv_self);
+
+        whisper_state_reader r_self = { src, size };
+        r_self.n = self_offset;
+        whisper_state_read_kv(r_self, kv_self, hparams.n_text_state, hparams.n_text_layer, v_trans, cells.size());
 
-        ggml_backend_buffer_free(ctx->model.buffer);
+        for (size_t i = 0; i < cells.size(); ++i) {
+            kv_self.cells[i] = std::move(cells[i]);
+        }
+        kv_self.head = self_head;
 
-        whisper_free_state(ctx->state);
+        whisper_state_reader r_cross = { src, size };
+        r_cross.n = cross_offset;
+        r_cross.read_tensor(kv_cross.k, 0, ggml_nbytes(kv_cross.k));
+        r_cross.read_tensor(kv_cross.v, 0, ggml_nbytes(kv_cross.v));
 
-        delete ctx;
-    }
-}
+        GGML_ASSERT(r_self.ok && r_cross.ok);
 
-void whisper_free_context_params(struct whisper_context_params * params) {
-    if (params) {
-        delete params;
+        // the encoder is skipped when the same mel window is evaluated again, and with it the decoding of the prompt
+        state->enc_cache_valid = enc_cache_valid;
+        state->enc_cache_hash  = enc_cache_hash;
+        state->enc_cache_n_ctx = enc_cache_n_ctx;
+        state->enc_cache_n_len = enc_cache_n_len;
+
+        state->prompt_cached = std::move(prompt_cached);
+        state->prompt_logits = std::move(prompt_logits);
     }
+
+    state->lang_id     = lang_id;
+    state->prompt_past = std::move(prompt_past);
+    state->t_beg       = t_beg;
+    state->t_last      = t_last;
+    state->tid_last    = tid_last;
+    state->result_all  = std::move(result_all);
+
+    return r.n;
 }
 
-void whisper_free_params(struct whisper_full_params * params) {
-    if (params) {
-        delete params;
-    }
+size_t whisper_state_set_data(struct whisper_context * ctx, const uint8_t * src, size_t size) {
+    return whisper_state_set_data_with_state(ctx, ctx->state, src, size);
 }
 
 int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
@@ -4253,6 +5977,9 @@ void whisper_print_timings(struct whisper_context * ctx) {
         const int32_t n_prompt = std::max(1, ctx->state->n_prompt);
 
         WHISPER_LOG_INFO("%s:     fallbacks = %3d p / %3d h\n", __func__, ctx->state->n_fail_p, ctx->state->n_fail_h);
+        if (ctx->state->n_exit > 0) {
+            WHISPER_LOG_INFO("%s:   early exits = %5d tokens\n", __func__, ctx->state->n_exit);
+        }
         WHISPER_LOG_INFO("%s:      mel time = %8.2f ms\n", __func__, ctx->state->t_mel_us / 1000.0f);
         WHISPER_LOG_INFO("%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_sample_us, n_sample, 1e-3f * ctx->state->t_sample_us / n_sample);
         WHISPER_LOG_INFO("%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_encode_us, n_encode, 1e-3f * ctx->state->t_encode_us / n_encode);
@@ -4277,6 +6004,7 @@ void whisper_reset_timings(struct whisper_context * ctx) {
         ctx->state->n_decode = 0;
         ctx->state->n_batchd = 0;
         ctx->state->n_prompt = 0;
+        ctx->state->n_exit   = 0;
     }
 }
 
@@ -4644,7 +6372,7 @@ static struct whisper_grammar whisper_grammar_init(
 
     // loop over alternates of start rule to build initial stacks
     std::vector<std::vector<const whisper_grammar_element *>> stacks;
-    pos = rules[i_start_rule];
+    pos = vec_rules[i_start_rule].data();
     do {
         std::vector<const whisper_grammar_element *> stack;
         if (!whisper_grammar_is_end_of_sequence(pos)) {
@@ -4664,11 +6392,135 @@ static struct whisper_grammar whisper_grammar_init(
         }
     } while (true);
 
-    return { std::move(vec_rules), std::move(stacks), {} };
+    return whisper_grammar(std::move(vec_rules), std::move(stacks));
+}
+
+static void whisper_token_trie_build(
+               whisper_token_trie & trie,
+             const whisper_vocab & vocab,
+                    whisper_token   n_text) {
+    trie.nodes.clear();
+    trie.nodes.emplace_back();
+    trie.ids.clear();
+
+    // (parent, code point) -> child
+    std::map<std::pair<int32_t, uint32_t>, int32_t> edges;
+
+    for (whisper_token id = 0; id < n_text; ++id) {
+        const std::string & text = vocab.id_to_token.at(id);
+        if (text.empty()) {
+            continue;
+        }
+
+        trie.ids.push_back(id);
+
+        const auto decoded = decode_utf8(text.c_str(), { 0, 0 });
+
+        int32_t cur = 0;
+        for (auto it = decoded.first.begin(), end = decoded.first.end() - 1; it != end; ++it) {
+            auto res = edges.emplace(std::make_pair(cur, *it), (int32_t) trie.nodes.size());
+            if (res.second) {
+                trie.nodes.emplace_back();
+            }
+            cur = res.first->second;
+        }
+
+        if (decoded.second.n_remain == 0) {
+            trie.nodes[cur].ends.push_back(id);
+        } else {
+            trie.nodes[cur].ends_partial.emplace_back(id, decoded.second);
+        }
+    }
+
+    // the map is ordered by code point within each parent
+    for (const auto & edge : edges) {
+        trie.nodes[edge.first.first].children.emplace_back(edge.first.second, edge.second);
+    }
+}
+
+// collects the tokens in the subtree of node i_node that can be accepted from at least one of the stacks
+// a subtree is skipped as soon as its prefix is rejected by all stacks
+static void whisper_grammar_accept_trie(
+        const std::vector<std::vector<whisper_grammar_element>>         & rules,
+        const whisper_token_trie                                        & trie,
+                                                      int32_t           i_node,
+        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
+        std::vector<whisper_token>                                      & accepted) {
+    const auto & node = trie.nodes[i_node];
+
+    // any stack accepts the tokens that end here with complete code points - an empty stack
+    // means the grammar is complete, which is fine as long as nothing else follows
+    accepted.insert(accepted.end(), node.ends.begin(), node.ends.end());
+
+    for (const auto & tok : node.ends_partial) {
+        for (const auto & stack : stacks) {
+            if (!stack.empty() && whisper_grammar_match_partial_char(stack.back(), tok.second)) {
+                accepted.push_back(tok.first);
+                break;
+            }
+        }
+    }
+
+    for (const auto & child : node.children) {
+        const auto next_stacks = whisper_grammar_accept(rules, stacks, child.first);
+        if (!next_stacks.empty()) {
+            whisper_grammar_accept_trie(rules, trie, child.second, next_stacks, accepted);
+        }
+    }
+}
+
+// the stacks point into the rules of a specific decoder, so they are keyed by their (rule, offset) position
+// returns an empty key if a stack element is not part of the rules
+static std::vector<int32_t> whisper_grammar_stacks_key(
+        const std::vector<std::vector<whisper_grammar_element>>         & rules,
+        const std::vector<std::vector<const whisper_grammar_element *>> & stacks) {
+    std::vector<int32_t> key;
+
+    for (const auto & stack : stacks) {
+        key.push_back(-1 - (int32_t) stack.size());
+        for (const auto * pos : stack) {
+            bool found = false;
+            for (size_t i = 0; i < rules.size(); ++i) {
+                if (pos >= rules[i].data() && pos < rules[i].data() + rules[i].size()) {
+                    key.push_back(i);
+                    key.push_back(pos - rules[i].data());
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                return {};
+            }
+        }
+    }
+
+    return key;
+}
+
+static bool whisper_grammar_rules_equal(
+        const std::vector<std::vector<whisper_grammar_element>> & a,
+        const std::vector<std::vector<whisper_grammar_element>> & b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (a[i].size() != b[i].size()) {
+            return false;
+        }
+        for (size_t j = 0; j < a[i].size(); ++j) {
+            if (a[i][j].type != b[i][j].type || a[i][j].value != b[i][j].value) {
+                return false;
+            }
+        }
+    }
+
+    return true;
 }
 
 static void whisper_suppress_invalid_grammar(
              whisper_context  & ctx,
+               whisper_state  & state,
     const whisper_full_params & params,
            std::vector<float> & logits,
     const     whisper_grammar & grammar) {
@@ -4687,21 +6539,84 @@ static void whisper_suppress_invalid_grammar(
 
     const whisper_token eot = whisper_token_eot(&ctx);
 
-    std::vector<std::pair<std::vector<uint32_t>, whisper_partial_utf8>> candidates_decoded;
-    std::vector<whisper_grammar_candidate>                              candidates_grammar;
+    if (grammar.partial_utf8.n_remain != 0) {
+        // the decoding of the tokens depends on the incomplete UTF-8 sequence of the accepted tokens - check them one by one
+        std::vector<std::pair<std::vector<uint32_t>, whisper_partial_utf8>> candidates_decoded;
+        std::vector<whisper_grammar_candidate>                              candidates_grammar;
+
+        candidates_decoded.reserve(eot);
+
+        for (whisper_token id = 0; id < eot; ++id) {
+            const std::string & text = ctx.vocab.id_to_token[id];
+            if (!text.empty()) {
+                candidates_decoded.push_back(decode_utf8(text.c_str(), grammar.partial_utf8));
+                candidates_grammar.push_back({ id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
+            }
+        }
+
+        const auto rejects = whisper_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
+
+        for (const auto & reject : rejects) {
+            logits[reject.id] -= params.grammar_penalty;
+        }
+
+        return;
+    }
+
+    auto & cache = state.grammar_cache;
+
+    const auto key = whisper_grammar_stacks_key(grammar.rules, grammar.stacks);
+
+    std::vector<whisper_token> accepted;
+    bool found = false;
+
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        if (cache.trie.nodes.empty()) {
+            whisper_token_trie_build(cache.trie, ctx.vocab, eot);
+        }
+
+        if (!whisper_grammar_rules_equal(cache.rules, grammar.rules)) {
+            cache.rules = grammar.rules;
+            cache.accepted.clear();
+        }
 
-    for (whisper_token id = 0; id < eot; ++id) {
-        const std::string & text = ctx.vocab.id_to_token[id];
-        if (!text.empty()) {
-            candidates_decoded.push_back(decode_utf8(text.c_str(), grammar.partial_utf8));
-            candidates_grammar.push_back({ id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
+        const auto it = key.empty() ? cache.accepted.end() : cache.accepted.find(key);
+        if (it != cache.accepted.end()) {
+            accepted = it->second;
+            found = true;
         }
     }
 
-    const auto rejects = whisper_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
+    if (!found) {
+        // the trie is never modified after it has been built
+        whisper_grammar_accept_trie(grammar.rules, cache.trie, 0, grammar.stacks, accepted);
+
+        std::sort(accepted.begin(), accepted.end());
+        accepted.erase(std::unique(accepted.begin(), accepted.end()), accepted.end());
+
+        if (!key.empty()) {
+            std::lock_guard<std::mutex> lock(cache.mutex);
+
+            // the number of grammar states is unbounded for recursive grammars
+            if (cache.accepted.size() >= 1024) {
+                cache.accepted.clear();
+            }
+            cache.accepted.emplace(key, accepted);
+        }
+    }
 
-    for (const auto & reject : rejects) {
-        logits[reject.id] -= params.grammar_penalty;
+    // reject all tokens that are not accepted
+    {
+        auto it = accepted.begin();
+        for (const whisper_token id : cache.trie.ids) {
+            if (it != accepted.end() && *it == id) {
+                ++it;
+            } else {
+                logits[id] -= params.grammar_penalty;
+            }
+        }
     }
 
     // when the grammar allows a continuation, we penalize the end-of-text token
@@ -4784,9 +6699,20 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 
         /*.debug_mode        =*/ false,
         /*.audio_ctx         =*/ 0,
+        /*.encoder_cache     =*/ false,
+        /*.n_text_layer_exit =*/ 0,
+        /*.text_exit_thold   =*/ 0.9f,
 
         /*.tdrz_enable       =*/ false,
 
+        /*.vad                =*/ false,
+        /*.vad_thold          =*/ 0.1f,
+        /*.vad_min_silence_ms =*/ 1000,
+        /*.vad_speech_pad_ms  =*/ 200,
+
+        /*.draft_ctx         =*/ nullptr,
+        /*.n_draft           =*/ 4,
+
         /* suppress_regex    =*/ nullptr,
 
         /*.initial_prompt    =*/ nullptr,
@@ -4796,6 +6722,9 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
         /*.language          =*/ "en",
         /*.detect_language   =*/ false,
 
+        /*.lang_detect_ms    =*/ 0,
+        /*.lang_detect_cache =*/ false,
+
         /*.suppress_blank    =*/ true,
         /*.suppress_non_speech_tokens =*/ false,
 
@@ -4947,16 +6876,158 @@ static const std::vector<std::string> non_speech_tokens = {
     "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
 };
 
+// resolve the tokens that are always suppressed for the given parameters
+// matching the regular expression and looking up the non-speech tokens is too slow to be done for every sampled token
+static void whisper_suppress_init(
+              struct whisper_context & ctx,
+               struct whisper_state  & state,
+    const struct whisper_full_params & params) {
+    const auto & vocab = ctx.vocab;
+
+    auto & pre  = state.suppress.pre;
+    auto & post = state.suppress.post;
+
+    pre.clear();
+    post.clear();
+
+    // suppress <|notimestamps|> token
+    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
+    pre.push_back(vocab.token_not);
+
+    // suppress sot and nosp tokens
+    pre.push_back(vocab.token_sot);
+    pre.push_back(vocab.token_nosp); // TODO: ignore this token for now
+
+    // [TDRZ] when tinydiarize is disabled, suppress solm token
+    if (params.tdrz_enable == false) {
+        pre.push_back(vocab.token_solm);
+    }
+
+    // suppress task tokens
+    pre.push_back(vocab.token_translate);
+    pre.push_back(vocab.token_transcribe);
+    pre.push_back(vocab.token_prev);
+
+    // suppress lang tokens
+    for (size_t i = 0; i < g_lang.size(); ++i) {
+        pre.push_back(whisper_token_lang(&ctx, i));
+    }
+
+    // suppress any tokens matching a regular expression
+    // ref: https://github.com/openai/whisper/discussions/1041
+    if (params.suppress_regex != nullptr) {
+        std::regex re(params.suppress_regex);
+        for (const auto & token_id : vocab.token_to_id) {
+            if (std::regex_match(token_id.first, re)) {
+                post.push_back(token_id.second);
+            }
+        }
+    }
+
+    // suppress non-speech tokens
+    // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+    if (params.suppress_non_speech_tokens) {
+        for (const std::string & token : non_speech_tokens) {
+            const std::string suppress_tokens[] = {token, " " + token};
+            for (const std::string & suppress_token : suppress_tokens) {
+                const auto it = vocab.token_to_id.find(suppress_token);
+                if (it != vocab.token_to_id.end()) {
+                    post.push_back(it->second);
+                }
+            }
+        }
+
+        // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+        for (const char * suppress_token : { " -", " '" }) {
+            const auto it = vocab.token_to_id.find(suppress_token);
+            if (it != vocab.token_to_id.end()) {
+                post.push_back(it->second);
+            }
+        }
+    }
+}
+
+// the logits of the text and the timestamp tokens are split in blocks of this size
+// the maxima of the blocks give the max of both ranges and the blocks that contain the top tokens
+#define WHISPER_LOGITS_BLOCK 256
+
+static void whisper_logits_blocks_init(const float * logits, int n_text, int n_logits, std::vector<whisper_logits_block> & blocks) {
+    blocks.clear();
+
+    for (int r = 0; r < 2; ++r) {
+        const int i_start = r == 0 ? 0      : n_text;
+        const int i_end   = r == 0 ? n_text : n_logits;
+
+        for (int i0 = i_start; i0 < i_end; i0 += WHISPER_LOGITS_BLOCK) {
+            const int i1 = std::min(i0 + WHISPER_LOGITS_BLOCK, i_end);
+
+            blocks.push_back({ i0, i1, ggml_max_row_f32(logits + i0, i1 - i0) });
+        }
+    }
+}
+
+// max of the blocks in [i0, i1)
+static float whisper_logits_blocks_max(const std::vector<whisper_logits_block> & blocks, int i0, int i1) {
+    float max = -INFINITY;
+
+    for (const auto & block : blocks) {
+        if (block.i0 >= i0 && block.i1 <= i1) {
+            max = std::max(max, block.max);
+        }
+    }
+
+    return max;
+}
+
+// the k most likely tokens in [i0, i1), ties go to the lower token id
+// the top k tokens are all in the k blocks with the largest maxima, so only these blocks are scanned
+static void whisper_logits_top_k(
+        const float * logits,
+        const std::vector<whisper_logits_block> & blocks,
+        int i0,
+        int i1,
+        int k,
+        std::vector<whisper_token> & top) {
+    std::vector<const whisper_logits_block *> blocks_sel;
+    for (const auto & block : blocks) {
+        if (block.i0 >= i0 && block.i1 <= i1) {
+            blocks_sel.push_back(&block);
+        }
+    }
+
+    const auto cmp_block = [](const whisper_logits_block * a, const whisper_logits_block * b) {
+        return a->max > b->max || (a->max == b->max && a->i0 < b->i0);
+    };
+
+    const int n_blocks = std::min<int>(k, blocks_sel.size());
+    std::partial_sort(blocks_sel.begin(), blocks_sel.begin() + n_blocks, blocks_sel.end(), cmp_block);
+
+    top.clear();
+    for (int b = 0; b < n_blocks; ++b) {
+        for (int i = blocks_sel[b]->i0; i < blocks_sel[b]->i1; ++i) {
+            top.push_back(i);
+        }
+    }
+
+    const auto cmp_token = [logits](whisper_token a, whisper_token b) {
+        return logits[a] > logits[b] || (logits[a] == logits[b] && a < b);
+    };
+
+    const int n_top = std::min<int>(k, top.size());
+    std::partial_sort(top.begin(), top.begin() + n_top, top.end(), cmp_token);
+    top.resize(n_top);
+}
+
 // process the logits for the selected decoder
 // - applies logit filters
-// - computes logprobs and probs
-// TODO: optimize
+// - computes logprobs and probs, the statistics of the timestamp tokens and the top n_top tokens
 static void whisper_process_logits(
               struct whisper_context & ctx,
                struct whisper_state  & state,
               struct whisper_decoder & decoder,
     const struct whisper_full_params   params,
-                               float   temperature) {
+                               float   temperature,
+                                 int   n_top) {
     const auto & vocab      = ctx.vocab;
     const auto & tokens_cur = decoder.sequence.tokens;
 
@@ -4972,12 +7043,15 @@ static void whisper_process_logits(
     auto & logprobs = decoder.logprobs;
     {
         logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + decoder.i_batch*n_logits, n_logits*sizeof(float));
+
+        const float * logits_src = state.logits.data() + decoder.i_batch*n_logits;
 
         if (temperature > 0.0f) {
             for (int i = 0; i < n_logits; i++) {
-                logits[i] /= temperature;
+                logits[i] = logits_src[i]/temperature;
             }
+        } else {
+            memcpy(logits.data(), logits_src, n_logits*sizeof(float));
         }
 
         // will be populated a bit later
@@ -4997,71 +7071,23 @@ static void whisper_process_logits(
             }
         }
 
-        // suppress <|notimestamps|> token
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
-        logits[vocab.token_not] = -INFINITY;
-        if (params.no_timestamps) {
-            for (int i = vocab.token_beg; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
-            }
-        }
-
-        // suppress sot and nosp tokens
-        logits[vocab.token_sot]  = -INFINITY;
-        logits[vocab.token_nosp] = -INFINITY; // TODO: ignore this token for now
-
-        // [TDRZ] when tinydiarize is disabled, suppress solm token
-        if (params.tdrz_enable == false) {
-            logits[vocab.token_solm] = -INFINITY;
+        // suppress <|notimestamps|>, sot, nosp, solm, task, lang and prev tokens
+        // see whisper_suppress_init()
+        for (const whisper_token id : state.suppress.pre) {
+            logits[id] = -INFINITY;
         }
 
-        // suppress task tokens
-        logits[vocab.token_translate]  = -INFINITY;
-        logits[vocab.token_transcribe] = -INFINITY;
-        logits[vocab.token_prev]       = -INFINITY;
-
-        // suppress lang tokens
-        for (size_t i = 0; i < g_lang.size(); ++i) {
-            logits[whisper_token_lang(&ctx, i)] = -INFINITY;
+        if (params.no_timestamps) {
+            std::fill(logits.begin() + vocab.token_beg, logits.end(), -INFINITY);
         }
 
-        // suppress prev token
-        logits[vocab.token_prev] = -INFINITY;
-
         if (params.logits_filter_callback) {
             params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
         }
 
-        // suppress any tokens matching a regular expression
-        // ref: https://github.com/openai/whisper/discussions/1041
-        if (params.suppress_regex != nullptr) {
-            std::regex re(params.suppress_regex);
-            for (std::pair<whisper_vocab::token, whisper_vocab::id> token_id : vocab.token_to_id) {
-                if (std::regex_match(token_id.first, re)) {
-                    logits[token_id.second] = -INFINITY;
-                }
-            }
-        }
-
-        // suppress non-speech tokens
-        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
-        if (params.suppress_non_speech_tokens) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
-                    }
-                }
-            }
-
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
-            }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
-            }
+        // suppress any tokens matching a regular expression and the non-speech tokens
+        for (const whisper_token id : state.suppress.post) {
+            logits[id] = -INFINITY;
         }
 
         // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
@@ -5074,13 +7100,9 @@ static void whisper_process_logits(
 
             if (last_was_timestamp) {
                 if (penultimate_was_timestamp) {
-                    for (int i = vocab.token_beg; i < n_logits; ++i) {
-                        logits[i] = -INFINITY;
-                    }
+                    std::fill(logits.begin() + vocab.token_beg, logits.end(), -INFINITY);
                 } else {
-                    for (int i = 0; i < vocab.token_eot; ++i) {
-                        logits[i] = -INFINITY;
-                    }
+                    std::fill(logits.begin(), logits.begin() + vocab.token_eot, -INFINITY);
                 }
             }
         }
@@ -5106,88 +7128,92 @@ static void whisper_process_logits(
             }
         }
 
-        // populate the logprobs array (log_softmax)
-        {
-            const float logit_max = *std::max_element(logits.begin(), logits.end());
-            float logsumexp = 0.0f;
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logsumexp += expf(logits[i] - logit_max);
-                }
-            }
-            logsumexp = logf(logsumexp) + logit_max;
+        // log_softmax
+        //
+        // fused with the statistics used for sampling: the maxima of the blocks give the max of the text and the
+        // timestamp tokens and the top tokens, the exponents are computed once (vectorized) and kept in probs
+        const int n_text = vocab.token_beg;
 
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logprobs[i] = logits[i] - logsumexp;
-                } else {
-                    logprobs[i] = -INFINITY;
-                }
-            }
-        }
+        auto & blocks = decoder.logits_blocks;
+
+        float  max_text;
+        float  logit_max;
+        double sum_text;
+        double sum_ts;
+
+        const auto compute_sums = [&]() {
+            whisper_logits_blocks_init(logits.data(), n_text, n_logits, blocks);
+
+            max_text  = whisper_logits_blocks_max(blocks, 0, n_text);
+            logit_max = std::max(max_text, whisper_logits_blocks_max(blocks, n_text, n_logits));
+
+            sum_text = ggml_soft_max_row_f32(logits.data(),          probs.data(),          n_text,            logit_max);
+            sum_ts   = ggml_soft_max_row_f32(logits.data() + n_text, probs.data() + n_text, n_logits - n_text, logit_max);
+        };
+
+        compute_sums();
+
+        float logsumexp = logf(sum_text + sum_ts) + logit_max;
 
         // if sum of probability over timestamps is above any other token, sample timestamp
         // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
         {
-            // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
-                    }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
-                }
-            }
-
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+            const float timestamp_logprob      = sum_ts > 0.0 ? logf(sum_ts) + logit_max - logsumexp : -INFINITY;
+            const float max_text_token_logprob = max_text - logsumexp;
 
             //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
 
             if (timestamp_logprob > max_text_token_logprob) {
-                for (int i = 0; i < vocab.token_beg; ++i) {
-                    logits[i]   = -INFINITY;
-                    logprobs[i] = -INFINITY;
-                }
-            } else {
-                if (params.n_grammar_rules > 0) {
-                    whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
-
-                    // populate the logprobs array (log_softmax)
-                    {
-                        const float logit_max = *std::max_element(logits.begin(), logits.end());
-                        float logsumexp = 0.0f;
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logsumexp += expf(logits[i] - logit_max);
-                            }
-                        }
-                        logsumexp = logf(logsumexp) + logit_max;
+                // the normalization of the full distribution is kept
+                std::fill(logits.begin(), logits.begin() + n_text, -INFINITY);
+                std::fill(probs.begin(),  probs.begin()  + n_text, 0.0f);
 
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logprobs[i] = logits[i] - logsumexp;
-                            } else {
-                                logprobs[i] = -INFINITY;
-                            }
-                        }
+                for (auto & block : blocks) {
+                    if (block.i1 <= n_text) {
+                        block.max = -INFINITY;
                     }
                 }
+
+                sum_text = 0.0;
+            } else if (params.n_grammar_rules > 0) {
+                whisper_suppress_invalid_grammar(ctx, state, params, logits, decoder.grammar);
+
+                compute_sums();
+
+                logsumexp = logf(sum_text + sum_ts) + logit_max;
             }
         }
-    }
 
-    // compute probs
-    {
-        for (int i = 0; i < n_logits; ++i) {
-            if (logits[i] == -INFINITY) {
-                probs[i] = 0.0f;
+        // populate the logprobs and the probs arrays together with the statistics used for sampling
+        {
+            const double sum = sum_text + sum_ts;
+
+            if (sum > 0.0) {
+                const float inv_sum = 1.0/sum;
+
+                for (int i = 0; i < n_logits; ++i) {
+                    logprobs[i] = logits[i] - logsumexp;
+                    probs[i]   *= inv_sum;
+                }
             } else {
-                probs[i] = expf(logprobs[i]);
+                std::fill(logprobs.begin(), logprobs.end(), -INFINITY);
+            }
+
+            auto & stats = decoder.probs_stats;
+
+            stats = { 0, -1, sum > 0.0 ? sum_ts/sum : 0.0, 0.0, };
+
+            whisper_logits_top_k(logits.data(), blocks, 0, n_logits, std::max(n_top, 1), decoder.top);
+
+            stats.id = decoder.top[0];
+
+            // the most likely timestamp token
+            std::vector<whisper_token> top_ts;
+            whisper_logits_top_k(logits.data(), blocks, n_text, n_logits, 1, top_ts);
+
+            if (!top_ts.empty() && probs[top_ts[0]] > 0.0f) {
+                stats.tid    = top_ts[0];
+                stats.max_ts = probs[top_ts[0]];
             }
         }
     }
@@ -5272,35 +7298,21 @@ static whisper_token_data whisper_sample_token(
     const auto & probs    = decoder.probs;
     const auto & logprobs = decoder.logprobs;
 
-    const int n_logits = vocab.n_vocab;
-
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
-
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
-
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                result.tid = i;
-            }
-        }
+    // computed by whisper_process_logits
+    const auto & stats = decoder.probs_stats;
 
-        result.pt    = max_ts/(sum_ts + 1e-10);
-        result.ptsum = sum_ts;
+    if (stats.tid >= 0) {
+        result.tid = stats.tid;
     }
 
+    result.pt    = stats.max_ts/(stats.sum_ts + 1e-10);
+    result.ptsum = stats.sum_ts;
+
     if (best) {
-        for (int i = 0; i < n_logits; ++i) {
-            if (result.p < probs[i]) {
-                result.id   = i;
-                result.p    = probs[i];
-                result.plog = logprobs[i];
-            }
+        if (probs[stats.id] > 0.0f) {
+            result.id   = stats.id;
+            result.p    = probs[stats.id];
+            result.plog = logprobs[stats.id];
         }
     } else {
         std::discrete_distribution<> dist(probs.begin(), probs.end());
@@ -5325,28 +7337,12 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
     const auto & vocab = ctx.vocab;
 
     const auto & probs    = decoder.probs;
-    const auto & logits   = decoder.logits;
-    const auto & logprobs = decoder.logprobs;
-
-    const int n_logits = vocab.n_vocab;
-
-    auto & logits_id = decoder.logits_id;
-
-    logits_id.resize(n_logits);
-    for (int i = 0; i < n_logits; ++i) {
-        logits_id[i].first = logits[i];
-        logits_id[i].second = i;
-    }
-
-    {
-        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
-        std::partial_sort(
-                logits_id.begin(),
-                logits_id.begin() + k, logits_id.end(),
-                [](const pair_type & a, const pair_type & b) {
-            return a.first > b.first;
-        });
-    }
+    const auto & logprobs = decoder.logprobs;
+
+    // the k most likely tokens, computed by whisper_process_logits
+    const auto & top = decoder.top;
+
+    GGML_ASSERT((int) top.size() >= std::min(k, vocab.n_vocab));
 
     std::vector<whisper_token_data> result;
     result.reserve(k);
@@ -5356,30 +7352,27 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
     float pt    = 0.0;
     float ptsum = 0.0;
 
+    // computed by whisper_process_logits
     {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
-
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
+        const auto & stats = decoder.probs_stats;
 
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                tid = i;
-            }
+        if (stats.tid >= 0) {
+            tid = stats.tid;
         }
 
-        pt    = max_ts/(sum_ts + 1e-10);
-        ptsum = sum_ts;
+        pt    = stats.max_ts/(stats.sum_ts + 1e-10);
+        ptsum = stats.sum_ts;
+    }
+
+    std::vector<float> probs_top(top.size());
+    for (size_t i = 0; i < top.size(); ++i) {
+        probs_top[i] = probs[top[i]];
     }
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
+    std::discrete_distribution<> dist(probs_top.begin(), probs_top.end());
 
     for (int i = 0; i < k; ++i) {
-        const auto id = dist(decoder.rng);
+        const auto id = top[dist(decoder.rng)];
         //printf("XXX %d %d %f %f %f %f\n", id, tid, probs[id], logprobs[id], pt, ptsum);
 
         result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, -1, 0.0f, });
@@ -5442,6 +7435,229 @@ static void whisper_sequence_score(
     }
 }
 
+// [EXPERIMENTAL] energy-based voice activity detection
+//
+// the input is split in 10 ms frames (same as the mel spectrogram) and a frame is considered speech if its average
+// amplitude is above a threshold placed between the noise floor and the speech level of the input
+// silences shorter than vad_min_silence_ms are kept, so only long pauses are removed
+//
+// the speech regions are concatenated into pcm_out and the spans are used to map timestamps back to the input
+//
+static void whisper_vad_compact(
+        const struct whisper_full_params & params,
+                             const float * samples,
+                                     int   n_samples,
+                                 int64_t   t_offset,
+                      std::vector<float> & pcm_out,
+           std::vector<whisper_vad_span> & spans) {
+    pcm_out.clear();
+    spans.clear();
+
+    const int n_per_frame = WHISPER_HOP_LENGTH;
+    const int n_frames    = (n_samples + n_per_frame - 1)/n_per_frame;
+
+    if (n_frames == 0) {
+        return;
+    }
+
+    std::vector<float> energy(n_frames);
+    for (int f = 0; f < n_frames; ++f) {
+        const int s0 = f*n_per_frame;
+        const int s1 = std::min(n_samples, s0 + n_per_frame);
+
+        float sum = 0.0f;
+        for (int i = s0; i < s1; ++i) {
+            sum += fabsf(samples[i]);
+        }
+        energy[f] = sum/(s1 - s0);
+    }
+
+    // estimate the noise floor and the speech level from the distribution of the frame energies
+    float e_lo;
+    float e_hi;
+    {
+        std::vector<float> tmp = energy;
+
+        std::nth_element(tmp.begin(), tmp.begin() + n_frames/10, tmp.end());
+        e_lo = tmp[n_frames/10];
+
+        std::nth_element(tmp.begin(), tmp.begin() + (9*n_frames)/10, tmp.end());
+        e_hi = tmp[(9*n_frames)/10];
+    }
+
+    if (e_hi <= 1e-6f) {
+        // digital silence
+        return;
+    }
+
+    const float thold = e_lo + params.vad_thold*(e_hi - e_lo);
+
+    const int n_min_silence = std::max(1, params.vad_min_silence_ms/10);
+    const int n_pad         = std::max(0, params.vad_speech_pad_ms/10);
+
+    // speech regions [f0, f1) in frames
+    std::vector<std::pair<int, int>> regions;
+
+    if (e_hi - e_lo < 1e-3f*e_hi) {
+        // flat signal - nothing to separate
+        regions.emplace_back(0, n_frames);
+    } else {
+        for (int f = 0; f < n_frames; ) {
+            if (energy[f] <= thold) {
+                ++f;
+                continue;
+            }
+
+            const int f0 = f;
+            while (f < n_frames && energy[f] > thold) {
+                ++f;
+            }
+
+            const int f_prev = regions.empty() ? 0 : regions.back().second;
+            if (f0 - f_prev < n_min_silence) {
+                // the silence is too short to be skipped
+                if (regions.empty()) {
+                    regions.emplace_back(0, f);
+                } else {
+                    regions.back().second = f;
+                }
+            } else {
+                regions.emplace_back(f0, f);
+            }
+        }
+
+        if (!regions.empty() && n_frames - regions.back().second < n_min_silence) {
+            regions.back().second = n_frames;
+        }
+    }
+
+    // pad the regions and merge the ones that overlap
+    std::vector<std::pair<int, int>> padded;
+    for (const auto & r : regions) {
+        const int f0 = std::max(0,        r.first  - n_pad);
+        const int f1 = std::min(n_frames, r.second + n_pad);
+
+        if (!padded.empty() && f0 <= padded.back().second) {
+            padded.back().second = f1;
+        } else {
+            padded.emplace_back(f0, f1);
+        }
+    }
+
+    for (const auto & r : padded) {
+        const int s0 = r.first*n_per_frame;
+        const int s1 = std::min(n_samples, r.second*n_per_frame);
+
+        spans.push_back({ (int64_t) pcm_out.size()/n_per_frame, t_offset + r.first, r.second - r.first });
+
+        pcm_out.insert(pcm_out.end(), samples + s0, samples + s1);
+    }
+}
+
+// map a timestamp of the speech-only audio to the original input
+// a timestamp on the boundary of two spans is mapped to the end of the first span if is_end is true
+static int64_t whisper_vad_map_t(const std::vector<whisper_vad_span> & spans, int64_t t, bool is_end) {
+    if (spans.empty() || t < 0) {
+        return t;
+    }
+
+    auto it = is_end ?
+        std::lower_bound(spans.begin(), spans.end(), t, [](const whisper_vad_span & s, int64_t v) { return s.t_proc <  v; }) :
+        std::upper_bound(spans.begin(), spans.end(), t, [](int64_t v, const whisper_vad_span & s) { return v < s.t_proc; });
+
+    if (it != spans.begin()) {
+        --it;
+    }
+
+    return it->t_orig + (t - it->t_proc);
+}
+
+static void whisper_vad_map_segments(whisper_state & state, int i_segment, int n_segments) {
+    const auto & spans = state.vad_spans;
+
+    for (int i = i_segment; i < i_segment + n_segments; ++i) {
+        auto & segment = state.result_all[i];
+
+        segment.t0 = whisper_vad_map_t(spans, segment.t0, false);
+        segment.t1 = whisper_vad_map_t(spans, segment.t1, true);
+
+        for (auto & token : segment.tokens) {
+            token.t0 = whisper_vad_map_t(spans, token.t0, false);
+            token.t1 = whisper_vad_map_t(spans, token.t1, true);
+        }
+    }
+}
+
+// [EXPERIMENTAL] speculative decoding
+//
+// bring the KV cache of the draft model up to date with the tokens of the target decoder and propose up to
+// n_draft tokens that follow them - fewer if the text context of the draft model ends before
+// the tokens of the previous proposal that were rejected by the target model are removed from the draft KV cache
+//
+static bool whisper_speculative_draft(
+        struct whisper_context & ctx_draft,
+          struct whisper_state & state_draft,
+    struct whisper_full_params   params,
+const std::vector<whisper_token> & prompt,
+        const whisper_sequence & sequence,
+                             int   n_draft,
+                           int & n_past_draft,
+    std::vector<whisper_token> & drafted) {
+    drafted.clear();
+
+    // the user callbacks and the grammar are only applied to the target model
+    params.logits_filter_callback  = nullptr;
+    params.grammar_rules           = nullptr;
+    params.n_grammar_rules         = 0;
+
+    // position of the last token of the target decoder
+    const int n_past = prompt.size() + sequence.tokens.size() - 1;
+
+    // the k-th drafted token is sampled from the logits at position n_past + k
+    n_draft = std::min(n_draft, whisper_n_text_ctx(&ctx_draft) - n_past);
+    if (n_draft <= 0) {
+        return true;
+    }
+
+    n_past_draft = std::min(n_past_draft, n_past);
+    whisper_kv_cache_seq_rm(state_draft.kv_self, 0, n_past_draft, -1);
+
+    auto & batch   = state_draft.batch;
+    auto & decoder = state_draft.decoders[0];
+
+    decoder.sequence.tokens = sequence.tokens;
+
+    for (int p = n_past_draft; p <= n_past; ++p) {
+        batch.token[p - n_past_draft] = p < (int) prompt.size() ? prompt[p] : sequence.tokens[p - prompt.size()].id;
+    }
+    whisper_batch_prep_legacy(batch, nullptr, n_past - n_past_draft + 1, n_past_draft, 0);
+
+    for (int k = 0; k < n_draft; ++k) {
+        if (!whisper_decode_internal(ctx_draft, state_draft, batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+            return false;
+        }
+
+        n_past_draft += batch.n_tokens;
+
+        decoder.i_batch = batch.n_tokens - 1;
+        whisper_process_logits(ctx_draft, state_draft, decoder, params, 0.0f, 1);
+
+        const auto token = whisper_sample_token(ctx_draft, decoder, true);
+
+        decoder.sequence.tokens.push_back(token);
+        drafted.push_back(token.id);
+
+        if (token.id == whisper_token_eot(&ctx_draft)) {
+            break;
+        }
+
+        batch.token[0] = token.id;
+        whisper_batch_prep_legacy(batch, nullptr, 1, n_past_draft, 0);
+    }
+
+    return true;
+}
+
 int whisper_full_with_state(
         struct whisper_context * ctx,
           struct whisper_state * state,
@@ -5453,6 +7669,33 @@ int whisper_full_with_state(
 
     result_all.clear();
 
+    // speech-only audio when voice activity detection is enabled
+    std::vector<float> pcm_vad;
+
+    state->vad_spans.clear();
+
+    if (params.vad && n_samples > 0) {
+        const int s0 = std::min<int64_t>(n_samples, ((int64_t) params.offset_ms*WHISPER_SAMPLE_RATE)/1000);
+        const int s1 = params.duration_ms == 0 ? n_samples : std::min<int64_t>(n_samples, s0 + ((int64_t) params.duration_ms*WHISPER_SAMPLE_RATE)/1000);
+
+        whisper_vad_compact(params, samples + s0, s1 - s0, s0/WHISPER_HOP_LENGTH, pcm_vad, state->vad_spans);
+
+        if (state->vad_spans.empty()) {
+            WHISPER_LOG_INFO("%s: no speech detected\n", __func__);
+            return 0;
+        }
+
+        WHISPER_LOG_INFO("%s: vad: keeping %.2f s of %.2f s of audio in %d regions\n", __func__,
+                (float) pcm_vad.size()/WHISPER_SAMPLE_RATE, (float) (s1 - s0)/WHISPER_SAMPLE_RATE, (int) state->vad_spans.size());
+
+        samples   = pcm_vad.data();
+        n_samples = pcm_vad.size();
+
+        // the offset and the duration have been applied to the speech-only audio
+        params.offset_ms   = 0;
+        params.duration_ms = 0;
+    }
+
     if (n_samples > 0) {
         // compute log mel spectrogram
         if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
@@ -5461,15 +7704,48 @@ int whisper_full_with_state(
         }
     }
 
+    state->exp_encoder_cache = params.encoder_cache;
+
+    // the encoder window evaluated by the language detection - reused by the first iteration of the main loop if it matches
+    int enc_seek_cached      = -1;
+    int enc_audio_ctx_cached = -1;
+
     // auto-detect language if not specified
     if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
         std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
 
-        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
-        if (lang_id < 0) {
-            WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
-            return -3;
+        int lang_id = -1;
+
+        if (params.lang_detect_cache && state->lang_detect_id >= 0) {
+            lang_id = state->lang_detect_id;
+            probs   = state->lang_detect_probs;
+        } else {
+            if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+                WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+                return -5;
+            }
+
+            // 1 audio context position = 2 mel frames = 20 ms
+            int n_audio_ctx_detect = params.audio_ctx;
+            if (params.lang_detect_ms > 0) {
+                n_audio_ctx_detect = std::min(whisper_n_audio_ctx(ctx), (params.lang_detect_ms + 19)/20);
+            }
+
+            state->exp_n_audio_ctx = n_audio_ctx_detect;
+
+            lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
+            if (lang_id < 0) {
+                WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
+                return -3;
+            }
+
+            enc_seek_cached      = 0;
+            enc_audio_ctx_cached = n_audio_ctx_detect == whisper_n_audio_ctx(ctx) ? 0 : n_audio_ctx_detect;
+
+            state->lang_detect_id    = lang_id;
+            state->lang_detect_probs = probs;
         }
+
         state->lang_id = lang_id;
         params.language = whisper_lang_str(lang_id);
 
@@ -5526,6 +7802,9 @@ int whisper_full_with_state(
 
     n_decoders = std::max(1, n_decoders);
 
+    // number of the most likely tokens that whisper_process_logits finds for sampling
+    const int n_top = params.strategy == WHISPER_SAMPLING_BEAM_SEARCH ? std::max(1, params.beam_search.beam_size) : 1;
+
     if (n_decoders > WHISPER_MAX_DECODERS) {
         WHISPER_LOG_ERROR("%s: too many decoders requested (%d), max = %d\n", __func__, n_decoders, WHISPER_MAX_DECODERS);
         return -4;
@@ -5545,6 +7824,17 @@ int whisper_full_with_state(
         decoder.rng = std::mt19937(0);
     }
 
+    // threads used to process the decoders in parallel
+    {
+        const int n_workers = std::min(params.n_threads, n_decoders);
+
+        if (!state->workers || state->workers->size() != n_workers) {
+            state->workers.reset(new whisper_thread_pool(n_workers));
+        }
+    }
+
+    auto & workers = *state->workers;
+
     // the accumulated text context so far
     auto & prompt_past = state->prompt_past;
     if (params.no_context) {
@@ -5585,6 +7875,15 @@ int whisper_full_with_state(
     }
     state->exp_n_audio_ctx = params.audio_ctx;
 
+    whisper_suppress_init(*ctx, *state, params);
+
+    state->exp_n_text_layer_exit = params.n_text_layer_exit;
+    state->exp_text_exit_thold   = params.text_exit_thold;
+
+    if (state->exp_n_text_layer_exit > 0 && !whisper_exit_init(*state, ctx->model.hparams)) {
+        return -7;
+    }
+
     // these tokens determine the task that will be performed
     std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx), };
 
@@ -5617,6 +7916,43 @@ int whisper_full_with_state(
     std::vector<whisper_token> prompt;
     prompt.reserve(whisper_n_text_ctx(ctx));
 
+    // [EXPERIMENTAL] speculative decoding
+    whisper_context * ctx_draft   = params.draft_ctx;
+    whisper_state   * state_draft = nullptr;
+
+    if (ctx_draft) {
+        if (params.n_draft < 1) {
+            WHISPER_LOG_WARN("%s: n_draft = %d - disabling speculative decoding\n", __func__, params.n_draft);
+        } else if (ctx_draft->state == nullptr || n_samples == 0) {
+            WHISPER_LOG_WARN("%s: the draft model needs a default state and PCM input - disabling speculative decoding\n", __func__);
+        } else if (whisper_n_vocab(ctx_draft) != whisper_n_vocab(ctx) || whisper_token_eot(ctx_draft) != whisper_token_eot(ctx)) {
+            WHISPER_LOG_WARN("%s: the draft model vocabulary does not match - disabling speculative decoding\n", __func__);
+        } else if (whisper_pcm_to_mel_with_state(ctx_draft, ctx_draft->state, samples, n_samples, params.n_threads) != 0) {
+            WHISPER_LOG_WARN("%s: failed to compute the mel spectrogram of the draft model - disabling speculative decoding\n", __func__);
+        } else {
+            if (params.n_draft > whisper_n_text_ctx(ctx) - 1) {
+                WHISPER_LOG_WARN("%s: n_draft = %d is larger than the text context - using %d\n", __func__, params.n_draft, whisper_n_text_ctx(ctx) - 1);
+                params.n_draft = whisper_n_text_ctx(ctx) - 1;
+            }
+
+            state_draft = ctx_draft->state;
+            state_draft->exp_n_audio_ctx = params.audio_ctx;
+            state_draft->exp_encoder_cache = params.encoder_cache;
+
+            whisper_suppress_init(*ctx_draft, *state_draft, params);
+        }
+    }
+
+    bool draft_encoded = false; // the draft model has encoded the current segment
+
+    int n_past_draft = 0;       // number of positions in the draft KV cache
+
+    std::vector<whisper_token> drafted; // tokens proposed by the draft model, not yet verified
+    int i_drafted = 0;                  // number of drafted tokens accepted so far
+
+    auto & prompt_cached = state->prompt_cached;
+    auto & prompt_logits = state->prompt_logits;
+
     struct beam_candidate {
         int decoder_idx;
         int seek_delta;
@@ -5652,10 +7988,17 @@ int whisper_full_with_state(
         }
 
         // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+        // the language detection may have already encoded this exact window
+        const int n_audio_ctx_cur = state->exp_n_audio_ctx == whisper_n_audio_ctx(ctx) ? 0 : state->exp_n_audio_ctx;
+        if (seek == enc_seek_cached && n_audio_ctx_cur == enc_audio_ctx_cached) {
+            WHISPER_LOG_DEBUG("%s: reusing the encoder output of the language detection\n", __func__);
+        } else if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
             WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
             return -6;
         }
+        enc_seek_cached = -1;
+
+        draft_encoded = false;
 
         // if there is a very short audio segment left to process, we remove any past prompt since it tends
         // to confuse the decoder and often make it repeat or hallucinate stuff
@@ -5691,6 +8034,25 @@ int whisper_full_with_state(
 
             WHISPER_LOG_DEBUG("\n%s: strategy = %d, decoding with %d decoders, temperature = %.2f\n", __func__, params.strategy, n_decoders_cur, t_cur);
 
+            const bool use_draft = state_draft && params.strategy == WHISPER_SAMPLING_GREEDY && n_decoders_cur == 1 && t_cur < 1e-6f;
+
+            if (use_draft) {
+                if (!draft_encoded) {
+                    if (!whisper_encode_internal(*ctx_draft, *state_draft, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+                        WHISPER_LOG_ERROR("%s: failed to encode with the draft model\n", __func__);
+                        return -6;
+                    }
+                    draft_encoded = true;
+                }
+
+                whisper_kv_cache_clear(state_draft->kv_self);
+
+                n_past_draft = 0;
+            }
+
+            drafted.clear();
+            i_drafted = 0;
+
             // TAGS: WHISPER_DECODER_INIT
             for (int j = 0; j < n_decoders_cur; ++j) {
                 auto & decoder = state->decoders[j];
@@ -5717,7 +8079,6 @@ int whisper_full_with_state(
             }
 
             // init prompt and kv cache for the current iteration
-            // TODO: do not recompute the prompt if it is the same as previous time
             {
                 prompt.clear();
 
@@ -5739,21 +8100,44 @@ int whisper_full_with_state(
                 }
                 WHISPER_LOG_DEBUG("\n\n");
 
-                whisper_kv_cache_clear(state->kv_self);
+                const int n_vocab = ctx->vocab.n_vocab;
+
+                if (prompt == prompt_cached) {
+                    // temperature fallback with the same prompt - drop the tokens of the previous round and reuse the prompt
+                    for (int j = 0; j < WHISPER_MAX_DECODERS; ++j) {
+                        whisper_kv_cache_seq_rm(state->kv_self, j, -1, -1);
+                    }
+
+                    whisper_kv_cache_seq_cp(state->kv_self, WHISPER_SEQ_ID_PROMPT, 0, -1, -1);
+
+                    state->logits.assign(prompt_logits.begin(), prompt_logits.end());
+
+                    state->decoders[0].i_batch = 0;
+                } else {
+                    whisper_kv_cache_clear(state->kv_self);
+                    prompt_cached.clear();
+
+                    whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
+
+                    if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                        return -7;
+                    }
+
+                    whisper_kv_cache_seq_cp(state->kv_self, 0, WHISPER_SEQ_ID_PROMPT, -1, -1);
 
-                whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
+                    prompt_cached = prompt;
+                    prompt_logits.assign(
+                            state->logits.begin() + (prompt.size() - 1)*n_vocab,
+                            state->logits.begin() + (prompt.size() - 0)*n_vocab);
 
-                if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
-                    WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
-                    return -7;
+                    state->decoders[0].i_batch = prompt.size() - 1;
                 }
 
                 {
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    state->decoders[0].i_batch = prompt.size() - 1;
-
-                    whisper_process_logits(*ctx, *state, state->decoders[0], params, t_cur);
+                    whisper_process_logits(*ctx, *state, state->decoders[0], params, t_cur, n_top);
 
                     for (int j = 1; j < n_decoders_cur; ++j) {
                         auto & decoder = state->decoders[j];
@@ -5763,6 +8147,9 @@ int whisper_full_with_state(
                         memcpy(decoder.probs.data(),    state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
                         memcpy(decoder.logits.data(),   state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
                         memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
+
+                        decoder.probs_stats = state->decoders[0].probs_stats;
+                        decoder.top         = state->decoders[0].top;
                     }
 
                     state->t_sample_us += ggml_time_us() - t_start_sample_us;
@@ -5779,7 +8166,7 @@ int whisper_full_with_state(
                 }
 
                 // sampling
-                // TODO: avoid memory allocations, optimize, avoid threads?
+                // TODO: avoid memory allocations, optimize
                 {
                     std::atomic<int> j_cur(0);
 
@@ -5822,22 +8209,10 @@ int whisper_full_with_state(
                         }
                     };
 
-                    const int n_threads = std::min(params.n_threads, n_decoders_cur);
-
-                    if (n_threads == 1) {
+                    if (n_decoders_cur == 1) {
                         process();
                     } else {
-                        std::vector<std::thread> threads(n_threads - 1);
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t] = std::thread(process);
-                        }
-
-                        process();
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t].join();
-                        }
+                        workers.run(process);
                     }
                 }
 
@@ -6014,6 +8389,70 @@ int whisper_full_with_state(
 
                 state->t_sample_us += ggml_time_us() - t_start_sample_us;
 
+                // [EXPERIMENTAL] speculative decoding
+                // the drafted tokens are decoded by the target model in a single batch and then accepted one by one for
+                // as long as they match the tokens sampled from the target logits
+                if (use_draft) {
+                    auto & decoder = state->decoders[0];
+
+                    const whisper_token id = decoder.sequence.tokens.back().id;
+
+                    const int n_past = prompt.size() + i;
+
+                    if (i_drafted < (int) drafted.size() && drafted[i_drafted] == id) {
+                        // the logits for the next token are already available
+                        decoder.i_batch = ++i_drafted;
+
+                        const int64_t t_start_sample_us = ggml_time_us();
+
+                        whisper_process_logits(*ctx, *state, decoder, params, t_cur, n_top);
+
+                        state->t_sample_us += ggml_time_us() - t_start_sample_us;
+
+                        continue;
+                    }
+
+                    // remove the rejected tokens
+                    whisper_kv_cache_seq_rm(state->kv_self, 0, n_past, -1);
+
+                    // the current token and the drafted ones are decoded at the positions n_past, n_past + 1, ...
+                    const int n_draft = std::min(params.n_draft, whisper_n_text_ctx(ctx) - n_past - 1);
+
+                    if (!whisper_speculative_draft(*ctx_draft, *state_draft, params, prompt, decoder.sequence, n_draft, n_past_draft, drafted)) {
+                        WHISPER_LOG_ERROR("%s: failed to decode with the draft model\n", __func__);
+                        return -8;
+                    }
+
+                    i_drafted = 0;
+
+                    auto & batch = state->batch;
+
+                    batch.token[0] = id;
+                    for (int k = 0; k < (int) drafted.size(); ++k) {
+                        batch.token[k + 1] = drafted[k];
+                    }
+                    whisper_batch_prep_legacy(batch, nullptr, drafted.size() + 1, n_past, 0);
+
+                    for (int k = 0; k < batch.n_tokens; ++k) {
+                        batch.logits[k] = 1;
+                    }
+
+                    if (!whisper_decode_internal(*ctx, *state, batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                        return -8;
+                    }
+
+                    decoder.i_batch = 0;
+
+                    const int64_t t_start_sample_us = ggml_time_us();
+
+                    whisper_process_logits(*ctx, *state, decoder, params, t_cur, n_top);
+
+                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
+
+                    continue;
+                }
+
                 // obtain logits for the next token
                 {
                     auto & batch = state->batch;
@@ -6050,7 +8489,7 @@ int whisper_full_with_state(
 
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    // TODO: avoid memory allocations, optimize, avoid threads?
+                    // TODO: avoid memory allocations, optimize
                     {
                         std::atomic<int> j_cur(0);
 
@@ -6068,26 +8507,14 @@ int whisper_full_with_state(
                                     continue;
                                 }
 
-                                whisper_process_logits(*ctx, *state, decoder, params, t_cur);
+                                whisper_process_logits(*ctx, *state, decoder, params, t_cur, n_top);
                             }
                         };
 
-                        const int n_threads = std::min(params.n_threads, n_decoders_cur);
-
-                        if (n_threads == 1) {
+                        if (n_decoders_cur == 1) {
                             process();
                         } else {
-                            std::vector<std::thread> threads(n_threads - 1);
-
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t] = std::thread(process);
-                            }
-
-                            process();
-
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t].join();
-                            }
+                            workers.run(process);
                         }
                     }
 
@@ -6211,7 +8638,9 @@ int whisper_full_with_state(
 
                             if (params.print_realtime) {
                                 if (params.print_timestamps) {
-                                    printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
+                                    printf("[%s --> %s]  %s\n",
+                                            to_timestamp(whisper_vad_map_t(state->vad_spans, tt0, false)).c_str(),
+                                            to_timestamp(whisper_vad_map_t(state->vad_spans, tt1, true)).c_str(), text.c_str());
                                 } else {
                                     printf("%s", text.c_str());
                                     fflush(stdout);
@@ -6235,6 +8664,9 @@ int whisper_full_with_state(
                                     n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
                                 }
                             }
+                            if (!state->vad_spans.empty()) {
+                                whisper_vad_map_segments(*state, result_all.size() - n_new, n_new);
+                            }
                             if (params.new_segment_callback) {
                                 params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
                             }
@@ -6258,7 +8690,9 @@ int whisper_full_with_state(
 
                     if (params.print_realtime) {
                         if (params.print_timestamps) {
-                            printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
+                            printf("[%s --> %s]  %s\n",
+                                    to_timestamp(whisper_vad_map_t(state->vad_spans, tt0, false)).c_str(),
+                                    to_timestamp(whisper_vad_map_t(state->vad_spans, tt1, true)).c_str(), text.c_str());
                         } else {
                             printf("%s", text.c_str());
                             fflush(stdout);
@@ -6280,6 +8714,9 @@ int whisper_full_with_state(
                             n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
                         }
                     }
+                    if (!state->vad_spans.empty()) {
+                        whisper_vad_map_segments(*state, result_all.size() - n_new, n_new);
+                    }
                     if (params.new_segment_callback) {
                         params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
                     }
@@ -6294,6 +8731,14 @@ int whisper_full_with_state(
                     const int n_frames = std::min(std::min(WHISPER_CHUNK_SIZE * 100, seek_delta), seek_end - seek);
                     whisper_exp_compute_token_level_timestamps_dtw(
                             ctx, state, params, result_all.size() - n_segments, n_segments, seek, n_frames, 7, params.n_threads);
+
+                    if (!state->vad_spans.empty()) {
+                        for (size_t i = result_all.size() - n_segments; i < result_all.size(); ++i) {
+                            for (auto & token : result_all[i].tokens) {
+                                token.t_dtw = whisper_vad_map_t(state->vad_spans, token.t_dtw, false);
+                            }
+                        }
+                    }
                 }
             }
 
@@ -6326,6 +8771,12 @@ int whisper_full_parallel(
     }
     int ret = 0;
 
+    // the draft model has a single state, which the chunks cannot share
+    if (params.draft_ctx) {
+        WHISPER_LOG_WARN("%s: speculative decoding is not supported with n_processors > 1 - disabling it\n", __func__);
+        params.draft_ctx = nullptr;
+    }
+
     // prepare separate states for each thread
     std::vector<whisper_state*> states;
 
@@ -7129,64 +9580,63 @@ static std::vector<uint32_t> get_alignment_heads_by_layer(const whisper_context_
 // dtw + backtrace to return found path
 // based on
 // https://github.com/openai/whisper/blob/main/whisper/timing.py#L83
-static ggml_tensor * dtw_and_backtrace(ggml_context * ctx, ggml_tensor * x) {
-    WHISPER_ASSERT(ggml_n_dims(x) == 2);
-
-    int64_t N = x->ne[0];
-    int64_t M = x->ne[1];
-    struct ggml_tensor * cost = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, N + 1, M + 1);
-    struct ggml_tensor * trace = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, N + 1, M + 1);
-
-    cost = ggml_set_f32(cost, INFINITY);
-    trace = ggml_set_f32(trace, -1);
-    ggml_set_f32_nd(cost, 0, 0, 0, 0, 0.0);
-
-    // dtw
-    // supposedly can be optmized by computing diagonals in parallel ?
-    // Not sure it is worth it since x will be GENERATED_TOKENS*1500 size at most.
-    for (int64_t j = 1; j < M + 1; ++j) {
-        for (int64_t i = 1; i < N + 1; ++i) {
-            float c0 = ggml_get_f32_nd(cost, i - 1, j - 1, 0, 0);
-            float c1 = ggml_get_f32_nd(cost, i - 1, j, 0, 0);
-            float c2 = ggml_get_f32_nd(cost, i, j - 1, 0, 0);
-
-            float c;
-            int32_t t;
-            if (c0 < c1 && c0 < c2) {
-                c = c0;
-                t = 0;
-            } else if (c1 < c0 && c1 < c2) {
-                c = c1;
-                t = 1;
-            } else {
-                c = c2;
-                t = 2;
-            }
+// x is the N x M cost matrix (N tokens, M audio frames), element (i, j) is at x[j*ld + i]
+// returns the path as (token index, frame index) pairs
+static std::vector<std::pair<int32_t, int32_t>> dtw_and_backtrace(const float * x, int64_t N, int64_t M, int64_t ld) {
+    // the cells on the anti-diagonal d = i + j depend only on the two previous anti-diagonals, so the cost
+    // matrix is evaluated as a wavefront: there is no dependency between the iterations of the inner loop and
+    // only three diagonals of the cost are kept
+    // cost_d*[i] is the cost of cell (i, d - i), trace[d*(N + 1) + i] is the step taken to reach it
+    std::vector<float> cost_d2(N + 1, INFINITY);
+    std::vector<float> cost_d1(N + 1, INFINITY);
+    std::vector<float> cost_d0(N + 1, INFINITY);
+
+    std::vector<int8_t> trace((N + M + 1)*(N + 1));
+
+    cost_d2[0] = 0.0f; // d = 0
+
+    for (int64_t d = 2; d <= N + M; ++d) {
+        const int64_t i0 = std::max<int64_t>(1, d - M);
+        const int64_t i1 = std::min<int64_t>(N, d - 1);
 
-            c = ggml_get_f32_nd(x, i - 1, j - 1, 0, 0) + c;
-            ggml_set_f32_nd(cost, i, j, 0, 0, c);
-            ggml_set_i32_nd(trace, i, j, 0, 0, t);
+        // cells (0, d) and (d, 0) are on the border
+        cost_d0[0] = INFINITY;
+        if (d <= N) {
+            cost_d0[d] = INFINITY;
         }
+
+        const float  * c_d2 = cost_d2.data();
+        const float  * c_d1 = cost_d1.data();
+              float  * c_d0 = cost_d0.data();
+              int8_t * t_d0 = trace.data() + d*(N + 1);
+
+        for (int64_t i = i0; i <= i1; ++i) {
+            const float c0 = c_d2[i - 1]; // (i - 1, j - 1)
+            const float c1 = c_d1[i - 1]; // (i - 1, j)
+            const float c2 = c_d1[i];     // (i, j - 1)
+
+            const bool b0 = c0 < c1 && c0 < c2;
+            const bool b1 = c1 < c0 && c1 < c2;
+
+            c_d0[i] = x[(d - i - 1)*ld + (i - 1)] + (b0 ? c0 : b1 ? c1 : c2);
+            t_d0[i] = b0 ? 0 : b1 ? 1 : 2;
+        }
+
+        std::swap(cost_d2, cost_d1);
+        std::swap(cost_d1, cost_d0);
     }
 
-    // Backtrace
-    const int64_t BT_MAX_ROWS = N + M - 1;
-    struct ggml_tensor * bt = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, BT_MAX_ROWS, 2);
-    // trace[0, :] = 2;
-    for (int64_t i = 0; i < M + 1; ++i)
-        ggml_set_i32_nd(trace, 0, i, 0, 0, 2);
-    //trace[:, 0] = 1;
-    for (int64_t i = 0; i < N + 1; ++i)
-        ggml_set_i32_nd(trace, i, 0, 0, 0, 1);
-    int bt_row_idx = BT_MAX_ROWS - 1;
+    // backtrace
+    std::vector<std::pair<int32_t, int32_t>> path;
+    path.reserve(N + M);
+
     int64_t i = N;
     int64_t j = M;
     while (i > 0 || j > 0) {
-        ggml_set_i32_nd(bt, bt_row_idx, 0, 0, 0, i - 1);
-        ggml_set_i32_nd(bt, bt_row_idx, 1, 0, 0, j - 1);
-        --bt_row_idx;
+        path.emplace_back(i - 1, j - 1);
 
-        int32_t t = ggml_get_i32_nd(trace, i, j, 0, 0);
+        // trace[0, :] = 2, trace[:, 0] = 1
+        const int8_t t = i == 0 ? 2 : j == 0 ? 1 : trace[(i + j)*(N + 1) + i];
         if (t == 0) {
             --i;
             --j;
@@ -7199,58 +9649,74 @@ static ggml_tensor * dtw_and_backtrace(ggml_context * ctx, ggml_tensor * x) {
         }
     }
 
-    // FIXME: manual clip/transpose might not be the most efficient way? (e.g. use ggml funcs)
-    // Clip + transpose
-    // This might not be entirely necessary for our case, but leaving it for now so output matrix
-    // is identical to dtw on openAI timing.py
-    const int64_t result_n_cols = BT_MAX_ROWS-bt_row_idx-1;
-    ggml_tensor * r = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, 2, result_n_cols);
-    for (int64_t i = 0; i < 2; ++i) {
-        for (int64_t j = 0; j < result_n_cols; ++j) {
-            int32_t v = ggml_get_i32_nd(bt, j+bt_row_idx+1, i, 0, 0);
-            ggml_set_i32_nd(r, i, j, 0, 0, v);
-        }
-    }
+    std::reverse(path.begin(), path.end());
 
-    return r;
+    return path;
 }
 
 struct median_filter_user_data {
     int filter_width;
 };
 
+// median filter over dim 2 of a, with "reflect" padding
+// the rows are split between the threads - the medians of a row are computed with a sorting network over
+// filter_width shifted copies of the row, so that each compare-exchange is a vectorizable min/max over the row
 static void median_filter(struct ggml_tensor * dst , const struct ggml_tensor * a, int ith, int nth, void * userdata) {
-    if (ith != 0) {
-        return;
-    }
     int filter_width = ((median_filter_user_data *) userdata)->filter_width;
     WHISPER_ASSERT(filter_width < a->ne[2]);
     WHISPER_ASSERT(filter_width % 2);
     WHISPER_ASSERT(ggml_n_dims(a) == 3);
     WHISPER_ASSERT(a->type == GGML_TYPE_F32);
 
-    std::vector<float> filter;
-    filter.reserve(filter_width);
-    for (int64_t i = 0; i < a->ne[0]; ++i) {
-        for (int64_t j = 0; j < a->ne[1]; ++j) {
-            for (int64_t k = 0; k < a->ne[2]; ++k) {
-                for (int64_t off = -filter_width/2; off <= filter_width/2; ++off) {
-                    // "reflect" padding
-                    int64_t idx = k + off;
-                    if (idx < 0) {
-                        idx = -idx;
-                    } else if (idx >= a->ne[2]) {
-                        idx = 2*(a->ne[2] - 1) - idx;
-                    }
+    const int64_t n    = a->ne[2];
+    const int     half = filter_width/2;
+
+    const int64_t nr  = a->ne[0]*a->ne[1];
+    const int64_t dr  = (nr + nth - 1)/nth;
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = std::min(ir0 + dr, nr);
+
+    std::vector<float> padded(n + 2*half);
+    std::vector<float> rows(filter_width*n);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i = ir % a->ne[0];
+        const int64_t j = ir / a->ne[0];
+
+        const char * src = (const char *)   a->data + i*a->nb[0]   + j*a->nb[1];
+              char * out = (char *)       dst->data + i*dst->nb[0] + j*dst->nb[1];
 
-                    filter.push_back(ggml_get_f32_nd(a, i, j, idx, 0));
+        for (int64_t k = 0; k < n; ++k) {
+            padded[half + k] = *(const float *) (src + k*a->nb[2]);
+        }
+        for (int m = 1; m <= half; ++m) {
+            padded[half - m]         = padded[half + m];
+            padded[half + n - 1 + m] = padded[half + n - 1 - m];
+        }
+
+        // rows[o][k] = padded[k + o] - the values in the window of output k
+        for (int o = 0; o < filter_width; ++o) {
+            memcpy(rows.data() + o*n, padded.data() + o, n*sizeof(float));
+        }
+
+        // odd-even transposition sort of the windows
+        for (int p = 0; p < filter_width; ++p) {
+            for (int r = p % 2; r + 1 < filter_width; r += 2) {
+                float * x = rows.data() + r*n;
+                float * y = x + n;
+                for (int64_t k = 0; k < n; ++k) {
+                    const float lo = std::min(x[k], y[k]);
+                    const float hi = std::max(x[k], y[k]);
+                    x[k] = lo;
+                    y[k] = hi;
                 }
-                std::sort(filter.begin(), filter.end());
-                const float v = filter[filter.size()/2];
-                ggml_set_f32_nd(dst, i, j, k, 0, v);
-                filter.clear();
             }
         }
+
+        const float * median = rows.data() + half*n;
+        for (int64_t k = 0; k < n; ++k) {
+            *(float *) (out + k*dst->nb[2]) = median[k];
+        }
     }
 }
 
@@ -7306,6 +9772,7 @@ static void whisper_exp_compute_token_level_timestamps_dtw(
     // Decoder already returns only alignment head QKs, already concatenated in
     // one tensor.
     whisper_kv_cache_clear(state->kv_self);
+    state->prompt_cached.clear();
     whisper_batch_prep_legacy(state->batch, tokens.data(), tokens.size(), 0, 0);
     whisper_kv_cache_seq_rm(state->kv_self, 0, 0, -1);
     if (!whisper_decode_internal(*ctx, *state, state->batch, n_threads, true, nullptr, nullptr)) {
@@ -7324,20 +9791,13 @@ static void whisper_exp_compute_token_level_timestamps_dtw(
     // tokens (i.e. discarding rows at the end of tensor)
     // IN: Tensor with N_TOKENS*audio_ctx*N_ALIGNMENT_HEADS dims
     // OUT: Tensor with N_TOKENS*N_AUDIO_TOKENS*N_ALIGNMENT_HEADS dims
+    // The used rows of each head are contiguous, so they are read directly into the local tensor
     WHISPER_ASSERT(state->aheads_cross_QKs->type == GGML_TYPE_F32);
     WHISPER_ASSERT(ggml_is_contiguous(state->aheads_cross_QKs));
     ggml_tensor * w = ggml_new_tensor_3d(gctx, GGML_TYPE_F32, n_tokens, n_audio_tokens, n_heads);
-    auto & data = state->aheads_cross_QKs_data;
-    data.resize(n_tokens * n_audio_ctx * n_heads);
-    ggml_backend_tensor_get(state->aheads_cross_QKs, data.data(), 0, sizeof(float) * n_tokens * n_audio_ctx * n_heads);
     for (int k = 0; k < n_heads; ++k) {
-        for (int j = 0; j < n_audio_tokens; ++j) {
-            memcpy(
-                (char *) w->data + j * w->nb[1] + k * w->nb[2],
-                data.data() + j * n_tokens + k * n_tokens * n_audio_ctx,
-                n_tokens * sizeof(float)
-            );
-        }
+        ggml_backend_tensor_get(state->aheads_cross_QKs, (char *) w->data + k * w->nb[2],
+                sizeof(float) * k * n_tokens * n_audio_ctx, sizeof(float) * n_tokens * n_audio_tokens);
     }
 
     // Normalize - in original OpenAI code, this is done over dim=-2. In this case,
@@ -7353,7 +9813,7 @@ static void whisper_exp_compute_token_level_timestamps_dtw(
     // IN: Tensor with N_ALIGNMENT_HEADS*N_TOKENS*N_AUDIO_TOKENS dims
     // OUT: Same dims
     median_filter_user_data mf_user_data = {medfilt_width};
-    w = ggml_map_custom1(gctx, w, median_filter, 1, &mf_user_data);
+    w = ggml_map_custom1(gctx, w, median_filter, GGML_N_TASKS_MAX, &mf_user_data);
 
     // Take mean over columns, scale by -1, reshape to 2D tensor, remove SOT sequence and EOT
     // IN: Tensor with N_ALIGNMENT_HEADS*N_TOKENS*N_AUDIO_TOKENS dims
@@ -7371,16 +9831,16 @@ static void whisper_exp_compute_token_level_timestamps_dtw(
     ggml_build_forward_expand(gf, w);
     ggml_graph_compute_with_ctx(gctx, gf, n_threads);
 
-    ggml_tensor * alignment = dtw_and_backtrace(gctx, w);
+    const auto alignment = dtw_and_backtrace((const float *) w->data, w->ne[0], w->ne[1], w->nb[1]/sizeof(float));
 
     // Place timestamps on segments
     int32_t last_v = 0;
     auto seg_i = state->result_all.begin() + i_segment;
     auto tok_i = seg_i->tokens.begin();
-    for (int i = 0; i < alignment->ne[1]; ++i) {
-        int32_t v = ggml_get_i32_nd(alignment, 0, i, 0, 0);
+    for (size_t i = 0; i < alignment.size(); ++i) {
+        int32_t v = alignment[i].first;
         if (v != last_v) {
-            int32_t time_index = ggml_get_i32_nd(alignment, 1, i, 0, 0);
+            int32_t time_index = alignment[i].second;
             int64_t timestamp = (time_index * 2) + seek; // Each index on DTW result = 20mS audio
             last_v = v;
 
@@ -79,6 +79,10 @@ static void init_tensor_uniform(ggml_tensor * tensor, float min = -1.0f, float m
                 im = nullptr;
             }
         }
+        if (ggml_internal_get_type_traits(tensor->type).blck_size_interleave > 0) {
+            // the interleaved layouts do not support an importance matrix
+            im = nullptr;
+        }
         ggml_quantize_chunk(tensor->type, data.data(), dataq.data(), 0, size/tensor->ne[0], tensor->ne[0], im);
         GGML_ASSERT(ggml_validate_row_data(tensor->type, dataq.data(), dataq.size()));
         ggml_backend_tensor_set(tensor, dataq.data(), 0, dataq.size());
@@ -325,6 +329,9 @@ struct test_case {
 
     ggml_cgraph * gf = nullptr;
 
+    // optional reference for the output of build_graph, computed with other ops in the same graph
+    ggml_tensor * out_ref = nullptr;
+
     static const int sentinel_size = 1024;
 
     test_mode mode;
@@ -387,6 +394,8 @@ struct test_case {
         // pre-graph sentinel
         add_sentinel(ctx);
 
+        out_ref = nullptr;
+
         ggml_tensor * out = build_graph(ctx);
 
         if (op_name != nullptr && op_desc(out) != op_name) {
@@ -428,6 +437,9 @@ struct test_case {
 
         // build graph
         ggml_build_forward_expand(gf, out);
+        if (out_ref) {
+            ggml_build_forward_expand(gf, out_ref);
+        }
 
         // add sentinels as graph nodes so that they are checked in the callback
         for (ggml_tensor * sentinel : sentinels) {
@@ -518,6 +530,18 @@ struct test_case {
             printf("compare failed ");
         }
 
+        // the output must also match its reference
+        if (out_ref && ud.ok && cmp_ok) {
+            std::vector<float> f_out = tensor_to_float(out);
+            std::vector<float> f_ref = tensor_to_float(out_ref);
+
+            double err = nmse(f_ref.data(), f_out.data(), f_out.size());
+            if (err > ud.max_err) {
+                printf("[%s] NMSE to the reference = %.9f > %.9f ", op_desc(out).c_str(), err, ud.max_err);
+                ud.ok = false;
+            }
+        }
+
         ggml_backend_buffer_free(buf);
 
         ggml_free(ctx);
@@ -1292,6 +1316,52 @@ struct test_conv_transpose_1d : public test_case {
     }
 };
 
+// GGML_OP_CONV_1D
+struct test_conv_1d_fused : public test_case {
+    const std::array<int64_t, 4> ne_input;
+    const std::array<int64_t, 4> ne_kernel;
+    const int s0; // stride
+    const int p0; // padding
+    const int d0; // dilation
+    const bool bias;
+    const bool gelu;
+
+    std::string vars() override {
+        return VARS_TO_STR7(ne_input, ne_kernel, s0, p0, d0, bias, gelu);
+    }
+
+    double max_nmse_err() override {
+        return 5e-4;
+    }
+
+    test_conv_1d_fused(std::array<int64_t, 4> ne_input = {197, 32, 1, 1}, // [input_width, input_channels, batch, 1]
+            std::array<int64_t, 4> ne_kernel = {3, 32, 16, 1},             // [kernel_width, input_channels, output_channels, 1]
+            int s0 = 1, int p0 = 1, int d0 = 1,
+            bool bias = true, bool gelu = true)
+        : ne_input(ne_input), ne_kernel(ne_kernel), s0(s0), p0(p0), d0(d0), bias(bias), gelu(gelu) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * input  = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne_input.data());
+        ggml_tensor * kernel = ggml_new_tensor(ctx, GGML_TYPE_F16, 4, ne_kernel.data());
+        ggml_tensor * b      = bias ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, ne_kernel[2]) : nullptr;
+
+        ggml_tensor * out = ggml_conv_1d_fused(ctx, kernel, input, b, s0, p0, d0, gelu);
+
+        // im2col + mul_mat - with more than one batch, ggml_conv_1d returns the data of [N, OC, OL] ordered as [OC, N, OL]
+        out_ref = ggml_conv_1d(ctx, kernel, input, s0, p0, d0);
+        out_ref = ggml_reshape_3d(ctx, out_ref, out->ne[0], out->ne[2], out->ne[1]);
+        out_ref = ggml_cont(ctx, ggml_permute(ctx, out_ref, 0, 2, 1, 3));
+        if (bias) {
+            out_ref = ggml_add(ctx, out_ref, b);
+        }
+        if (gelu) {
+            out_ref = ggml_gelu(ctx, out_ref);
+        }
+
+        return out;
+    }
+};
+
 // GGML_OP_IM2COL
 struct test_im2col : public test_case {
     const ggml_type type_input;
@@ -2124,6 +2194,12 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
     test_cases.emplace_back(new test_im2col(GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_F32));
     test_cases.emplace_back(new test_im2col(GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_F16));
 
+    test_cases.emplace_back(new test_conv_1d_fused());
+    test_cases.emplace_back(new test_conv_1d_fused({197, 32, 2, 1}, {3, 32, 16, 1}, 2, 1, 1, true,  true));
+    test_cases.emplace_back(new test_conv_1d_fused({197, 32, 1, 1}, {3, 32, 16, 1}, 1, 1, 1, false, false));
+    test_cases.emplace_back(new test_conv_1d_fused({197, 32, 1, 1}, {5, 32, 16, 1}, 1, 4, 2, true,  false));
+    test_cases.emplace_back(new test_conv_1d_fused({ 50, 80, 1, 1}, {3, 80, 64, 1}, 1, 1, 1, true,  true));
+
     test_cases.emplace_back(new test_conv_transpose_1d());
     test_cases.emplace_back(new test_conv_transpose_1d({3,2,1,1}, {2,3,2,1}, 3, 0, 1));
     test_cases.emplace_back(new test_conv_transpose_1d({3,2,1,1}, {2,3,2,1}, 2, 0, 1));
@@ -2227,6 +2303,20 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
         }
     }
 
+    // the interleaved Q4_0 layout of the CPU, if any (mat-vec and mat-mul kernels, with leftover rows)
+    {
+        ggml_init_params params = { ggml_tensor_overhead(), NULL, true };
+        ggml_context * ctx = ggml_init(params);
+        const ggml_type type_a = ggml_repack_get_optimal_type(ggml_new_tensor_2d(ctx, GGML_TYPE_Q4_0, 256, 16));
+        ggml_free(ctx);
+
+        if (type_a != GGML_TYPE_Q4_0) {
+            for (int n : {1, 4, 7, 32}) {
+                test_cases.emplace_back(new test_mul_mat(type_a, GGML_TYPE_F32, 16, n, 256, { 1,  1}, {1, 1}));
+            }
+        }
+    }
+
     test_cases.emplace_back(new test_mul_mat(GGML_TYPE_F16, GGML_TYPE_F32,  64, 2,  128, { 8,  1}, {1, 1}));
     test_cases.emplace_back(new test_mul_mat(GGML_TYPE_F16, GGML_TYPE_F32,  83, 2,  128, { 8,  1}, {4, 1}));
     test_cases.emplace_back(new test_mul_mat(GGML_TYPE_F16, GGML_TYPE_F32,  64, 2,   64, { 8,  1}, {4, 1}));
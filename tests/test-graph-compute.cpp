@@ -0,0 +1,530 @@
+// checks how the CPU computes whole graphs: the phases of independent nodes that run without a barrier in between
+// and the fused nodes, compared with the same graph computed one node at a time (no phases, no fusion)
+// and the CPU kernels that split their rows across the threads, compared with the unsplit computation
+
+#include "ggml.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+constexpr float MAX_NMSE = 1e-9f;
+constexpr float MAX_NMSE_FLASH_ATTN_F16  = 1e-7f; // Q is converted to the vec_dot type of K
+constexpr float MAX_NMSE_FLASH_ATTN_Q8_0 = 2e-5f;
+
+static void init_tensor_uniform(ggml_tensor * tensor, float min = -1.0f, float max = 1.0f) {
+    const int64_t n = ggml_nelements(tensor);
+
+    std::vector<float> data(n);
+    for (int64_t i = 0; i < n; i++) {
+        data[i] = min + (max - min)*((float) rand()/(float) RAND_MAX);
+    }
+
+    if (tensor->type == GGML_TYPE_F32) {
+        memcpy(tensor->data, data.data(), n*sizeof(float));
+    } else {
+        ggml_quantize_chunk(tensor->type, data.data(), tensor->data, 0, n/tensor->ne[0], tensor->ne[0], nullptr);
+    }
+}
+
+static ggml_tensor * new_input(ggml_context * ctx, int64_t ne0, int64_t ne1 = 1, int64_t ne2 = 1, int64_t ne3 = 1) {
+    ggml_tensor * t = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, ne0, ne1, ne2, ne3);
+    init_tensor_uniform(t);
+    return t;
+}
+
+static int node_index(const ggml_cgraph * gf, const ggml_tensor * node) {
+    for (int i = 0; i < gf->n_nodes; i++) {
+        if (gf->nodes[i] == node) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static std::vector<float> tensor_to_float(const ggml_tensor * tensor) {
+    GGML_ASSERT(tensor->type == GGML_TYPE_F32);
+
+    std::vector<float> res;
+    for (int64_t i3 = 0; i3 < tensor->ne[3]; i3++) {
+        for (int64_t i2 = 0; i2 < tensor->ne[2]; i2++) {
+            for (int64_t i1 = 0; i1 < tensor->ne[1]; i1++) {
+                for (int64_t i0 = 0; i0 < tensor->ne[0]; i0++) {
+                    const char * p = (const char *) tensor->data + i0*tensor->nb[0] + i1*tensor->nb[1] + i2*tensor->nb[2] + i3*tensor->nb[3];
+                    res.push_back(*(const float *) p);
+                }
+            }
+        }
+    }
+
+    return res;
+}
+
+// normalized mean squared error = mse(a, b) / mse(a, 0)
+static double nmse(const std::vector<float> & a, const std::vector<float> & b) {
+    double mse_a_b = 0.0;
+    double mse_a_0 = 0.0;
+
+    for (size_t i = 0; i < a.size(); i++) {
+        mse_a_b += (a[i] - b[i]) * (a[i] - b[i]);
+        mse_a_0 += a[i] * a[i];
+    }
+
+    return mse_a_b / mse_a_0;
+}
+
+// compute the graph with n_threads, then again one node at a time from the same inputs, and compare the results of all nodes
+static bool check_graph(ggml_context * ctx, ggml_cgraph * gf, int n_threads, const char * name) {
+    // in-place nodes may overwrite the inputs
+    std::vector<std::vector<uint8_t>> leafs(gf->n_leafs);
+    for (int i = 0; i < gf->n_leafs; i++) {
+        const uint8_t * data = (const uint8_t *) gf->leafs[i]->data;
+        leafs[i].assign(data, data + ggml_nbytes(gf->leafs[i]));
+    }
+
+    ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+
+    const int n_nodes = gf->n_nodes;
+
+    std::vector<std::vector<float>> out(n_nodes);
+    for (int i = 0; i < n_nodes; i++) {
+        out[i] = tensor_to_float(gf->nodes[i]);
+    }
+
+    for (int i = 0; i < gf->n_leafs; i++) {
+        memcpy(gf->leafs[i]->data, leafs[i].data(), leafs[i].size());
+    }
+
+    for (int i = 0; i < n_nodes; i++) {
+        ggml_cgraph gv = ggml_graph_view(gf, i, i + 1);
+        ggml_graph_compute_with_ctx(ctx, &gv, n_threads);
+    }
+
+    bool ok = true;
+
+    for (int i = 0; i < n_nodes; i++) {
+        const ggml_tensor * node = gf->nodes[i];
+
+        const double err = nmse(tensor_to_float(node), out[i]);
+        if (!(err <= MAX_NMSE)) {
+            printf("  %s: node %d (%s) differs from the node computed alone, NMSE = %g\n", name, i, ggml_op_desc(node), err);
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+// the Q, K and V projections of an attention layer only read the normalized input, so they are computed in one phase
+// the quantized weights make each mat-mul convert the input into its own part of the work buffer
+static bool test_qkv_one_phase(ggml_type type, int n_threads) {
+    const int64_t n_embd   = 256;
+    const int64_t n_embd_k = 128;
+    const int64_t n_tokens = 7;
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ 16*1024*1024,
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * inp  = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_tokens);
+    ggml_tensor * norm = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+    ggml_tensor * wq   = ggml_new_tensor_2d(ctx, type, n_embd, n_embd);
+    ggml_tensor * wk   = ggml_new_tensor_2d(ctx, type, n_embd, n_embd_k);
+    ggml_tensor * wv   = ggml_new_tensor_2d(ctx, type, n_embd, n_embd_k);
+
+    for (ggml_tensor * t : { inp, norm, wq, wk, wv }) {
+        init_tensor_uniform(t);
+    }
+
+    ggml_tensor * cur = ggml_mul(ctx, ggml_rms_norm(ctx, inp, 1e-6f), norm);
+
+    ggml_tensor * q = ggml_mul_mat(ctx, wq, cur);
+    ggml_tensor * k = ggml_mul_mat(ctx, wk, cur);
+    ggml_tensor * v = ggml_mul_mat(ctx, wv, cur);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, q);
+    ggml_build_forward_expand(gf, k);
+    ggml_build_forward_expand(gf, v);
+
+    const int n_nodes = gf->n_nodes;
+
+    std::vector<int> phase(n_nodes);
+    std::vector<int> group(n_nodes);
+
+    const int n_phases = ggml_graph_get_schedule(gf, n_threads, phase.data(), group.data());
+
+    const int i_q = node_index(gf, q);
+    const int i_k = node_index(gf, k);
+    const int i_v = node_index(gf, v);
+
+    bool ok = true;
+
+    if (phase[i_q] != phase[i_k] || phase[i_q] != phase[i_v]) {
+        printf("  %s: Q, K and V are computed in the phases %d, %d and %d of %d\n", __func__, phase[i_q], phase[i_k], phase[i_v], n_phases);
+        ok = false;
+    }
+
+    ok = check_graph(ctx, gf, n_threads, __func__) && ok;
+
+    printf("%s(type=%s, n_threads=%d): %s\n", __func__, ggml_type_name(type), n_threads, ok ? "OK" : "FAILED");
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+// a pattern that the CPU may compute in a single pass: the graph, its first node and the node that it is computed with
+typedef void (*build_fusion_t)(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor ** first, ggml_tensor ** last);
+
+static const int64_t ne_fusion[4] = { 64, 10, 3, 2 };
+
+static ggml_tensor * new_fusion_input(ggml_context * ctx) {
+    return new_input(ctx, ne_fusion[0], ne_fusion[1], ne_fusion[2], ne_fusion[3]);
+}
+
+static void build_rms_norm_mul(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor ** first, ggml_tensor ** last) {
+    *first = ggml_rms_norm(ctx, new_fusion_input(ctx), 1e-6f);
+    *last  = ggml_mul(ctx, *first, new_input(ctx, ne_fusion[0]));
+    ggml_build_forward_expand(gf, *last);
+}
+
+// the weight is repeated along the rows
+static void build_rms_norm_mul_repeat(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor ** first, ggml_tensor ** last) {
+    *first = ggml_rms_norm(ctx, new_fusion_input(ctx), 1e-5f);
+    *last  = ggml_mul(ctx, *first, new_input(ctx, ne_fusion[0]/4, ne_fusion[1]));
+    ggml_build_forward_expand(gf, *last);
+}
+
+static void build_add_rms_norm_mul(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor ** first, ggml_tensor ** last) {
+    *first = ggml_add(ctx, new_fusion_input(ctx), new_input(ctx, ne_fusion[0], 1, ne_fusion[2]));
+    *last  = ggml_mul(ctx, ggml_rms_norm(ctx, *first, 1e-6f), new_input(ctx, ne_fusion[0], ne_fusion[1]));
+    ggml_build_forward_expand(gf, *last);
+}
+
+// the residual is added in place
+static void build_add_rms_norm_mul_inplace(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor ** first, ggml_tensor ** last) {
+    *first = ggml_add_inplace(ctx, new_fusion_input(ctx), new_fusion_input(ctx));
+    *last  = ggml_mul_inplace(ctx, ggml_rms_norm_inplace(ctx, *first, 1e-6f), new_input(ctx, ne_fusion[0]));
+    ggml_build_forward_expand(gf, *last);
+}
+
+// the rows of the weight are not contiguous
+static void build_rms_norm_mul_strided(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor ** first, ggml_tensor ** last) {
+    ggml_tensor * w = ggml_transpose(ctx, new_input(ctx, ne_fusion[1], ne_fusion[0]));
+    ggml_build_forward_expand(gf, w);
+
+    *first = ggml_rms_norm(ctx, new_fusion_input(ctx), 1e-6f);
+    *last  = ggml_mul(ctx, *first, w);
+    ggml_build_forward_expand(gf, *last);
+}
+
+// the broadcast weight is a row of the tensor that rms_norm overwrites, which other threads compute
+static void build_rms_norm_mul_overlap(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor ** first, ggml_tensor ** last) {
+    ggml_tensor * x = new_fusion_input(ctx);
+    ggml_tensor * w = ggml_view_1d(ctx, x, ne_fusion[0], 5*x->nb[1]);
+    ggml_build_forward_expand(gf, w);
+
+    *first = ggml_rms_norm_inplace(ctx, x, 1e-6f);
+    *last  = ggml_mul(ctx, *first, w);
+    ggml_build_forward_expand(gf, *last);
+}
+
+// the activation is moved over the up projection to the mul
+static void build_glu(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor ** first, ggml_tensor ** last, ggml_unary_op op) {
+    ggml_tensor * inp = new_input(ctx, 32, ne_fusion[1]*ne_fusion[2]*ne_fusion[3]);
+
+    ggml_tensor * gate = ggml_mul_mat(ctx, new_input(ctx, 32, ne_fusion[0]), inp);
+    ggml_tensor * up   = ggml_mul_mat(ctx, new_input(ctx, 32, ne_fusion[0]), inp);
+
+    *first = ggml_unary(ctx, gate, op);
+    ggml_build_forward_expand(gf, *first);
+
+    *last = ggml_mul(ctx, *first, up);
+    ggml_build_forward_expand(gf, *last);
+}
+
+static void build_glu_silu(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor ** first, ggml_tensor ** last) {
+    build_glu(ctx, gf, first, last, GGML_UNARY_OP_SILU);
+}
+
+static void build_glu_gelu(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor ** first, ggml_tensor ** last) {
+    build_glu(ctx, gf, first, last, GGML_UNARY_OP_GELU);
+}
+
+static void build_glu_repeat(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor ** first, ggml_tensor ** last) {
+    *first = ggml_silu(ctx, new_fusion_input(ctx));
+    ggml_build_forward_expand(gf, *first);
+
+    *last = ggml_mul(ctx, *first, new_input(ctx, ne_fusion[0], 1, ne_fusion[2]));
+    ggml_build_forward_expand(gf, *last);
+}
+
+static void build_glu_strided(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor ** first, ggml_tensor ** last) {
+    *first = ggml_silu(ctx, new_input(ctx, ne_fusion[0], ne_fusion[1]));
+    ggml_build_forward_expand(gf, *first);
+
+    *last = ggml_mul(ctx, *first, ggml_transpose(ctx, new_input(ctx, ne_fusion[1], ne_fusion[0])));
+    ggml_build_forward_expand(gf, *last);
+}
+
+// a node between the activation and the mul overwrites the input of the activation
+static void build_glu_overwritten(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor ** first, ggml_tensor ** last) {
+    ggml_tensor * x = new_fusion_input(ctx);
+
+    *first = ggml_silu(ctx, x);
+    ggml_build_forward_expand(gf, *first);
+    ggml_build_forward_expand(gf, ggml_scale_inplace(ctx, x, 2.0f));
+
+    *last = ggml_mul(ctx, *first, new_fusion_input(ctx));
+    ggml_build_forward_expand(gf, *last);
+}
+
+// the pattern is computed in a single pass only if fused is set, the results always match the unfused graph
+static bool test_fusion(const char * name, build_fusion_t build, bool fused, int n_threads) {
+    ggml_init_params params = {
+        /*.mem_size   =*/ 16*1024*1024,
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+    ggml_cgraph  * gf  = ggml_new_graph(ctx);
+
+    ggml_tensor * first = nullptr;
+    ggml_tensor * last  = nullptr;
+    build(ctx, gf, &first, &last);
+
+    std::vector<int> phase(gf->n_nodes);
+    std::vector<int> group(gf->n_nodes);
+    ggml_graph_get_schedule(gf, n_threads, phase.data(), group.data());
+
+    const int i_first = node_index(gf, first);
+    const int i_last  = node_index(gf, last);
+
+    bool ok = true;
+
+    if ((group[i_first] == i_last) != fused) {
+        printf("  %s: node %d is computed with node %d, expected %d\n", name, i_first, group[i_first], fused ? i_last : i_first);
+        ok = false;
+    }
+
+    ok = check_graph(ctx, gf, n_threads, name) && ok;
+
+    printf("test_fusion(%s, n_threads=%d): %s\n", name, n_threads, ok ? "OK" : "FAILED");
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+// flash attention against mul_mat + soft_max_ext + mul_mat on the same (dequantized) K and V
+// the tiles of q rows, the split of the K/V rows for few tiles (decode) and the merge of the partial results
+static bool test_flash_attn_ext(ggml_type type_kv, int64_t D, int64_t n_q, int64_t n_kv, int64_t n_head, int64_t n_head_kv,
+        bool mask, float max_bias, int n_threads) {
+    ggml_init_params params = {
+        /*.mem_size   =*/ 128*1024*1024,
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * q = new_input(ctx, D, n_q, n_head);
+    ggml_tensor * k = ggml_new_tensor_3d(ctx, type_kv, D, n_kv, n_head_kv);
+    ggml_tensor * v = ggml_new_tensor_3d(ctx, type_kv, D, n_kv, n_head_kv);
+
+    init_tensor_uniform(k);
+    init_tensor_uniform(v);
+
+    ggml_tensor * k_f32 = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, D, n_kv, n_head_kv);
+    ggml_tensor * v_f32 = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, D, n_kv, n_head_kv);
+
+    ggml_internal_get_type_traits(type_kv).to_float(k->data, (float *) k_f32->data, ggml_nelements(k));
+    ggml_internal_get_type_traits(type_kv).to_float(v->data, (float *) v_f32->data, ggml_nelements(v));
+
+    ggml_tensor * m = nullptr;
+    if (mask) {
+        m = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_kv, GGML_PAD(n_q, GGML_KQ_MASK_PAD));
+
+        ggml_fp16_t * data = (ggml_fp16_t *) m->data;
+        for (int64_t i = 0; i < ggml_nelements(m); i++) {
+            data[i] = ggml_fp32_to_fp16(i % 7 == 3 ? -INFINITY : -(float) rand()/(float) RAND_MAX);
+        }
+    }
+
+    const float scale = 1.0f/sqrtf((float) D);
+
+    ggml_tensor * out = ggml_flash_attn_ext(ctx, q, k, v, m, scale, max_bias);
+
+    ggml_tensor * kq  = ggml_soft_max_ext(ctx, ggml_mul_mat(ctx, k_f32, q), m, scale, max_bias);
+    ggml_tensor * kqv = ggml_mul_mat(ctx, ggml_cont(ctx, ggml_transpose(ctx, v_f32)), kq);
+    ggml_tensor * ref = ggml_permute(ctx, kqv, 0, 2, 1, 3); // same layout as the result of flash attention
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+    ggml_build_forward_expand(gf, ref);
+
+    ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+
+    const double err = nmse(tensor_to_float(ref), tensor_to_float(out));
+    const bool   ok  = err <= (type_kv == GGML_TYPE_F16 ? MAX_NMSE_FLASH_ATTN_F16 : MAX_NMSE_FLASH_ATTN_Q8_0);
+
+    printf("%s(type_kv=%s, D=%d, n_q=%d, n_kv=%d, n_head=%d, n_head_kv=%d, mask=%d, max_bias=%g, n_threads=%d): %s",
+            __func__, ggml_type_name(type_kv), (int) D, (int) n_q, (int) n_kv, (int) n_head, (int) n_head_kv, mask, max_bias, n_threads,
+            ok ? "OK\n" : "FAILED");
+    if (!ok) {
+        printf(" (NMSE = %g)\n", err);
+    }
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+// kernels that split a row across the threads when there are fewer rows than threads:
+// the result with n_threads must match the one of a single thread
+typedef ggml_tensor * (*build_split_t)(ggml_context * ctx);
+
+static ggml_tensor * new_mask(ggml_context * ctx, ggml_type type, int64_t ne0, int64_t ne1) {
+    ggml_tensor * m = ggml_new_tensor_2d(ctx, type, ne0, ne1);
+
+    for (int64_t i = 0; i < ggml_nelements(m); i++) {
+        const float x = i % 7 == 3 ? -INFINITY : -(float) rand()/(float) RAND_MAX;
+        if (type == GGML_TYPE_F16) {
+            ((ggml_fp16_t *) m->data)[i] = ggml_fp32_to_fp16(x);
+        } else {
+            ((float *) m->data)[i] = x;
+        }
+    }
+
+    return m;
+}
+
+static ggml_tensor * build_soft_max_4096(ggml_context * ctx) {
+    ggml_tensor * a = new_input(ctx, 4096, 1, 2);
+    return ggml_soft_max_ext(ctx, a, new_mask(ctx, GGML_TYPE_F16, 4096, 1), 0.125f, 8.0f);
+}
+
+static ggml_tensor * build_soft_max_8192(ggml_context * ctx) {
+    ggml_tensor * a = new_input(ctx, 8192);
+    return ggml_soft_max_ext(ctx, a, new_mask(ctx, GGML_TYPE_F16, 8192, 1), 0.125f, 8.0f);
+}
+
+static ggml_tensor * build_soft_max_alibi(ggml_context * ctx) {
+    ggml_tensor * a = new_input(ctx, 16484, 1, 3); // one row per head, each with its own slope
+    return ggml_soft_max_ext(ctx, a, new_mask(ctx, GGML_TYPE_F32, 16484, 1), 0.125f, 8.0f);
+}
+
+static ggml_tensor * build_soft_max_rows(ggml_context * ctx) {
+    ggml_tensor * a = new_input(ctx, 20000, 2);
+    return ggml_soft_max_ext(ctx, a, new_mask(ctx, GGML_TYPE_F16, 20000, 2), 0.25f, 4.0f);
+}
+
+static ggml_tensor * build_flash_attn_ext_gcd(ggml_context * ctx) {
+    // N=1 with 2 heads: 2 tiles, the K/V rows of each are split into nth/gcd(2, nth) chunks
+    ggml_tensor * q = new_input(ctx, 64, 1, 2);
+    ggml_tensor * k = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, 64, 4096, 2);
+    ggml_tensor * v = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, 64, 4096, 2);
+
+    init_tensor_uniform(k);
+    init_tensor_uniform(v);
+
+    ggml_tensor * m = new_mask(ctx, GGML_TYPE_F16, 4096, GGML_KQ_MASK_PAD);
+
+    return ggml_flash_attn_ext(ctx, q, k, v, m, 0.125f, 8.0f);
+}
+
+static bool test_split(const char * name, build_split_t build, int n_threads) {
+    ggml_init_params params = {
+        /*.mem_size   =*/ 64*1024*1024,
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * out = build(ctx);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+
+    ggml_graph_compute_with_ctx(ctx, gf, 1);
+    const std::vector<float> expected = tensor_to_float(out);
+
+    ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+
+    const double err = nmse(expected, tensor_to_float(out));
+    const bool   ok  = err <= MAX_NMSE;
+
+    printf("%s(%s, n_threads=%d): %s", __func__, name, n_threads, ok ? "OK\n" : "FAILED");
+    if (!ok) {
+        printf(" (NMSE = %g)\n", err);
+    }
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    srand(0);
+
+    bool ok = true;
+
+    for (int n_threads : { 2, 4 }) {
+        ok = test_qkv_one_phase(GGML_TYPE_F32,  n_threads) && ok;
+        ok = test_qkv_one_phase(GGML_TYPE_F16,  n_threads) && ok;
+        ok = test_qkv_one_phase(GGML_TYPE_Q4_0, n_threads) && ok;
+        ok = test_qkv_one_phase(GGML_TYPE_Q8_0, n_threads) && ok;
+    }
+
+    for (int n_threads : { 1, 2, 4 }) {
+        ok = test_fusion("rms_norm_mul",             build_rms_norm_mul,             true,  n_threads) && ok;
+        ok = test_fusion("rms_norm_mul_repeat",      build_rms_norm_mul_repeat,      true,  n_threads) && ok;
+        ok = test_fusion("add_rms_norm_mul",         build_add_rms_norm_mul,         true,  n_threads) && ok;
+        ok = test_fusion("add_rms_norm_mul_inplace", build_add_rms_norm_mul_inplace, true,  n_threads) && ok;
+        ok = test_fusion("rms_norm_mul_strided",     build_rms_norm_mul_strided,     false, n_threads) && ok;
+        ok = test_fusion("rms_norm_mul_overlap",     build_rms_norm_mul_overlap,     false, n_threads) && ok;
+        ok = test_fusion("glu_silu",                 build_glu_silu,                 true,  n_threads) && ok;
+        ok = test_fusion("glu_gelu",                 build_glu_gelu,                 true,  n_threads) && ok;
+        ok = test_fusion("glu_repeat",               build_glu_repeat,               true,  n_threads) && ok;
+        ok = test_fusion("glu_strided",              build_glu_strided,              false, n_threads) && ok;
+        ok = test_fusion("glu_overwritten",          build_glu_overwritten,          false, n_threads) && ok;
+    }
+
+    for (ggml_type type_kv : { GGML_TYPE_F16, GGML_TYPE_Q8_0 }) {
+        for (int n_threads : { 1, 2, 3, 4, 8 }) {
+            // single-token decode with a long KV: few tiles, the K/V rows are split across the threads
+            ok = test_flash_attn_ext(type_kv, 64,  1, 4096, 2, 2, true,  0.0f, n_threads) && ok;
+            ok = test_flash_attn_ext(type_kv, 64,  1, 4096, 8, 2, true,  0.0f, n_threads) && ok; // GQA
+            ok = test_flash_attn_ext(type_kv, 64,  1, 1000, 4, 4, false, 0.0f, n_threads) && ok;
+            // tiles that do not divide the q rows of a group
+            ok = test_flash_attn_ext(type_kv, 64, 11,  256, 4, 4, true,  0.0f, n_threads) && ok;
+            ok = test_flash_attn_ext(type_kv, 64, 13,  300, 8, 2, true,  0.0f, n_threads) && ok; // GQA
+            // ALiBi
+            ok = test_flash_attn_ext(type_kv, 64,  5,  512, 4, 4, true,  8.0f, n_threads) && ok;
+            ok = test_flash_attn_ext(type_kv, 64,  1, 2048, 4, 1, true,  8.0f, n_threads) && ok;
+        }
+    }
+
+    for (int n_threads : { 1, 2, 3, 4, 6, 8 }) {
+        ok = test_split("soft_max_4096",      build_soft_max_4096,      n_threads) && ok;
+        ok = test_split("soft_max_8192",      build_soft_max_8192,      n_threads) && ok;
+        ok = test_split("soft_max_alibi",     build_soft_max_alibi,     n_threads) && ok;
+        ok = test_split("soft_max_rows",      build_soft_max_rows,      n_threads) && ok;
+        ok = test_split("flash_attn_ext_gcd", build_flash_attn_ext_gcd, n_threads) && ok;
+    }
+
+    return ok ? 0 : 1;
+}
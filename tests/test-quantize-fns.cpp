@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include <string>
 #include <vector>
 
@@ -20,6 +21,8 @@ constexpr float MAX_QUANTIZATION_TOTAL_ERROR_3BITS = 0.0040f;
 constexpr float MAX_QUANTIZATION_TOTAL_ERROR_3BITS_XXS = 0.0050f;
 constexpr float MAX_DOT_PRODUCT_ERROR = 0.02f;
 constexpr float MAX_DOT_PRODUCT_ERROR_LOWBIT = 0.04f;
+constexpr float MAX_VEC_MAD_ERROR = 0.00001f;
+constexpr float MAX_MAT_MUL_ERROR = 0.00001f;
 
 static const char* RESULT_STR[] = {"ok", "FAILED"};
 
@@ -94,6 +97,128 @@ static float dot_product_error(
     return fabsf(result - dot_ref) / test_size;
 }
 
+// Max error of the fused dequantize + multiply-add against dequantizing the row first
+// n is a multiple of the block size, but not necessarily of the width of the SIMD implementations
+static float vec_mad_error(ggml_type_traits_t & qfns, size_t n, const float * test_data1, const float * test_data2) {
+    std::vector<uint8_t> tmp_q(2*n);
+    std::vector<float> tmp_x(n);
+    std::vector<float> result(test_data2, test_data2 + n);
+    std::vector<float> result_ref(test_data2, test_data2 + n);
+
+    const float v = 0.7f;
+
+    qfns.from_float(test_data1, tmp_q.data(), n);
+    qfns.to_float(tmp_q.data(), tmp_x.data(), n);
+
+    // same as ggml_vec_mad_f32
+    for (size_t i = 0; i < n; i++) {
+        result_ref[i] += tmp_x[i]*v;
+    }
+
+    qfns.vec_mad(n, result.data(), tmp_q.data(), v);
+
+    float max_error = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        max_error = fmaxf(max_error, fabsf(result[i] - result_ref[i]));
+    }
+
+    return max_error;
+}
+
+// Error of the interleaved gemv/gemm kernels against the dot products of the plain rows
+static float interleaved_mat_mul_error(
+    ggml_type type, ggml_type type_plain, size_t n_per_row, size_t nrows, const float * test_data1, const float * test_data2
+) {
+    auto qfns       = ggml_internal_get_type_traits(type);
+    auto qfns_plain = ggml_internal_get_type_traits(type_plain);
+    auto vdot       = ggml_internal_get_type_traits(qfns.vec_dot_type);
+
+    const int ncols = 4; // rows of the activations, as expected by gemm
+
+    std::vector<uint8_t> tmp_q1(ggml_row_size(type, n_per_row) * nrows);
+    std::vector<uint8_t> tmp_q1_plain(ggml_row_size(type_plain, n_per_row) * nrows);
+    std::vector<uint8_t> tmp_q2(ggml_row_size(qfns.vec_dot_type, n_per_row) * ncols);
+    std::vector<uint8_t> tmp_q2_mat(ggml_row_size(qfns.vec_dot_type, n_per_row) * ncols);
+
+    ggml_quantize_chunk(type,       test_data1, tmp_q1.data(),       0, nrows, n_per_row, nullptr);
+    ggml_quantize_chunk(type_plain, test_data1, tmp_q1_plain.data(), 0, nrows, n_per_row, nullptr);
+
+    const size_t row_size2 = ggml_row_size(qfns.vec_dot_type, n_per_row);
+    for (int j = 0; j < ncols; j++) {
+        vdot.from_float(test_data2 + j*n_per_row, tmp_q2.data() + j*row_size2, n_per_row);
+    }
+    vdot.from_float_to_mat(test_data2, tmp_q2_mat.data(), ncols, n_per_row, qfns.blck_size_interleave);
+
+    std::vector<float> result_ref(ncols * nrows);
+    for (int j = 0; j < ncols; j++) {
+        for (size_t i = 0; i < nrows; i++) {
+            qfns_plain.vec_dot(n_per_row, &result_ref[j*nrows + i], 0,
+                tmp_q1_plain.data() + i*ggml_row_size(type_plain, n_per_row), 0, tmp_q2.data() + j*row_size2, 0, 1);
+        }
+    }
+
+    std::vector<float> result_gemv(nrows, INFINITY);
+    std::vector<float> result_gemm(ncols * nrows, INFINITY);
+    qfns.gemv(n_per_row, result_gemv.data(), nrows, tmp_q1.data(), tmp_q2.data(), 1, nrows);
+    qfns.gemm(n_per_row, result_gemm.data(), nrows, tmp_q1.data(), tmp_q2_mat.data(), ncols, nrows);
+
+    // the activations of gemm are quantized by a different routine, so allow for rounding differences
+    float max_error = 0.0f;
+    for (size_t i = 0; i < nrows; i++) {
+        max_error = fmaxf(max_error, fabsf(result_gemv[i] - result_ref[i]));
+    }
+    for (size_t i = 0; i < ncols * nrows; i++) {
+        max_error = fmaxf(max_error, fabsf(result_gemm[i] - result_ref[i]));
+    }
+
+    return max_error / n_per_row;
+}
+
+// Error of ggml_mul_mat against the dot products of the rows (m rows of k elements times n rows of k elements)
+// with GGML_LLAMAFILE the K-quants take the tinyBLAS path, k is a multiple of the super-block size
+static float mat_mul_error(ggml_type type, int64_t k, int64_t m, int64_t n, int n_threads, const float * test_data1, const float * test_data2) {
+    auto qfns = ggml_internal_get_type_traits(type);
+    auto vdot = ggml_internal_get_type_traits(qfns.vec_dot_type);
+
+    struct ggml_init_params params = {
+        /* .mem_size   = */ ggml_row_size(type, k)*m + ggml_row_size(GGML_TYPE_F32, k)*(n + m) + 4*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * a = ggml_new_tensor_2d(ctx, type,          k, m);
+    ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, k, n);
+
+    ggml_quantize_chunk(type, test_data1, a->data, 0, m, k, nullptr);
+    memcpy(b->data, test_data2, ggml_nbytes(b));
+
+    ggml_tensor * c = ggml_mul_mat(ctx, a, b);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, c);
+    ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+
+    std::vector<uint8_t> tmp_q2(ggml_row_size(qfns.vec_dot_type, k));
+
+    float max_error = 0.0f;
+    for (int64_t j = 0; j < n; j++) {
+        vdot.from_float(test_data2 + j*k, tmp_q2.data(), k);
+
+        for (int64_t i = 0; i < m; i++) {
+            float result_ref = INFINITY;
+            qfns.vec_dot(k, &result_ref, 0, (const char *) a->data + i*a->nb[1], 0, tmp_q2.data(), 0, 1);
+
+            const float result = ((const float *) c->data)[j*m + i];
+            max_error = fmaxf(max_error, fabsf(result - result_ref));
+        }
+    }
+
+    ggml_free(ctx);
+
+    return max_error / k;
+}
+
 int main(int argc, char * argv[]) {
     bool verbose = false;
     const size_t test_size = 32 * 128;
@@ -173,6 +298,56 @@ int main(int argc, char * argv[]) {
                 printf("%5s dot product error:              %s (%f)\n", ggml_type_name(type), RESULT_STR[failed], vec_dot_error);
             }
         }
+
+        if (qfns.vec_mad) {
+            for (size_t n : { qfns.blck_size, 3*qfns.blck_size, 5*qfns.blck_size, (int64_t) test_size }) {
+                const float vec_mad_err = vec_mad_error(qfns, n, test_data.data(), test_data2.data());
+                failed = !(vec_mad_err < MAX_VEC_MAD_ERROR);
+                num_failed += failed;
+                if (failed || verbose) {
+                    printf("%5s vec_mad error (n = %4zu):        %s (%f)\n", ggml_type_name(type), n, RESULT_STR[failed], vec_mad_err);
+                }
+            }
+        }
+    }
+
+    // the interleaved layout used by this CPU
+    {
+        const size_t n_per_row = 256;
+        const size_t nrows     = test_size / n_per_row;
+
+        ggml_tensor * t = ggml_new_tensor_2d(ctx, GGML_TYPE_Q4_0, n_per_row, nrows);
+        const ggml_type type = ggml_repack_get_optimal_type(t);
+
+        if (type != t->type) {
+            printf("Testing %s gemv/gemm\n", ggml_type_name(type));
+
+            const float mat_mul_error = interleaved_mat_mul_error(type, t->type, n_per_row, nrows, test_data.data(), test_data2.data());
+            failed = !(mat_mul_error < MAX_DOT_PRODUCT_ERROR);
+            num_failed += failed;
+            if (failed || verbose) {
+                printf("%5s gemv/gemm error:                %s (%f)\n", ggml_type_name(type), RESULT_STR[failed], mat_mul_error);
+            }
+        }
+    }
+
+    // the K-quants with tinyBLAS kernels, on whole tiles (m and n multiples of 4) and on the edges
+    for (ggml_type type : { GGML_TYPE_Q4_K, GGML_TYPE_Q5_K, GGML_TYPE_Q6_K, GGML_TYPE_IQ4_XS }) {
+        const int64_t k = 2*ggml_blck_size(type); // 2 super-blocks
+        const int64_t m = test_size / k;
+
+        printf("Testing %s mul_mat\n", ggml_type_name(type));
+
+        for (int64_t n : { m, m - 3 }) {
+            for (int n_threads : { 1, 3 }) {
+                const float mat_mul_err = mat_mul_error(type, k, m, n, n_threads, test_data.data(), test_data2.data());
+                failed = !(mat_mul_err < MAX_MAT_MUL_ERROR);
+                num_failed += failed;
+                if (failed || verbose) {
+                    printf("%5s mul_mat error (n = %d, %d threads): %s (%f)\n", ggml_type_name(type), (int) n, n_threads, RESULT_STR[failed], mat_mul_err);
+                }
+            }
+        }
     }
 
     if (num_failed || verbose) {